@@ -0,0 +1,642 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "draw_list.h"
+#include "sdf.h"
+#include "utf8.h"
+#include "utils.h"
+
+// NOTE: glyph atlas keeps every glyph rasterized once per font size.
+// Glyphs are rasterized in white and tinted with vertex colors,
+// text is drawn as batched quads with SDL_RenderGeometry, one call per page.
+// Layout only needs glyph metrics, glyphs are rasterized when first drawn.
+// Pages are capped by a byte budget, least recently used page is reused
+// when the budget is reached.
+// Atlases created from a SdfFont don't rasterize with the font, glyphs are
+// converted from the distance fields, so zooming doesn't rasterize glyphs.
+// Pages keep a CPU copy, so an atlas that isn't drawn with can release
+// its textures and upload the pages again when it's used (see atlas_unload).
+// The CPU copy is also what glyphs are blended from when drawing
+// into a framebuffer.
+
+#define ATLAS_PAGE_SIZE 1024
+#define ATLAS_GLYPH_PADDING 1
+#define ATLAS_ASCII_COUNT 128
+#define ATLAS_GLYPHS_INITIAL_CAP 256 // NOTE: must be power of 2
+#define ATLAS_REPLACEMENT_CHAR 0xFFFD
+#define ATLAS_PAGE_BYTES (ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE * 4)
+
+long ATLAS_BUDGET_BYTES = 8 * ATLAS_PAGE_BYTES; // NOTE: 32MiB
+
+// NOTE: fonts can be used from different threads, but opening and closing
+// them isn't thread safe, so it's guarded when there are multiple threads
+SDL_mutex *ATLAS_FONT_LOCK = NULL;
+
+int ATLAS_IDS = 0; // NOTE: atlases get unique ids, addresses are reused
+
+typedef struct {
+  int codepoint;
+  int page; // NOTE: -1 if there is nothing to draw, eg space
+  SDL_Rect rect;
+  int advance;
+  bool used;
+  bool rasterized;
+} Glyph;
+
+typedef struct {
+  SDL_Vertex *vertices;
+  int vertices_count;
+  int vertices_cap;
+  int *indices;
+  int indices_count;
+  int indices_cap;
+} GlyphBatch;
+
+typedef struct {
+  SDL_Texture *texture;
+  SDL_Surface *surface; // NOTE: CPU copy of the page
+  GlyphBatch batch;
+  Uint64 last_used_frame;
+} AtlasPage;
+
+typedef struct {
+  int id;
+  TTF_Font *font; // NOTE: NULL if glyphs come from sdf
+  SdfFont *sdf;   // NOTE: borrowed
+  int font_size;
+  int line_height;
+  int monospace_advance; // NOTE: 0 if printable ascii advances differ
+  //
+  AtlasPage *pages;
+  int pages_count;
+  int current_page; // NOTE: page where new glyphs are packed
+  int pen_x;
+  int pen_y;
+  int shelf_height;
+  //
+  Glyph ascii[ATLAS_ASCII_COUNT];
+  Glyph *glyphs; // NOTE: non-ascii glyphs, open addressing
+  int glyphs_count;
+  int glyphs_cap;
+  //
+  Uint64 frame;
+  long evictions;
+  bool unloaded; // NOTE: page textures were released, see atlas_unload
+  long reloads;
+  bool reload_failed;
+  Uint64 reload_failed_frame;
+} GlyphAtlas;
+
+// atlas_page_texture uploads the page surface into a new texture
+// allocs memory
+SDL_Texture *atlas_page_texture(SDL_Renderer *renderer,
+                                SDL_Surface *surface) {
+  SDL_Texture *texture =
+      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_STATIC, ATLAS_PAGE_SIZE,
+                        ATLAS_PAGE_SIZE);
+  if (texture == NULL) {
+    fprintf(stderr, "failed to create atlas page texture: %s\n",
+            SDL_GetError());
+    return NULL;
+  }
+  SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+  /*
+    worst to best scaled font
+    SDL_ScaleModeNearest < nearest pixel sampling>
+    SDL_ScaleModeLinear < linear filtering>
+    SDL_ScaleModeBest < anisotropic filtering>
+  */
+  SDL_SetTextureScaleMode(texture, SDL_ScaleModeBest);
+  SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch);
+  return texture;
+}
+
+bool atlas_add_page(GlyphAtlas *atlas, SDL_Renderer *renderer) {
+  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(
+      0, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, 32, SDL_PIXELFORMAT_ARGB8888);
+  if (surface == NULL) {
+    fprintf(stderr, "failed to create atlas page surface: %s\n",
+            SDL_GetError());
+    return false;
+  }
+  SDL_Texture *texture = atlas_page_texture(renderer, surface);
+  if (texture == NULL) {
+    SDL_FreeSurface(surface);
+    return false;
+  }
+
+  atlas->pages =
+      realloc(atlas->pages, (atlas->pages_count + 1) * sizeof(AtlasPage));
+  atlas->pages[atlas->pages_count] = (AtlasPage){0};
+  atlas->pages[atlas->pages_count].texture = texture;
+  atlas->pages[atlas->pages_count].surface = surface;
+  atlas->pages[atlas->pages_count].last_used_frame = atlas->frame;
+  atlas->current_page = atlas->pages_count;
+  atlas->pages_count += 1;
+
+  atlas->pen_x = 0;
+  atlas->pen_y = 0;
+  atlas->shelf_height = 0;
+  return true;
+}
+
+void atlas_evict_glyph(Glyph *glyph, int page) {
+  if (glyph->used && glyph->rasterized && glyph->page == page) {
+    glyph->rasterized = false;
+    glyph->page = -1;
+  }
+}
+
+// atlas_lru_page returns the least recently used page,
+// pages used in the current frame are never returned
+int atlas_lru_page(GlyphAtlas *atlas) {
+  int lru = -1;
+  for (int i = 0; i < atlas->pages_count; i += 1) {
+    if (atlas->pages[i].last_used_frame == atlas->frame) {
+      continue;
+    }
+    if (lru < 0 ||
+        atlas->pages[i].last_used_frame < atlas->pages[lru].last_used_frame) {
+      lru = i;
+    }
+  }
+  return lru;
+}
+
+// atlas_reuse_page evicts all glyphs from the page and starts packing into it
+void atlas_reuse_page(GlyphAtlas *atlas, int page) {
+  for (int i = 0; i < ATLAS_ASCII_COUNT; i += 1) {
+    atlas_evict_glyph(&atlas->ascii[i], page);
+  }
+  for (int i = 0; i < atlas->glyphs_cap; i += 1) {
+    atlas_evict_glyph(&atlas->glyphs[i], page);
+  }
+  SDL_Surface *surface = atlas->pages[page].surface;
+  memset(surface->pixels, 0, surface->h * surface->pitch);
+  SDL_UpdateTexture(atlas->pages[page].texture, NULL, surface->pixels,
+                    surface->pitch);
+  atlas->pages[page].last_used_frame = atlas->frame;
+  atlas->evictions += 1;
+
+  atlas->current_page = page;
+  atlas->pen_x = 0;
+  atlas->pen_y = 0;
+  atlas->shelf_height = 0;
+}
+
+// atlas_next_page adds a new page, or reuses the least recently used one
+// if adding would exceed ATLAS_BUDGET_BYTES
+bool atlas_next_page(GlyphAtlas *atlas, SDL_Renderer *renderer) {
+  int lru = atlas_lru_page(atlas);
+  if (lru >= 0 &&
+      (long)(atlas->pages_count + 1) * ATLAS_PAGE_BYTES > ATLAS_BUDGET_BYTES) {
+    atlas_reuse_page(atlas, lru);
+    return true;
+  }
+  return atlas_add_page(atlas, renderer);
+}
+
+// atlas_measure fills in the glyph advance without rasterizing it
+void atlas_measure(GlyphAtlas *atlas, Glyph *glyph) {
+  int advance = 0;
+  if (atlas->font != NULL) {
+    TTF_GlyphMetrics32(atlas->font, glyph->codepoint, NULL, NULL, NULL, NULL,
+                       &advance);
+  } else {
+    advance = sdf_glyph_advance(atlas->sdf, glyph->codepoint,
+                                atlas->line_height);
+  }
+  glyph->advance = advance;
+  glyph->page = -1;
+}
+
+// atlas_is_blank returns true for codepoints that have nothing to draw
+bool atlas_is_blank(int codepoint) {
+  return codepoint == ' ' || codepoint == '\t' || codepoint == '\n';
+}
+
+// atlas_pack packs the rendered glyph surface into the current page,
+// next page is taken when the current one is full.
+// NOTE: glyph is rasterized after this, even if surface is NULL
+// frees memory
+void atlas_pack(GlyphAtlas *atlas, SDL_Renderer *renderer, Glyph *glyph,
+                SDL_Surface *glyph_surface) {
+  glyph->rasterized = true;
+  glyph->page = -1;
+  if (glyph_surface == NULL) {
+    return;
+  }
+
+  int w = glyph_surface->w;
+  int h = glyph_surface->h;
+  if (atlas->pen_x + w + ATLAS_GLYPH_PADDING > ATLAS_PAGE_SIZE) {
+    atlas->pen_x = 0;
+    atlas->pen_y += atlas->shelf_height + ATLAS_GLYPH_PADDING;
+    atlas->shelf_height = 0;
+  }
+  if (atlas->pages_count == 0 ||
+      atlas->pen_y + h + ATLAS_GLYPH_PADDING > ATLAS_PAGE_SIZE) {
+    if (!atlas_next_page(atlas, renderer)) {
+      SDL_FreeSurface(glyph_surface);
+      return;
+    }
+  }
+
+  AtlasPage *page = &atlas->pages[atlas->current_page];
+  SDL_Rect rect = {atlas->pen_x, atlas->pen_y, w, h};
+  SDL_SetSurfaceBlendMode(glyph_surface, SDL_BLENDMODE_NONE);
+  SDL_BlitSurface(glyph_surface, NULL, page->surface, &rect);
+  SDL_UpdateTexture(page->texture, &rect,
+                    (Uint8 *)page->surface->pixels +
+                        rect.y * page->surface->pitch + rect.x * 4,
+                    page->surface->pitch);
+  SDL_FreeSurface(glyph_surface);
+
+  glyph->page = atlas->current_page;
+  glyph->rect = rect;
+  atlas->pen_x += w + ATLAS_GLYPH_PADDING;
+  atlas->shelf_height = gt(atlas->shelf_height, h);
+}
+
+// atlas_render_glyph renders codepoint in white with font,
+// that is opened at the font size of a font atlas.
+// returns NULL if there is nothing to draw
+// allocs memory
+SDL_Surface *atlas_render_glyph(TTF_Font *font, int codepoint) {
+  SDL_Surface *glyph_surface = TTF_RenderGlyph32_Blended(
+      font, codepoint, (SDL_Color){255, 255, 255, 255});
+  if (glyph_surface == NULL) {
+    fprintf(stderr, "failed to create glyph surface: %s\n", TTF_GetError());
+  }
+  return glyph_surface;
+}
+
+// atlas_rasterize renders the glyph and packs it into the atlas
+void atlas_rasterize(GlyphAtlas *atlas, SDL_Renderer *renderer,
+                     Glyph *glyph) {
+  SDL_Surface *glyph_surface = NULL;
+  if (atlas_is_blank(glyph->codepoint)) {
+    // NOTE: nothing to pack
+  } else if (atlas->font != NULL) {
+    glyph_surface = atlas_render_glyph(atlas->font, glyph->codepoint);
+  } else {
+    glyph_surface =
+        sdf_glyph_surface(atlas->sdf, glyph->codepoint, atlas->line_height);
+  }
+  atlas_pack(atlas, renderer, glyph, glyph_surface);
+}
+
+Glyph *atlas_find_slot(Glyph *glyphs, int glyphs_cap, int codepoint) {
+  unsigned int i = ((unsigned int)codepoint * 2654435761u) & (glyphs_cap - 1);
+  while (glyphs[i].used && glyphs[i].codepoint != codepoint) {
+    i = (i + 1) & (glyphs_cap - 1);
+  }
+  return &glyphs[i];
+}
+
+void atlas_grow(GlyphAtlas *atlas) {
+  int glyphs_cap = gt(2 * atlas->glyphs_cap, ATLAS_GLYPHS_INITIAL_CAP);
+  Glyph *glyphs = calloc(glyphs_cap, sizeof(Glyph));
+  for (int i = 0; i < atlas->glyphs_cap; i += 1) {
+    if (atlas->glyphs[i].used) {
+      *atlas_find_slot(glyphs, glyphs_cap, atlas->glyphs[i].codepoint) =
+          atlas->glyphs[i];
+    }
+  }
+  if (atlas->glyphs != NULL) {
+    free(atlas->glyphs);
+  }
+  atlas->glyphs = glyphs;
+  atlas->glyphs_cap = glyphs_cap;
+}
+
+// atlas_find_glyph returns the glyph for codepoint,
+// NULL if it wasn't measured yet
+Glyph *atlas_find_glyph(GlyphAtlas *atlas, int codepoint) {
+  Glyph *glyph = NULL;
+  if (0 <= codepoint && codepoint < ATLAS_ASCII_COUNT) {
+    glyph = &atlas->ascii[codepoint];
+  } else {
+    glyph = atlas_find_slot(atlas->glyphs, atlas->glyphs_cap, codepoint);
+  }
+  return glyph->used ? glyph : NULL;
+}
+
+// atlas_is_missing returns true if the glyph of codepoint has to be
+// rasterized before it's drawn
+bool atlas_is_missing(GlyphAtlas *atlas, int codepoint) {
+  if (atlas_is_blank(codepoint)) {
+    return false;
+  }
+  Glyph *glyph = atlas_find_glyph(atlas, codepoint);
+  return glyph == NULL || !glyph->rasterized;
+}
+
+// atlas_glyph_metrics returns the glyph for codepoint without rasterizing it.
+// NOTE: returned pointer is valid until the next atlas_glyph* call
+Glyph *atlas_glyph_metrics(GlyphAtlas *atlas, int codepoint) {
+  Glyph *glyph = NULL;
+  if (0 <= codepoint && codepoint < ATLAS_ASCII_COUNT) {
+    glyph = &atlas->ascii[codepoint];
+  } else {
+    if (4 * (atlas->glyphs_count + 1) > 3 * atlas->glyphs_cap) {
+      atlas_grow(atlas);
+    }
+    glyph = atlas_find_slot(atlas->glyphs, atlas->glyphs_cap, codepoint);
+    if (!glyph->used) {
+      atlas->glyphs_count += 1;
+    }
+  }
+  if (!glyph->used) {
+    glyph->used = true;
+    glyph->codepoint = codepoint;
+    atlas_measure(atlas, glyph);
+  }
+  return glyph;
+}
+
+// atlas_unload releases page textures, pages stay in CPU memory
+// and glyphs stay rasterized
+// frees memory
+void atlas_unload(GlyphAtlas *atlas) {
+  for (int i = 0; i < atlas->pages_count; i += 1) {
+    if (atlas->pages[i].texture != NULL) {
+      SDL_DestroyTexture(atlas->pages[i].texture);
+      atlas->pages[i].texture = NULL;
+    }
+  }
+  atlas->unloaded = true;
+}
+
+// atlas_reload uploads pages released by atlas_unload again.
+// NOTE: atlas stays unloaded if a page fails, so it's retried once
+// per frame
+// allocs memory
+void atlas_reload(GlyphAtlas *atlas, SDL_Renderer *renderer) {
+  if (atlas->reload_failed && atlas->reload_failed_frame == atlas->frame) {
+    return;
+  }
+  atlas->unloaded = false;
+  atlas->reload_failed = false;
+  for (int i = 0; i < atlas->pages_count; i += 1) {
+    if (atlas->pages[i].texture == NULL) {
+      atlas->pages[i].texture =
+          atlas_page_texture(renderer, atlas->pages[i].surface);
+    }
+    if (atlas->pages[i].texture == NULL) {
+      atlas->unloaded = true;
+      atlas->reload_failed = true;
+      atlas->reload_failed_frame = atlas->frame;
+    }
+  }
+  atlas->reloads += 1;
+}
+
+// atlas_glyph returns the glyph for codepoint, rasterizing it if needed.
+// NOTE: returned pointer is valid until the next atlas_glyph* call
+Glyph *atlas_glyph(GlyphAtlas *atlas, SDL_Renderer *renderer,
+                   int codepoint) {
+  if (atlas->unloaded) {
+    atlas_reload(atlas, renderer);
+  }
+  Glyph *glyph = atlas_glyph_metrics(atlas, codepoint);
+  if (!glyph->rasterized) {
+    atlas_rasterize(atlas, renderer, glyph);
+  }
+  return glyph;
+}
+
+// atlas_detect_monospace measures printable ascii glyphs once,
+// layout of monospace fonts doesn't need per glyph advances
+void atlas_detect_monospace(GlyphAtlas *atlas) {
+  int advance = atlas_glyph_metrics(atlas, ' ')->advance;
+  for (int codepoint = ' ' + 1; codepoint <= '~'; codepoint += 1) {
+    if (atlas_glyph_metrics(atlas, codepoint)->advance != advance) {
+      atlas->monospace_advance = 0;
+      return;
+    }
+  }
+  atlas->monospace_advance = advance;
+}
+
+// allocs memory
+GlyphAtlas *atlas_create(const char *font_path, int font_size) {
+  if (ATLAS_FONT_LOCK != NULL) {
+    SDL_LockMutex(ATLAS_FONT_LOCK);
+  }
+  TTF_Font *font = TTF_OpenFont(font_path, font_size);
+  if (ATLAS_FONT_LOCK != NULL) {
+    SDL_UnlockMutex(ATLAS_FONT_LOCK);
+  }
+  if (font == NULL) {
+    fprintf(stderr, "failed to load atlas font: %s\n", TTF_GetError());
+    return NULL;
+  }
+  GlyphAtlas *atlas = calloc(1, sizeof(GlyphAtlas));
+  ATLAS_IDS += 1;
+  atlas->id = ATLAS_IDS;
+  atlas->font = font;
+  atlas->font_size = font_size;
+  atlas->line_height = TTF_FontHeight(font);
+  atlas_grow(atlas);
+  atlas_detect_monospace(atlas);
+  return atlas;
+}
+
+// atlas_create_sdf creates an atlas that converts glyphs from sdf,
+// scaled to line_height
+// allocs memory
+GlyphAtlas *atlas_create_sdf(SdfFont *sdf, int font_size, int line_height) {
+  GlyphAtlas *atlas = calloc(1, sizeof(GlyphAtlas));
+  ATLAS_IDS += 1;
+  atlas->id = ATLAS_IDS;
+  atlas->sdf = sdf;
+  atlas->font_size = font_size;
+  atlas->line_height = line_height;
+  atlas_grow(atlas);
+  atlas_detect_monospace(atlas);
+  return atlas;
+}
+
+// frees memory
+void atlas_free(GlyphAtlas *atlas) {
+  if (atlas == NULL) {
+    return;
+  }
+  for (int i = 0; i < atlas->pages_count; i += 1) {
+    if (atlas->pages[i].texture != NULL) {
+      SDL_DestroyTexture(atlas->pages[i].texture);
+    }
+    SDL_FreeSurface(atlas->pages[i].surface);
+    if (atlas->pages[i].batch.vertices != NULL) {
+      free(atlas->pages[i].batch.vertices);
+    }
+    if (atlas->pages[i].batch.indices != NULL) {
+      free(atlas->pages[i].batch.indices);
+    }
+  }
+  if (atlas->pages != NULL) {
+    free(atlas->pages);
+  }
+  if (atlas->glyphs != NULL) {
+    free(atlas->glyphs);
+  }
+  if (atlas->font != NULL) {
+    if (ATLAS_FONT_LOCK != NULL) {
+      SDL_LockMutex(ATLAS_FONT_LOCK);
+    }
+    TTF_CloseFont(atlas->font);
+    if (ATLAS_FONT_LOCK != NULL) {
+      SDL_UnlockMutex(ATLAS_FONT_LOCK);
+    }
+  }
+  free(atlas);
+}
+
+// atlas_glyph_quad sets vertices of the quad for the glyph at dst
+void atlas_glyph_quad(Glyph *glyph, SDL_FRect dst, SDL_Color color,
+                      SDL_Vertex *vertices) {
+  float u0 = (float)glyph->rect.x / ATLAS_PAGE_SIZE;
+  float v0 = (float)glyph->rect.y / ATLAS_PAGE_SIZE;
+  float u1 = (float)(glyph->rect.x + glyph->rect.w) / ATLAS_PAGE_SIZE;
+  float v1 = (float)(glyph->rect.y + glyph->rect.h) / ATLAS_PAGE_SIZE;
+
+  vertices[0] = (SDL_Vertex){{dst.x, dst.y}, color, {u0, v0}};
+  vertices[1] = (SDL_Vertex){{dst.x + dst.w, dst.y}, color, {u1, v0}};
+  vertices[2] =
+      (SDL_Vertex){{dst.x + dst.w, dst.y + dst.h}, color, {u1, v1}};
+  vertices[3] = (SDL_Vertex){{dst.x, dst.y + dst.h}, color, {u0, v1}};
+}
+
+// atlas_batch_quad queues a quad of the page, moved by dx, dy
+void atlas_batch_quad(GlyphAtlas *atlas, int page, SDL_Vertex *vertices,
+                      float dx, float dy) {
+  if (page < 0) {
+    return;
+  }
+  atlas->pages[page].last_used_frame = atlas->frame;
+  GlyphBatch *batch = &atlas->pages[page].batch;
+  if (batch->vertices_count + 4 > batch->vertices_cap) {
+    batch->vertices_cap = gt(2 * batch->vertices_cap, 1024);
+    batch->vertices =
+        realloc(batch->vertices, batch->vertices_cap * sizeof(SDL_Vertex));
+    batch->indices_cap = batch->vertices_cap / 4 * 6;
+    batch->indices = realloc(batch->indices, batch->indices_cap * sizeof(int));
+  }
+
+  int v = batch->vertices_count;
+  for (int k = 0; k < 4; k += 1) {
+    batch->vertices[v + k] = vertices[k];
+    batch->vertices[v + k].position.x += dx;
+    batch->vertices[v + k].position.y += dy;
+  }
+
+  int i = batch->indices_count;
+  batch->indices[i + 0] = v + 0;
+  batch->indices[i + 1] = v + 1;
+  batch->indices[i + 2] = v + 2;
+  batch->indices[i + 3] = v + 0;
+  batch->indices[i + 4] = v + 2;
+  batch->indices[i + 5] = v + 3;
+
+  batch->vertices_count += 4;
+  batch->indices_count += 6;
+}
+
+// atlas_batch_glyph queues a quad for the glyph at dst
+void atlas_batch_glyph(GlyphAtlas *atlas, Glyph *glyph, SDL_FRect dst,
+                       SDL_Color color) {
+  SDL_Vertex vertices[4];
+  atlas_glyph_quad(glyph, dst, color, vertices);
+  atlas_batch_quad(atlas, glyph->page, vertices, 0, 0);
+}
+
+// NOTE: pages used since atlas_begin_frame are not evicted
+void atlas_begin_frame(GlyphAtlas *atlas) {
+  if (atlas != NULL) {
+    atlas->frame += 1;
+  }
+}
+
+// atlas_blend_batch blends quads queued for the page into the framebuffer
+void atlas_blend_batch(GlyphAtlas *atlas, int page, Framebuffer *fb) {
+  GlyphBatch *batch = &atlas->pages[page].batch;
+  for (int v = 0; v + 4 <= batch->vertices_count; v += 4) {
+    // NOTE: quads are axis aligned, see atlas_glyph_quad
+    SDL_Vertex *top_left = &batch->vertices[v];
+    SDL_Vertex *bottom_right = &batch->vertices[v + 2];
+    SDL_Rect src = {
+        lrintf(top_left->tex_coord.x * ATLAS_PAGE_SIZE),
+        lrintf(top_left->tex_coord.y * ATLAS_PAGE_SIZE),
+        lrintf((bottom_right->tex_coord.x - top_left->tex_coord.x) *
+               ATLAS_PAGE_SIZE),
+        lrintf((bottom_right->tex_coord.y - top_left->tex_coord.y) *
+               ATLAS_PAGE_SIZE),
+    };
+    SDL_FRect dst = {top_left->position.x, top_left->position.y,
+                     bottom_right->position.x - top_left->position.x,
+                     bottom_right->position.y - top_left->position.y};
+    fb_blend_glyph(fb, atlas->pages[page].surface, src, dst,
+                   top_left->color);
+  }
+}
+
+// atlas_flush draws all queued quads, one draw call per page,
+// or blends them on the CPU if the draw list has a framebuffer,
+// and counts them in the draw list
+void atlas_flush(GlyphAtlas *atlas, SDL_Renderer *renderer, DrawList *list) {
+  if (atlas == NULL) {
+    return;
+  }
+  for (int i = 0; i < atlas->pages_count; i += 1) {
+    GlyphBatch *batch = &atlas->pages[i].batch;
+    if (batch->indices_count == 0) {
+      continue;
+    }
+    if (list->fb != NULL) {
+      atlas_blend_batch(atlas, i, list->fb);
+      draw_list_count(list, 0, batch->vertices_count / 4);
+      batch->vertices_count = 0;
+      batch->indices_count = 0;
+      continue;
+    }
+    if (atlas->pages[i].texture == NULL) {
+      // NOTE: page failed to upload, untextured quads would be boxes
+      batch->vertices_count = 0;
+      batch->indices_count = 0;
+      continue;
+    }
+    SDL_RenderGeometry(renderer, atlas->pages[i].texture, batch->vertices,
+                       batch->vertices_count, batch->indices,
+                       batch->indices_count);
+    draw_list_count(list, 1, batch->vertices_count / 4);
+    batch->vertices_count = 0;
+    batch->indices_count = 0;
+  }
+}
+
+void print_atlas_stats(GlyphAtlas *atlas, int textures_count) {
+  if (atlas == NULL) {
+    return;
+  }
+  int rasterized_count = 0;
+  for (int i = 0; i < ATLAS_ASCII_COUNT; i += 1) {
+    rasterized_count += atlas->ascii[i].rasterized;
+  }
+  for (int i = 0; i < atlas->glyphs_cap; i += 1) {
+    rasterized_count += atlas->glyphs[i].rasterized;
+  }
+  printf("[STATS]: glyph atlas: %d rasterized glyphs in %d textures "
+         "(%ld evictions, %ld byte budget), "
+         "instead of %d textures (one per token)\n",
+         rasterized_count, atlas->pages_count, atlas->evictions,
+         ATLAS_BUDGET_BYTES, textures_count);
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+#include "utils.h"
+
+// NOTE: draw list collects solid rects of a layer of the frame and draws
+// them with one SDL_RenderFillRects call per color, instead of setting
+// the draw color and filling every rect on its own.
+// Rects are grouped by color, in order of the first rect of each color,
+// so layers that have to cover each other are flushed separately.
+// Glyph quads are batched by the glyph atlas, one call per page,
+// and counted here too (see atlas_flush).
+// With a framebuffer, layers are drawn on the CPU instead and only
+// the primitives are counted.
+
+#define DRAW_LIST_INITIAL_CAP 16
+
+typedef struct {
+  long calls;      // NOTE: draw calls submitted to the renderer
+  long primitives; // NOTE: rects, quads and copies drawn by them
+} DrawCounts;
+
+typedef struct {
+  SDL_Color color;
+  SDL_Rect *rects;
+  int rects_count;
+  int rects_cap;
+} DrawRun;
+
+typedef struct {
+  DrawRun *runs; // NOTE: runs past runs_count keep their rects for reuse
+  int runs_count;
+  int runs_cap;
+  DrawCounts counts; // NOTE: of the frame being drawn
+  Framebuffer *fb;   // NOTE: NULL unless drawing on the CPU
+} DrawList;
+
+void draw_list_count(DrawList *list, long calls, long primitives) {
+  list->counts.calls += calls;
+  list->counts.primitives += primitives;
+}
+
+bool draw_color_equal(SDL_Color a, SDL_Color b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// draw_list_rect queues rect filled with color
+void draw_list_rect(DrawList *list, SDL_Rect rect, SDL_Color color) {
+  if (rect.w <= 0 || rect.h <= 0) {
+    return;
+  }
+  DrawRun *run = NULL;
+  for (int i = 0; i < list->runs_count; i += 1) {
+    if (draw_color_equal(list->runs[i].color, color)) {
+      run = &list->runs[i];
+      break;
+    }
+  }
+  if (run == NULL) {
+    if (list->runs_count == list->runs_cap) {
+      list->runs_cap = gt(2 * list->runs_cap, DRAW_LIST_INITIAL_CAP);
+      list->runs = realloc(list->runs, list->runs_cap * sizeof(DrawRun));
+      memset(list->runs + list->runs_count, 0,
+             (list->runs_cap - list->runs_count) * sizeof(DrawRun));
+    }
+    run = &list->runs[list->runs_count];
+    run->color = color;
+    run->rects_count = 0;
+    list->runs_count += 1;
+  }
+  if (run->rects_count == run->rects_cap) {
+    run->rects_cap = gt(2 * run->rects_cap, DRAW_LIST_INITIAL_CAP);
+    run->rects = realloc(run->rects, run->rects_cap * sizeof(SDL_Rect));
+  }
+  run->rects[run->rects_count] = rect;
+  run->rects_count += 1;
+}
+
+// draw_list_outline queues the outline of rect, one pixel wide
+void draw_list_outline(DrawList *list, SDL_Rect rect, SDL_Color color) {
+  draw_list_rect(list, (SDL_Rect){rect.x, rect.y, rect.w, 1}, color);
+  draw_list_rect(list, (SDL_Rect){rect.x, rect.y + rect.h - 1, rect.w, 1},
+                 color);
+  draw_list_rect(list, (SDL_Rect){rect.x, rect.y + 1, 1, rect.h - 2}, color);
+  draw_list_rect(list, (SDL_Rect){rect.x + rect.w - 1, rect.y + 1, 1,
+                                  rect.h - 2},
+                 color);
+}
+
+// draw_list_flush draws queued rects, one call per color,
+// and keeps the draw color of the renderer
+void draw_list_flush(DrawList *list, SDL_Renderer *renderer) {
+  if (list->runs_count == 0) {
+    return;
+  }
+  if (list->fb != NULL) {
+    for (int i = 0; i < list->runs_count; i += 1) {
+      DrawRun *run = &list->runs[i];
+      for (int j = 0; j < run->rects_count; j += 1) {
+        fb_fill_rect(list->fb, run->rects[j], run->color);
+      }
+      draw_list_count(list, 0, run->rects_count);
+      run->rects_count = 0;
+    }
+    list->runs_count = 0;
+    return;
+  }
+  SDL_Color prev = {0};
+  SDL_GetRenderDrawColor(renderer, (Uint8 *)&prev.r, (Uint8 *)&prev.g,
+                         (Uint8 *)&prev.b, (Uint8 *)&prev.a);
+  for (int i = 0; i < list->runs_count; i += 1) {
+    DrawRun *run = &list->runs[i];
+    SDL_SetRenderDrawColor(renderer, run->color.r, run->color.g, run->color.b,
+                           run->color.a);
+    SDL_RenderFillRects(renderer, run->rects, run->rects_count);
+    draw_list_count(list, 1, run->rects_count);
+    run->rects_count = 0;
+  }
+  list->runs_count = 0;
+  SDL_SetRenderDrawColor(renderer, prev.r, prev.g, prev.b, prev.a);
+}
+
+// frees memory
+void free_draw_list(DrawList *list) {
+  for (int i = 0; i < list->runs_cap; i += 1) {
+    if (list->runs[i].rects != NULL) {
+      free(list->runs[i].rects);
+    }
+  }
+  if (list->runs != NULL) {
+    free(list->runs);
+  }
+  *list = (DrawList){0};
+}
@@ -0,0 +1,458 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "color_scheme.h"
+#include "file_contents.h"
+#include "utf8.h"
+#include "utils.h"
+
+// NOTE: fallback views are used for files that sniff_file doesn't consider
+// text. They skip tokenizing and per-token textures, and only read the rows
+// that are currently on screen.
+
+#define HEXDUMP_BYTES_PER_ROW 16
+#define CHUNK_WIDTH 256 // in bytes; long lines are split into rows of this
+#define FALLBACK_ROW_BUF_SIZE (4 * CHUNK_WIDTH + 1)
+#define FALLBACK_INDEX_BLOCK (1024 * 1024)
+#define FALLBACK_SCROLL_ROWS 3
+#define FALLBACK_PADDING 5
+#define FALLBACK_SCROLLBAR_WIDTH 15
+#define FALLBACK_FRAME_DELAY 16 // in milliseconds; ~60FPS
+#define FALLBACK_POLL_DELAY 1000 // in milliseconds; file is checked when idle
+#define FALLBACK_INDEX_BUDGET 8  // in milliseconds; of indexing per frame
+
+typedef struct {
+  enum FILE_KIND kind;
+  FILE *fptr;
+  long size;
+  //
+  // NOTE: chunked view only; start offset of each row, filled lazily
+  long *row_offsets;
+  long row_offsets_count;
+  long row_offsets_cap;
+  long scan_offset;
+  int scan_row_len;
+  bool indexed;
+  bool jump_to_end; // NOTE: indexing continues across frames, see Ctrl+E
+  //
+  // NOTE: bytes of the rows currently on screen
+  char *page;
+  long page_offset;
+  long page_len;
+  long page_cap;
+  //
+  long first_row;
+  int row_height;
+} FallbackView;
+
+void fallback_push_row(FallbackView *view, long offset) {
+  if (view->row_offsets_count == view->row_offsets_cap) {
+    view->row_offsets_cap = gt(2 * view->row_offsets_cap, 1024);
+    view->row_offsets =
+        realloc(view->row_offsets, view->row_offsets_cap * sizeof(long));
+  }
+  view->row_offsets[view->row_offsets_count] = offset;
+  view->row_offsets_count += 1;
+}
+
+// allocs memory
+FallbackView *fallback_open(char *filename, enum FILE_KIND kind,
+                            TTF_Font *font) {
+  FILE *fptr = fopen(filename, "r");
+  if (fptr == NULL) {
+    fprintf(stderr, "failed to open file '%s'\n", filename);
+    return NULL;
+  }
+  FallbackView *view = calloc(1, sizeof(FallbackView));
+  view->kind = kind;
+  view->fptr = fptr;
+  fseek(fptr, 0, SEEK_END);
+  view->size = ftell(fptr);
+  view->row_height = gt(TTF_FontHeight(font), 1);
+  view->page_offset = -1;
+  if (view->kind != FILE_KIND_BINARY) {
+    fallback_push_row(view, 0);
+  }
+  return view;
+}
+
+// frees memory
+void fallback_free(FallbackView *view) {
+  if (view == NULL) {
+    return;
+  }
+  if (view->fptr != NULL) {
+    fclose(view->fptr);
+  }
+  if (view->row_offsets != NULL) {
+    free(view->row_offsets);
+  }
+  if (view->page != NULL) {
+    free(view->page);
+  }
+  free(view);
+}
+
+// fallback_index_block scans the next block of the file for row starts.
+// Rows end at a newline or after CHUNK_WIDTH bytes, whichever comes first.
+// returns false when the whole file is indexed
+bool fallback_index_block(FallbackView *view, char *block) {
+  fseek(view->fptr, view->scan_offset, SEEK_SET);
+  long read_bytes =
+      fread(block, sizeof(char), FALLBACK_INDEX_BLOCK, view->fptr);
+  if (read_bytes <= 0) {
+    view->indexed = true;
+    return false;
+  }
+  for (long i = 0; i < read_bytes; i += 1) {
+    // NOTE: don't split utf8 sequences between rows
+    if (view->scan_row_len >= CHUNK_WIDTH &&
+        !is_utf8_continuation(block[i])) {
+      fallback_push_row(view, view->scan_offset + i);
+      view->scan_row_len = 0;
+    }
+    view->scan_row_len += 1;
+    if (block[i] == '\n') {
+      fallback_push_row(view, view->scan_offset + i + 1);
+      view->scan_row_len = 0;
+    }
+  }
+  view->scan_offset += read_bytes;
+  return true;
+}
+
+// fallback_index_until scans the file for row starts until the end
+// of given row is known
+void fallback_index_until(FallbackView *view, long row) {
+  if (view->kind == FILE_KIND_BINARY) {
+    return;
+  }
+  char *block = NULL;
+  while (!view->indexed && view->row_offsets_count <= row + 1) {
+    if (block == NULL) {
+      block = calloc(FALLBACK_INDEX_BLOCK, sizeof(char));
+    }
+    if (!fallback_index_block(view, block)) {
+      break;
+    }
+  }
+  if (block != NULL) {
+    free(block);
+  }
+}
+
+// fallback_index_step scans the file for row starts for at most
+// budget milliseconds, so indexing a large file doesn't block the window
+void fallback_index_step(FallbackView *view, Uint64 budget) {
+  if (view->kind == FILE_KIND_BINARY || view->indexed) {
+    return;
+  }
+  Uint64 start = SDL_GetTicks64();
+  char *block = calloc(FALLBACK_INDEX_BLOCK, sizeof(char));
+  while (SDL_GetTicks64() - start < budget) {
+    if (!fallback_index_block(view, block)) {
+      break;
+    }
+  }
+  free(block);
+}
+
+// NOTE: until the whole file is indexed, the chunked row count is estimated
+long fallback_rows_count(FallbackView *view) {
+  if (view->kind == FILE_KIND_BINARY) {
+    long count =
+        (view->size + HEXDUMP_BYTES_PER_ROW - 1) / HEXDUMP_BYTES_PER_ROW;
+    return count > 0 ? count : 1;
+  }
+  long count = view->row_offsets_count;
+  // NOTE: file ending with newline doesn't start a new row
+  if (view->indexed && count > 1 &&
+      view->row_offsets[count - 1] >= view->size) {
+    count -= 1;
+  }
+  if (!view->indexed && count < view->size / CHUNK_WIDTH + 1) {
+    count = view->size / CHUNK_WIDTH + 1;
+  }
+  return count;
+}
+
+void fallback_row_range(FallbackView *view, long row, long *start,
+                        long *end) {
+  if (view->kind == FILE_KIND_BINARY) {
+    *start = row * HEXDUMP_BYTES_PER_ROW;
+    *end = *start + HEXDUMP_BYTES_PER_ROW;
+  } else {
+    fallback_index_until(view, row);
+    if (row >= view->row_offsets_count) {
+      *start = view->size;
+      *end = view->size;
+      return;
+    }
+    *start = view->row_offsets[row];
+    *end = row + 1 < view->row_offsets_count ? view->row_offsets[row + 1]
+                                              : view->size;
+  }
+  *start = *start < view->size ? *start : view->size;
+  *end = *end < view->size ? *end : view->size;
+}
+
+// fallback_page_in reads the bytes of the given rows, if not already read
+void fallback_page_in(FallbackView *view, long first_row, long rows) {
+  long start = 0;
+  long end = 0;
+  long last_start = 0;
+  fallback_row_range(view, first_row, &start, &end);
+  fallback_row_range(view, first_row + rows - 1, &last_start, &end);
+
+  if (view->page_offset >= 0 && view->page_offset <= start &&
+      end <= view->page_offset + view->page_len) {
+    return;
+  }
+
+  long len = end - start;
+  if (len + 1 > view->page_cap) {
+    view->page_cap = len + 1;
+    view->page = realloc(view->page, view->page_cap);
+  }
+  fseek(view->fptr, start, SEEK_SET);
+  view->page_len = fread(view->page, sizeof(char), len, view->fptr);
+  view->page_offset = start;
+}
+
+// fallback_row_text formats given row into buf, which is expected to be
+// at least FALLBACK_ROW_BUF_SIZE long. Row must be paged in.
+void fallback_row_text(FallbackView *view, long row, char *buf) {
+  long start = 0;
+  long end = 0;
+  fallback_row_range(view, row, &start, &end);
+  char *bytes = view->page + (start - view->page_offset);
+  int len = end - start;
+  memset(buf, '\0', FALLBACK_ROW_BUF_SIZE);
+
+  if (view->kind == FILE_KIND_BINARY) {
+    int offset = snprintf(buf, FALLBACK_ROW_BUF_SIZE, "%08lx ", start);
+    for (int i = 0; i < HEXDUMP_BYTES_PER_ROW; i += 1) {
+      if (i % 8 == 0) {
+        buf[offset] = ' ';
+        offset += 1;
+      }
+      if (i < len) {
+        offset += snprintf(buf + offset, FALLBACK_ROW_BUF_SIZE - offset,
+                           "%02x ", (unsigned char)bytes[i]);
+      } else {
+        offset += snprintf(buf + offset, FALLBACK_ROW_BUF_SIZE - offset,
+                           "   ");
+      }
+    }
+    buf[offset] = '|';
+    offset += 1;
+    for (int i = 0; i < len; i += 1) {
+      char c = bytes[i];
+      buf[offset] = (' ' <= c && c <= '~') ? c : '.';
+      offset += 1;
+    }
+    buf[offset] = '|';
+    return;
+  }
+
+  int offset = 0;
+  for (int i = 0; i < len && offset < FALLBACK_ROW_BUF_SIZE - 1; i += 1) {
+    unsigned char c = bytes[i];
+    if (c == '\n') {
+      break;
+    }
+    // NOTE: keep utf8 bytes, replace control chars
+    buf[offset] = (c < ' ' || c == 0x7F) ? ' ' : c;
+    offset += 1;
+  }
+}
+
+void fallback_render(SDL_Renderer *renderer, TTF_Font *font,
+                     FallbackView *view, int window_height) {
+  long rows_count = fallback_rows_count(view);
+  long visible_rows = window_height / view->row_height + 1;
+  if (view->first_row > rows_count - 1) {
+    view->first_row = rows_count - 1;
+  }
+  if (view->first_row < 0) {
+    view->first_row = 0;
+  }
+  long last_row = view->first_row + visible_rows < rows_count
+                      ? view->first_row + visible_rows
+                      : rows_count;
+
+  SDL_RenderClear(renderer);
+
+  if (view->first_row < last_row) {
+    fallback_page_in(view, view->first_row, last_row - view->first_row);
+  }
+
+  char buf[FALLBACK_ROW_BUF_SIZE] = {0};
+  for (long row = view->first_row; row < last_row; row += 1) {
+    fallback_row_text(view, row, buf);
+    if (buf[0] == '\0') {
+      continue;
+    }
+    SDL_Surface *row_surface =
+        TTF_RenderUTF8_Solid(font, buf, color_scheme->fg);
+    if (row_surface == NULL) {
+      fprintf(stderr, "failed to create row surface: %s\n", TTF_GetError());
+      continue;
+    }
+    SDL_Texture *row_texture =
+        SDL_CreateTextureFromSurface(renderer, row_surface);
+    if (row_texture == NULL) {
+      fprintf(stderr, "failed to create row texture: %s\n", SDL_GetError());
+      SDL_FreeSurface(row_surface);
+      continue;
+    }
+    SDL_Rect row_rect = {
+        FALLBACK_SCROLLBAR_WIDTH + FALLBACK_PADDING,
+        FALLBACK_PADDING + (row - view->first_row) * view->row_height,
+        row_surface->w, row_surface->h};
+    SDL_RenderCopy(renderer, row_texture, NULL, &row_rect);
+    SDL_DestroyTexture(row_texture);
+    SDL_FreeSurface(row_surface);
+  }
+
+  // NOTE: vertical scrollbar
+  SDL_Color prev = {0};
+  SDL_GetRenderDrawColor(renderer, (Uint8 *)&prev.r, (Uint8 *)&prev.g,
+                         (Uint8 *)&prev.b, (Uint8 *)&prev.a);
+  SDL_Rect scrollbar_bg_rect = {0, 0, FALLBACK_SCROLLBAR_WIDTH,
+                                window_height};
+  SDL_SetRenderDrawColor(
+      renderer, color_scheme->scrollbar_bg.r, color_scheme->scrollbar_bg.g,
+      color_scheme->scrollbar_bg.b, color_scheme->scrollbar_bg.a);
+  SDL_RenderFillRect(renderer, &scrollbar_bg_rect);
+  SDL_Rect scrollbar_fg_rect = {
+      0, (int)((double)window_height * view->first_row / rows_count),
+      FALLBACK_SCROLLBAR_WIDTH,
+      gt((int)((double)window_height * visible_rows / rows_count), 1)};
+  SDL_SetRenderDrawColor(
+      renderer, color_scheme->scrollbar_fg.r, color_scheme->scrollbar_fg.g,
+      color_scheme->scrollbar_fg.b, color_scheme->scrollbar_fg.a);
+  SDL_RenderFillRect(renderer, &scrollbar_fg_rect);
+  SDL_SetRenderDrawColor(renderer, prev.r, prev.g, prev.b, prev.a);
+
+  SDL_RenderPresent(renderer);
+}
+
+// fallback_loop shows a hexdump of binary files or a chunked plain view
+// of files with extremely long lines.
+int fallback_loop(SDL_Window *window, SDL_Renderer *renderer, TTF_Font *font,
+                  char *filename, enum FILE_KIND kind) {
+
+  FallbackView *view = fallback_open(filename, kind, font);
+  if (view == NULL) {
+    return EXIT_FAILURE;
+  }
+  time_t last_modified = get_last_modified(filename);
+
+  int window_height = 0;
+  (void)SDL_GetWindowSize(window, NULL, &window_height);
+  fallback_render(renderer, font, view, window_height);
+
+  bool keep_window_open = true;
+  while (keep_window_open) {
+    Uint64 start = SDL_GetTicks64();
+    bool needs_render = false;
+
+    SDL_Event sdl_event = {0};
+    while (SDL_PollEvent(&sdl_event) > 0) {
+      long visible_rows = window_height / view->row_height;
+      needs_render = true;
+
+      if (sdl_event.type == SDL_QUIT ||
+          (sdl_event.type == SDL_KEYDOWN &&
+           sdl_event.key.state == SDL_PRESSED &&
+           sdl_event.key.keysym.sym == SDLK_q)) {
+        keep_window_open = false;
+        break;
+      } else if (sdl_event.type == SDL_MOUSEWHEEL && sdl_event.wheel.y != 0) {
+        view->first_row -= FALLBACK_SCROLL_ROWS * sdl_event.wheel.y;
+        view->jump_to_end = false;
+      } else if (sdl_event.type == SDL_KEYDOWN &&
+                 sdl_event.key.state == SDL_PRESSED &&
+                 sdl_event.key.keysym.mod & KMOD_CTRL) {
+        switch (sdl_event.key.keysym.sym) {
+        case SDLK_d:
+          view->first_row += visible_rows / 2;
+          view->jump_to_end = false;
+          break;
+        case SDLK_u:
+          view->first_row -= visible_rows / 2;
+          view->jump_to_end = false;
+          break;
+        case SDLK_a:
+          view->first_row = 0;
+          view->jump_to_end = false;
+          break;
+        case SDLK_e:
+          // NOTE: the whole file needs to be indexed to know the last row,
+          // it's indexed a bit every frame until then
+          view->jump_to_end = true;
+          break;
+        }
+      } else if (sdl_event.type == SDL_WINDOWEVENT &&
+                 sdl_event.window.event == SDL_WINDOWEVENT_RESIZED) {
+        (void)SDL_GetWindowSize(window, NULL, &window_height);
+      }
+    }
+    if (!keep_window_open) {
+      break;
+    }
+
+    if (view->jump_to_end) {
+      fallback_index_step(view, FALLBACK_INDEX_BUDGET);
+      if (view->indexed || view->kind == FILE_KIND_BINARY) {
+        view->first_row =
+            fallback_rows_count(view) - window_height / view->row_height;
+        view->jump_to_end = false;
+        needs_render = true;
+      }
+    }
+
+    if (_is_updated(filename, &last_modified)) {
+      last_modified = get_last_modified(filename);
+      long first_row = view->first_row;
+      bool jump_to_end = view->jump_to_end;
+      enum FILE_KIND new_kind = sniff_file(filename);
+      fallback_free(view);
+      // NOTE: text files are shown in the chunked view until reopened
+      if (new_kind == FILE_KIND_TEXT) {
+        new_kind = FILE_KIND_LONG_LINES;
+      }
+      view = fallback_open(filename, new_kind, font);
+      if (view == NULL) {
+        return EXIT_FAILURE;
+      }
+      view->first_row = first_row;
+      view->jump_to_end = jump_to_end;
+      needs_render = true;
+    }
+
+    if (needs_render) {
+      fallback_render(renderer, font, view, window_height);
+      Uint64 elapsed = SDL_GetTicks64() - start;
+      if (elapsed <= FALLBACK_FRAME_DELAY) {
+        SDL_Delay(FALLBACK_FRAME_DELAY - elapsed);
+      }
+    }
+
+    // NOTE: sleep until the next event, the file is polled meanwhile.
+    // Indexing for Ctrl+E doesn't wait
+    (void)SDL_WaitEventTimeout(NULL,
+                               view->jump_to_end ? 0 : FALLBACK_POLL_DELAY);
+  }
+
+  fallback_free(view);
+  return EXIT_SUCCESS;
+}
@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "piece_table.h"
+#include "utf8.h"
 #include "utils.h"
 
 // TODO: other platforms
@@ -68,6 +70,104 @@ time_t get_last_modified(char *filename) {
 #endif
 }
 
+// NOTE: sniffing parameters, see sniff_file
+#define SNIFF_SAMPLE_SIZE (64 * 1024)
+#define SNIFF_SAMPLES_COUNT 3
+#define SNIFF_INVALID_UTF8_RATIO 0.05
+#define SNIFF_LONG_LINE (16 * 1024)
+
+enum FILE_KIND { FILE_KIND_TEXT = 0, FILE_KIND_BINARY, FILE_KIND_LONG_LINES };
+
+const char *file_kind_name(enum FILE_KIND kind) {
+  switch (kind) {
+  case FILE_KIND_TEXT:
+    return "FILE_KIND_TEXT";
+  case FILE_KIND_BINARY:
+    return "FILE_KIND_BINARY";
+  case FILE_KIND_LONG_LINES:
+    return "FILE_KIND_LONG_LINES";
+  }
+  return "FILE_KIND_UNKNOWN";
+}
+
+// sniff_file reads samples from the beginning, middle and end of the file
+// and checks them for NUL bytes, invalid utf8 and very long lines.
+// Files that are not FILE_KIND_TEXT should not go through tokenize.
+enum FILE_KIND sniff_file(char *filename) {
+  FILE *fptr = fopen(filename, "r");
+  if (fptr == NULL) {
+    return FILE_KIND_TEXT;
+  }
+  fseek(fptr, 0, SEEK_END);
+  long size = ftell(fptr);
+
+  char *sample = calloc(SNIFF_SAMPLE_SIZE, sizeof(char));
+
+  long sampled_bytes = 0;
+  long invalid_bytes = 0;
+  long nul_bytes = 0;
+  int longest_line = 0;
+
+  for (int i = 0; i < SNIFF_SAMPLES_COUNT; i += 1) {
+    // NOTE: samples at beginning, middle and end; small files are read once
+    long sample_offset = (size - SNIFF_SAMPLE_SIZE) * i /
+                         gt(SNIFF_SAMPLES_COUNT - 1, 1);
+    if (size <= SNIFF_SAMPLE_SIZE) {
+      if (i > 0) {
+        break;
+      }
+      sample_offset = 0;
+    }
+    fseek(fptr, sample_offset, SEEK_SET);
+    int sample_len = fread(sample, sizeof(char), SNIFF_SAMPLE_SIZE, fptr);
+    sampled_bytes += sample_len;
+
+    int offset = 0;
+    // NOTE: don't count continuation bytes cut by the sample boundary
+    while (sample_offset > 0 && offset < sample_len &&
+           is_utf8_continuation(sample[offset])) {
+      offset += 1;
+    }
+
+    int line_len = 0;
+    while (offset < sample_len) {
+      char c = sample[offset];
+      if (c == '\0') {
+        nul_bytes += 1;
+      }
+      if (c == '\n') {
+        line_len = 0;
+        offset += 1;
+        continue;
+      }
+      int seq_len = utf8_decode(sample + offset, sample_len - offset, NULL);
+      if (seq_len == 0) {
+        // NOTE: truncated sequence at the end of the sample is fine
+        if (sample_len - offset >= 4) {
+          invalid_bytes += 1;
+        }
+        seq_len = 1;
+      }
+      offset += seq_len;
+      line_len += 1;
+      longest_line = gt(longest_line, line_len);
+    }
+  }
+
+  free(sample);
+  fclose(fptr);
+
+  if (nul_bytes > 0 ||
+      (sampled_bytes > 0 && (double)invalid_bytes / (double)sampled_bytes >
+                                SNIFF_INVALID_UTF8_RATIO)) {
+    return FILE_KIND_BINARY;
+  }
+  if (longest_line >= SNIFF_LONG_LINE) {
+    return FILE_KIND_LONG_LINES;
+  }
+  return FILE_KIND_TEXT;
+}
+
 bool _is_updated(char *filename, time_t *last_modified) {
   return last_modified != NULL && *last_modified < get_last_modified(filename);
 }
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "utils.h"
+
+// NOTE: framebuffer is the CPU render path (see CPU_RENDER), for hosts
+// without a GPU, where every draw call goes through the software renderer.
+// The frame is drawn into pixels in memory: rects are filled and glyph
+// coverage of the atlas pages is alpha blended, 4 pixels at a time with
+// SSE2. Pixels are kept between frames, so they are the retained frame,
+// and only the dirty region is uploaded to a streaming texture,
+// once per frame.
+// Blending rounds the same way with and without SSE2, so both give
+// the same pixels.
+
+typedef struct {
+  Uint32 *pixels; // NOTE: ARGB8888, w * h
+  int w;
+  int h;
+  SDL_Rect clip;        // NOTE: drawing is limited to it
+  SDL_Rect dirty;       // NOTE: changed since the last upload
+  SDL_Texture *texture; // NOTE: streaming, uploaded by fb_present
+  Uint32 *scratch;      // NOTE: row of a scaled glyph
+  int scratch_cap;
+  //
+  double uploaded_pixels;
+} Framebuffer;
+
+Uint32 fb_color(SDL_Color color) {
+  return (Uint32)color.a << 24 | (Uint32)color.r << 16 |
+         (Uint32)color.g << 8 | color.b;
+}
+
+// fb_div255 returns v / 255 rounded, for v up to 255 * 255
+int fb_div255(int v) {
+  v += 128;
+  return (v + (v >> 8)) >> 8;
+}
+
+// fb_ready (re)creates pixels and the texture when the size changes.
+// returns false if the framebuffer can't be used
+bool fb_ready(Framebuffer *fb, SDL_Renderer *renderer, int w, int h) {
+  if (fb->pixels != NULL && fb->w == w && fb->h == h) {
+    return true;
+  }
+  if (fb->texture != NULL) {
+    SDL_DestroyTexture(fb->texture);
+  }
+  if (fb->pixels != NULL) {
+    free(fb->pixels);
+  }
+  fb->pixels = NULL;
+  fb->texture =
+      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_STREAMING, gt(w, 1), gt(h, 1));
+  if (fb->texture == NULL) {
+    fprintf(stderr, "failed to create framebuffer texture: %s\n",
+            SDL_GetError());
+    return false;
+  }
+  // NOTE: frame is copied as is, not blended
+  SDL_SetTextureBlendMode(fb->texture, SDL_BLENDMODE_NONE);
+  fb->pixels = calloc((size_t)gt(w, 1) * gt(h, 1), sizeof(Uint32));
+  fb->w = w;
+  fb->h = h;
+  fb->clip = (SDL_Rect){0, 0, w, h};
+  fb->dirty = (SDL_Rect){0, 0, w, h};
+  return true;
+}
+
+// fb_set_clip limits drawing to clip, NULL for the whole framebuffer
+void fb_set_clip(Framebuffer *fb, SDL_Rect *clip) {
+  SDL_Rect all = {0, 0, fb->w, fb->h};
+  if (clip == NULL || !SDL_IntersectRect(clip, &all, &fb->clip)) {
+    fb->clip = clip == NULL ? all : (SDL_Rect){0};
+  }
+}
+
+// fb_damage adds rect to the region uploaded by fb_present
+void fb_damage(Framebuffer *fb, SDL_Rect rect) {
+  SDL_Rect all = {0, 0, fb->w, fb->h};
+  if (!SDL_IntersectRect(&rect, &all, &rect)) {
+    return;
+  }
+  if (fb->dirty.w <= 0 || fb->dirty.h <= 0) {
+    fb->dirty = rect;
+  } else {
+    SDL_UnionRect(&fb->dirty, &rect, &fb->dirty);
+  }
+}
+
+void fb_fill_rect(Framebuffer *fb, SDL_Rect rect, SDL_Color color) {
+  SDL_Rect clipped = {0};
+  if (!SDL_IntersectRect(&rect, &fb->clip, &clipped)) {
+    return;
+  }
+  Uint32 pixel = fb_color(color);
+  for (int y = clipped.y; y < clipped.y + clipped.h; y += 1) {
+    Uint32 *row = fb->pixels + (size_t)y * fb->w + clipped.x;
+    for (int x = 0; x < clipped.w; x += 1) {
+      row[x] = pixel;
+    }
+  }
+}
+
+// fb_blend_span_scalar is fb_blend_span a pixel at a time
+void fb_blend_span_scalar(Uint32 *dst, const Uint32 *src, int count,
+                          SDL_Color color) {
+  Uint32 c = fb_color(color);
+  for (int i = 0; i < count; i += 1) {
+    int a = fb_div255((src[i] >> 24) * color.a);
+    if (a == 0) {
+      continue;
+    }
+    Uint32 pixel = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      int cv = (c >> shift) & 0xFF;
+      int dv = (dst[i] >> shift) & 0xFF;
+      pixel |= (Uint32)fb_div255(cv * a + dv * (255 - a)) << shift;
+    }
+    dst[i] = pixel;
+  }
+}
+
+// fb_blend_span blends color over count pixels of dst, with coverage
+// in the alpha of src pixels
+void fb_blend_span(Uint32 *dst, const Uint32 *src, int count,
+                   SDL_Color color) {
+  int i = 0;
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i full = _mm_set1_epi16(255);
+  __m128i half = _mm_set1_epi16(128);
+  __m128i tint = _mm_set1_epi16(color.a);
+  __m128i c16 = _mm_unpacklo_epi8(_mm_set1_epi32(fb_color(color)), zero);
+  for (; i + 4 <= count; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i a = _mm_srli_epi32(s, 24);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xFFFF) {
+      continue; // NOTE: nothing covered, eg space between glyphs
+    }
+    // NOTE: coverage of each pixel in all of its channels
+    a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+    a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i halves[2];
+    for (int k = 0; k < 2; k += 1) {
+      __m128i ak = k == 0 ? _mm_unpacklo_epi8(a, zero)
+                          : _mm_unpackhi_epi8(a, zero);
+      __m128i dk = k == 0 ? _mm_unpacklo_epi8(d, zero)
+                          : _mm_unpackhi_epi8(d, zero);
+      // NOTE: fb_div255 of coverage * tint alpha
+      ak = _mm_add_epi16(_mm_mullo_epi16(ak, tint), half);
+      ak = _mm_srli_epi16(_mm_add_epi16(ak, _mm_srli_epi16(ak, 8)), 8);
+      // NOTE: fb_div255 of c * a + d * (255 - a)
+      __m128i v = _mm_add_epi16(
+          _mm_mullo_epi16(c16, ak),
+          _mm_mullo_epi16(dk, _mm_sub_epi16(full, ak)));
+      v = _mm_add_epi16(v, half);
+      halves[k] = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+    }
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(halves[0], halves[1]));
+  }
+#endif
+  fb_blend_span_scalar(dst + i, src + i, count - i, color);
+}
+
+// fb_blend_glyph blends color with the coverage of src in surface at dst,
+// glyphs that are drawn scaled are sampled from the nearest pixel
+void fb_blend_glyph(Framebuffer *fb, SDL_Surface *surface, SDL_Rect src,
+                    SDL_FRect dst, SDL_Color color) {
+  int x0 = lrintf(dst.x);
+  int y0 = lrintf(dst.y);
+  int x1 = lrintf(dst.x + dst.w);
+  int y1 = lrintf(dst.y + dst.h);
+  int cx0 = gt(x0, fb->clip.x);
+  int cy0 = gt(y0, fb->clip.y);
+  int cx1 = lt(x1, fb->clip.x + fb->clip.w);
+  int cy1 = lt(y1, fb->clip.y + fb->clip.h);
+  if (cx1 <= cx0 || cy1 <= cy0 || src.w <= 0 || src.h <= 0) {
+    return;
+  }
+  int dw = x1 - x0;
+  int dh = y1 - y0;
+  bool is_scaled = dw != src.w || dh != src.h;
+  int count = cx1 - cx0;
+  if (is_scaled && fb->scratch_cap < count) {
+    fb->scratch_cap = gt(count, 2 * fb->scratch_cap);
+    fb->scratch = realloc(fb->scratch, fb->scratch_cap * sizeof(Uint32));
+  }
+  int pitch = surface->pitch / sizeof(Uint32);
+  for (int y = cy0; y < cy1; y += 1) {
+    int sy = src.y + (is_scaled ? (2 * (y - y0) + 1) * src.h / (2 * dh)
+                                : y - y0);
+    const Uint32 *src_row = (Uint32 *)surface->pixels + sy * pitch + src.x;
+    Uint32 *dst_row = fb->pixels + (size_t)y * fb->w + cx0;
+    if (!is_scaled) {
+      fb_blend_span(dst_row, src_row + (cx0 - x0), count, color);
+      continue;
+    }
+    for (int x = cx0; x < cx1; x += 1) {
+      fb->scratch[x - cx0] = src_row[(2 * (x - x0) + 1) * src.w / (2 * dw)];
+    }
+    fb_blend_span(dst_row, fb->scratch, count, color);
+  }
+}
+
+// fb_blend_surface blends color at dst with the coverage of the surface,
+// eg text rendered with TTF
+void fb_blend_surface(Framebuffer *fb, SDL_Surface *surface, SDL_Rect dst,
+                      SDL_Color color) {
+  SDL_Surface *converted =
+      SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+  if (converted == NULL) {
+    fprintf(stderr, "[WARNING]: failed to convert surface: %s\n",
+            SDL_GetError());
+    return;
+  }
+  SDL_Rect src = {0, 0, converted->w, converted->h};
+  fb_blend_glyph(fb, converted, src, (SDL_FRect){dst.x, dst.y, dst.w, dst.h},
+                 color);
+  SDL_FreeSurface(converted);
+}
+
+// fb_scroll moves the frame dy rows down, or up if dy is negative.
+// NOTE: rows that are uncovered keep stale pixels, they are damaged
+void fb_scroll(Framebuffer *fb, int dy) {
+  if (dy == 0 || abs(dy) >= fb->h) {
+    return;
+  }
+  size_t row_bytes = (size_t)fb->w * sizeof(Uint32);
+  if (dy > 0) {
+    memmove(fb->pixels + (size_t)dy * fb->w, fb->pixels,
+            (fb->h - dy) * row_bytes);
+  } else {
+    memmove(fb->pixels, fb->pixels + (size_t)-dy * fb->w,
+            (fb->h + dy) * row_bytes);
+  }
+  fb_damage(fb, (SDL_Rect){0, 0, fb->w, fb->h});
+}
+
+// fb_present uploads the dirty region and copies the frame to the window
+void fb_present(Framebuffer *fb, SDL_Renderer *renderer) {
+  if (fb->dirty.w > 0 && fb->dirty.h > 0) {
+    SDL_UpdateTexture(fb->texture, &fb->dirty,
+                      fb->pixels + (size_t)fb->dirty.y * fb->w + fb->dirty.x,
+                      fb->w * sizeof(Uint32));
+    fb->uploaded_pixels += (double)fb->dirty.w * fb->dirty.h;
+    fb->dirty = (SDL_Rect){0};
+  }
+  SDL_RenderCopy(renderer, fb->texture, NULL, NULL);
+}
+
+// frees memory
+void free_framebuffer(Framebuffer *fb) {
+  if (fb->texture != NULL) {
+    SDL_DestroyTexture(fb->texture);
+  }
+  if (fb->pixels != NULL) {
+    free(fb->pixels);
+  }
+  if (fb->scratch != NULL) {
+    free(fb->scratch);
+  }
+  *fb = (Framebuffer){0};
+}
+
+#define BLEND_CHECK_SPAN 259 // NOTE: every coverage and a tail of 3
+
+// check_blend_span blends every coverage with every alpha of the color
+// with fb_blend_span and fb_blend_span_scalar, and prints how many pixels
+// came out the same. dst pixels and color channels are taken from bytes
+void check_blend_span(const char *bytes, int bytes_len) {
+  Uint32 src[BLEND_CHECK_SPAN] = {0};
+  Uint32 dst[BLEND_CHECK_SPAN] = {0};
+  Uint32 expected[BLEND_CHECK_SPAN] = {0};
+  int byte = 0;
+  long matched = 0;
+  long total = 0;
+  for (int tint = 0; tint < 256; tint += 1) {
+    Uint8 rgb[3] = {0};
+    for (int k = 0; k < 3; k += 1) {
+      rgb[k] = bytes_len > 0 ? bytes[byte % bytes_len] : 0;
+      byte += 1;
+    }
+    SDL_Color color = {rgb[0], rgb[1], rgb[2], tint};
+    for (int i = 0; i < BLEND_CHECK_SPAN; i += 1) {
+      src[i] = (Uint32)(i % 256) << 24;
+      dst[i] = 0;
+      for (int k = 0; k < 4; k += 1) {
+        Uint8 v = bytes_len > 0 ? bytes[byte % bytes_len] : 0;
+        dst[i] |= (Uint32)v << (8 * k);
+        byte += 1;
+      }
+      expected[i] = dst[i];
+    }
+    fb_blend_span(dst, src, BLEND_CHECK_SPAN, color);
+    fb_blend_span_scalar(expected, src, BLEND_CHECK_SPAN, color);
+    for (int i = 0; i < BLEND_CHECK_SPAN; i += 1) {
+      total += 1;
+      if (dst[i] == expected[i]) {
+        matched += 1;
+      } else if (total - matched <= 8) {
+        printf("coverage %d, alpha %d: 0x%08x instead of 0x%08x\n", i % 256,
+               tint, dst[i], expected[i]);
+      }
+    }
+  }
+  printf("blend: %ld/%ld pixels match\n", matched, total);
+}
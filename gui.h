@@ -1,15 +1,26 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "atlas.h"
 #include "color_scheme.h"
 #include "consts.h"
+#include "draw_list.h"
+#include "fallback.h"
+#include "minimap.h"
+#include "raster_pool.h"
+#include "row_cache.h"
+#include "runs.h"
 #include "tokens.h"
+#include "utf8.h"
 #include "utils.h"
+#include "watch.h"
 
 #define SCREEN_WIDTH 960
 #define SCREEN_HEIGHT 540
@@ -30,18 +41,53 @@
 #define VERTICAL_PADDING (5)
 #define ROW_NUMBER_PADDING (10)
 
-#define FRAME_DELAY 16 // in milliseconds; ~60FPS
+#define FRAME_DELAY 16 // in milliseconds; ~60FPS, when there's no vsync
+#define WATCH_RECHECK_DELAY 1100 // in milliseconds
 
 #define MILLISECOND 1
 #define SECOND (1000 * MILLISECOND)
 
-#define FONT_RENDERING_DELAY 2
+#define GLYPH_PREFETCH_ROWS 20 // NOTE: rows rasterized ahead of scrolling
+#define ZOOM_ATLASES_CAP 3     // NOTE: atlases kept for recent font sizes
 
 int BASE_FONT_SIZE = DEFAULT_FONT_SIZE; // MAYBE: move to state
 int FONT_SIZE = DEFAULT_FONT_SIZE;      // MAYBE: move to state
 int HORIZONTAL_PADDING = (HORIZONTAL_PADDING_BASE);
 int ROW_NUMBER_WIDTH = 0; // NOTE: will be updated once it's calculated
 
+bool PRINT_STATS = false; // NOTE: print cache stats on exit
+bool SHOW_MINIMAP = false;
+bool SHOW_DRAW_CALLS = false; // NOTE: overlay with draw calls of a frame
+bool CPU_RENDER = false;      // NOTE: draw frames on the CPU, see framebuffer.h
+
+// NOTE: run cache is shared by the builder thread, that releases runs of
+// retired generations, and the render thread, that lays out rows
+SDL_mutex *RUN_CACHE_LOCK = NULL;
+
+// NOTE: colors of token types in the active color scheme, looked up when
+// drawing, so switching color schemes doesn't touch the layout
+SDL_Color TOKEN_COLORS[TOKEN_TOKEN_COUNT];
+
+void update_token_colors(ColorScheme *scheme) {
+  for (int t = 0; t < TOKEN_TOKEN_COUNT; t += 1) {
+    TOKEN_COLORS[t] = scheme->fg;
+  }
+  TOKEN_COLORS[TOKEN_STRING] = scheme->strings;
+  TOKEN_COLORS[TOKEN_NUMBER] = scheme->numbers;
+  TOKEN_COLORS[TOKEN_CODE_KEYWORD] = scheme->code_keywords;
+  TOKEN_COLORS[TOKEN_COMMENT_KEYWORD] = scheme->comment_keywords;
+  TOKEN_COLORS[TOKEN_COMMENT] = scheme->comments;
+}
+
+// NOTE: scripted storms, WHEEL_STORM wheel events and DRAG_STORM mouse
+// motion events with the left button held are pushed every frame,
+// RELOAD_STORM builds are posted every frame,
+// for STORM_FRAMES frames and then the window is closed
+int WHEEL_STORM = 0;
+int DRAG_STORM = 0;
+int RELOAD_STORM = 0;
+#define STORM_FRAMES 600
+
 // TODO: add SEARCH_BUF_SIZE overflow checks NOTE: might already be done
 // TODO: handle case when search text doesn't fit in the window
 #define SEARCH_BUF_SIZE (4096 + 1)
@@ -53,37 +99,156 @@ int SEARCH_BUF_OFFSET = 0;
 char GOTO_LINE_BUF[GOTO_LINE_BUF_SIZE] = {0};
 int GOTO_LINE_BUF_OFFSET = 0;
 
+// NOTE: text tokens don't have their own texture,
+// their glyphs are drawn from the glyph atlas
 typedef struct {
-  struct SDL_Texture *texture;
   Token *token;
-  int x;
-  int y;
+  Run *run; // NOTE: shared with other tokens with the same text
+  int x; // NOTE: x and w are set when the row is laid out, see layout_row
   int w;
-  int h;
   int r;
   int c;
+  // NOTE: -1 for ascii tokens, otherwise the codepoint to draw.
+  // 0 if the token is continuation of the previous token's codepoint
+  int codepoint;
 } Texture;
 
+// NOTE: document generations.
+// A generation is an immutable snapshot of one version of the file:
+// its tokens and their layout. Generations are built on the builder thread
+// and handed to the render thread through an atomic pointer.
+// The render thread adopts the newest generation between frames, which is
+// the only point where it lets go of the previous one, so retired
+// generations are freed by the builder without locks on the render path.
+// NOTE: rows of the adopted generation are laid out on demand,
+// the render thread is the only one that touches it after it's published.
+
+// NOTE: tokens are shared by generations that only differ in layout,
+// eg after font resize. Only the builder thread takes and drops references.
 typedef struct {
-  int x;
-  int y;
-} Coord;
+  int refs;
+  char *contents; // NOTE: selections are byte ranges of contents
+  int contents_len;
+  Token **tokens;
+  int tokens_count;
+  uint64_t *line_hashes; // NOTE: of the tokens of each line, see hash_lines
+  int lines_count;
+} Document;
+
+typedef struct Generation {
+  struct Generation *next; // NOTE: link in the retired list
+  int id;
+  Document *doc;
+  int font_size;
+  //
+  Texture **textures;
+  int textures_count;
+  //
+  int rows_count;
+  int *row_texture_idx; // NOTE: first texture of each row, rows_count + 1
+  bool *row_laid_out;
+  int line_height; // NOTE: rows aren't wrapped, row y is row * line_height
+  //
+  int max_horizontal_offset; // NOTE: widest row laid out so far
+  int max_vertical_offset;
+  //
+  Minimap *minimap; // NOTE: NULL if SHOW_MINIMAP is off
+  // NOTE: rows [changed_first_row, changed_rows_end) differ from the
+  // generation base_id, rows after them moved by rows_shift.
+  // base_id is 0 if the whole generation has to be drawn
+  int base_id;
+  int changed_first_row;
+  int changed_rows_end;
+  int rows_shift;
+} Generation;
+
+// NOTE: everything the frame depends on, see present_frame
+typedef struct {
+  Generation *generation;
+  int generation_id; // NOTE: generation might be freed, ids are compared
+  ColorScheme *color_scheme;
+  int window_width;
+  int window_height;
+  float font_scale_factor;
+  int row_number_width;
+  int max_horizontal_offset; // NOTE: grows as rows are laid out
+  int horizontal_scroll;
+  int vertical_scroll;
+  int selection_anchor;
+  int selection_head;
+  bool search_mode;
+  bool goto_line_mode;
+  uint32_t actionbox_hash;
+} FrameView;
+
+#define FRAME_DAMAGE_CAP 8
+
+// NOTE: frame cache retains the last frame in a render target,
+// so only damaged regions are redrawn and scrolling blits the frame.
+typedef struct {
+  SDL_Texture *targets[2]; // NOTE: retained frame and scratch for scrolling
+  int current;
+  int w;
+  int h;
+  bool valid;
+  bool unsupported; // NOTE: draw straight to window without render targets
+  bool exposed;     // NOTE: window needs the retained frame again
+  bool vsync;       // NOTE: presenting waits for vertical retrace
+  FrameView view;
+  SDL_Rect damage[FRAME_DAMAGE_CAP];
+  int damage_count;
+  //
+  Uint64 started;
+  clock_t cpu_started;
+  long loops; // NOTE: main loop wakeups
+  long events;
+  long presented;
+  long skipped;
+  long full_redraws;
+  long scroll_blits;
+  long partial_redraws;
+  double redrawn_pixels;
+  double window_pixels;
+  Uint64 render_ticks;
+  long draw_calls; // NOTE: summed over presented frames, see DrawCounts
+  long primitives;
+} FrameCache;
 
 typedef struct {
   int window_width;
   int window_height;
   //
   TTF_Font *font;
+  GlyphAtlas *atlas;   // NOTE: glyphs of the current FONT_SIZE
+  GlyphAtlas *metrics; // NOTE: layout font size, only metrics are used
+  SdfFont *sdf;
+  RasterPool *raster_pool; // NOTE: NULL if glyphs are rasterized inline
+  int *raster_codepoints;  // NOTE: scratch of raster_rows
+  int raster_codepoints_cap;
+  // NOTE: atlases of recently used font sizes without textures,
+  // most recent first, see update_draw_atlas
+  GlyphAtlas *zoom_atlases[ZOOM_ATLASES_CAP];
+  long zoom_switches;
+  long zoom_hits;
   //
   SDL_Texture *clearing;
+  FrameCache frame;
+  DrawList draw_list;
+  Framebuffer framebuffer; // NOTE: retained frame with CPU_RENDER
+  RowCache row_cache;
+  MinimapTiles minimap_tiles;
+  SDL_Rect *clip; // NOTE: region being redrawn, NULL for whole window
   //
   bool keep_window_open;
+  bool file_changed; // NOTE: WATCH_EVENT was received
   bool file_modified;
-  bool color_scheme_modified;
   //
-  bool is_font_resized;
-  float font_scale_factor;
-  Uint64 font_size_unchanged_since;
+  float font_scale_factor; // NOTE: view scale of the layout, see zoom_view
+  int zoomed_font_size;
+  int zoomed_horizontal_scroll;
+  int zoomed_vertical_scroll;
+  double zoom_anchor_x; // NOTE: scroll per font size unit
+  double zoom_anchor_y;
   //
   bool ctrl_pressed;  // TODO: use sdl_event.key.keysym.mod == KMOD_CTRL
   bool shift_pressed; // TODO: use sdl_event.key.keysym.mod == KMOD_SHIFT
@@ -94,16 +259,24 @@ typedef struct {
   //
   int horizontal_scroll;
   int vertical_scroll;
+  int scroll_direction; // NOTE: 1 when last scrolled down, -1 when up
   //
-  int highlight_stationary_texture_idx; // inclusive
-  int highlight_moving_texture_idx;     // inclusive
-  Coord *highlight_stationary_coord;
-  Coord *highlight_moving_coord;
+  // NOTE: selection is a byte range of the document contents,
+  // from anchor (where it started) to head; anchor is -1 if nothing is
+  // selected. It doesn't depend on layout, so zooming doesn't touch it
+  int selection_anchor;
+  int selection_head;
   //
   Uint64 last_mouse_click_tick;
   //
-  Texture **row_nr_textures;
+  FileWatch *watch;
+  Uint64 recheck_at; // NOTE: when to check the file again, 0 if not armed
+  //
+  Generation *generation; // NOTE: adopted generation, see adopt_generation
+  PieceTable *text;       // NOTE: contents of the adopted generation
   int rows_count;
+  int *row_texture_idx; // NOTE: borrowed from the adopted generation
+  long laid_out_rows;
   //
   bool search_mode;
   //
@@ -113,27 +286,18 @@ typedef struct {
 typedef struct SearchResult {
   struct SearchResult *next;
   struct SearchResult *prev;
-  Coord *start;
-  Coord *end;
-  int start_texture_idx;
-  int end_texture_idx;
+  int start; // NOTE: byte range of the document contents
+  int end;
   char *val;
 } SearchResult;
 
 SearchResult *search_results = NULL;
 
-void add_search_result(Coord *start, Coord *end, int start_texture_idx,
-                       int end_texture_idx, State *state) {
+void add_search_result(int start, int end) {
 
   SearchResult *new = calloc(1, sizeof(SearchResult));
-  new->start = calloc(1, sizeof(Coord));
-  new->end = calloc(1, sizeof(Coord));
-  new->start->x = start->x;
-  new->start->y = start->y;
-  new->end->x = end->x;
-  new->end->y = end->y;
-  new->start_texture_idx = start_texture_idx;
-  new->end_texture_idx = end_texture_idx;
+  new->start = start;
+  new->end = end;
 
   if (search_results == NULL) {
     new->val = calloc(SEARCH_BUF_OFFSET, sizeof(char));
@@ -159,8 +323,7 @@ void add_search_result(Coord *start, Coord *end, int start_texture_idx,
 void print_search_results() {
   SearchResult *cur = search_results;
   for (; cur->next != search_results; cur = cur->next) {
-    printf("(%d, %d), (%d, %d): %s\n", cur->start->x, cur->start->y,
-           cur->end->x, cur->end->y, SEARCH_BUF + 1);
+    printf("[%d, %d): %s\n", cur->start, cur->end, SEARCH_BUF + 1);
   }
 }
 
@@ -176,12 +339,6 @@ void *free_search_results() {
     SearchResult *me = search_results;
     ((SearchResult *)search_results->prev)->next = NULL;
     search_results = (SearchResult *)search_results->next;
-    if (me->start != NULL) {
-      free(me->start);
-    }
-    if (me->end != NULL) {
-      free(me->start);
-    }
     free(me);
   }
   return NULL;
@@ -236,210 +393,399 @@ void *free_search_history() {
   return NULL;
 }
 
-void scale_texture_font(Texture **textures, int textures_count, State *state) {
-  for (int i = 0; i < textures_count; i += 1) {
-    textures[i]->x = rint((float)textures[i]->x * state->font_scale_factor);
-    textures[i]->y = rint((float)textures[i]->y * state->font_scale_factor);
-    textures[i]->w = rint((float)textures[i]->w * state->font_scale_factor);
-    textures[i]->h = rint((float)textures[i]->h * state->font_scale_factor);
-  }
-}
+// NOTE: texture rects are layout units of BASE_FONT_SIZE and zooming
+// doesn't touch them. Zoom is a view transform, rects are scaled by
+// font_scale_factor only where they are drawn or hit tested, so a zoom
+// tick costs the same for any file size.
 
-void scale_font(Texture **textures, int textures_count, State *state) {
+// view_px returns window pixels of layout units
+int view_px(int v, State *state) {
+  return rint((double)v * state->font_scale_factor);
+}
 
-  state->max_horizontal_offset =
-      rint((float)state->max_horizontal_offset * state->font_scale_factor);
-  state->max_vertical_offset =
-      rint((float)state->max_vertical_offset * state->font_scale_factor);
+// row_y returns document y of the row in window pixels.
+// NOTE: rows aren't wrapped, so the row doesn't have to be laid out
+int row_y(int row, State *state) {
+  return rint((double)row * state->generation->line_height *
+              state->font_scale_factor);
+}
 
-  state->horizontal_scroll =
-      rint((float)state->horizontal_scroll * state->font_scale_factor);
-  state->vertical_scroll =
-      rint((float)state->vertical_scroll * state->font_scale_factor);
+// row_height returns height of the rows in window pixels
+int row_height(State *state) {
+  return view_px(state->generation->line_height, state);
+}
 
-  state->highlight_stationary_coord->x = rint(
-      (float)state->highlight_stationary_coord->x * state->font_scale_factor);
-  state->highlight_stationary_coord->y = rint(
-      (float)state->highlight_stationary_coord->y * state->font_scale_factor);
+// zoom_view scales the view to the current FONT_SIZE.
+// NOTE: scroll is rescaled from where it was when zooming started,
+// so zooming in and back out returns to the same scroll
+void zoom_view(State *state) {
+  if (state->horizontal_scroll != state->zoomed_horizontal_scroll ||
+      state->vertical_scroll != state->zoomed_vertical_scroll) {
+    // NOTE: scrolled since the last zoom, anchor the current scroll
+    state->zoom_anchor_x =
+        (double)state->horizontal_scroll / state->zoomed_font_size;
+    state->zoom_anchor_y =
+        (double)state->vertical_scroll / state->zoomed_font_size;
+  }
+  state->font_scale_factor = (float)FONT_SIZE / (float)BASE_FONT_SIZE;
+
+  Generation *gen = state->generation;
+  if (gen != NULL) {
+    state->max_horizontal_offset =
+        gt(view_px(gen->max_horizontal_offset, state), 1);
+    state->max_vertical_offset =
+        gt(view_px(gen->max_vertical_offset, state), 1);
+  }
+  // NOTE: anchor isn't clamped, zooming back returns to the same scroll
+  state->horizontal_scroll = clamp(rint(state->zoom_anchor_x * FONT_SIZE),
+                                   -state->max_horizontal_offset, 0);
+  state->vertical_scroll = clamp(rint(state->zoom_anchor_y * FONT_SIZE),
+                                 -state->max_vertical_offset, 0);
+
+  state->zoomed_font_size = FONT_SIZE;
+  state->zoomed_horizontal_scroll = state->horizontal_scroll;
+  state->zoomed_vertical_scroll = state->vertical_scroll;
+}
 
-  state->highlight_moving_coord->x =
-      rint((float)state->highlight_moving_coord->x * state->font_scale_factor);
-  state->highlight_moving_coord->y =
-      rint((float)state->highlight_moving_coord->y * state->font_scale_factor);
+// layout_row places textures of the row, unless it's laid out already.
+// NOTE: rows are laid out when they are drawn or hit tested, so jumping
+// in a long file doesn't lay out the rows in between. Token width is the
+// sum of its glyph advances, glyphs are rasterized only when drawn
+void layout_row(int row, State *state) {
+  Generation *gen = state->generation;
+  GlyphAtlas *metrics = state->metrics;
+  if (gen == NULL || metrics == NULL || row < 0 || row >= gen->rows_count ||
+      gen->row_laid_out[row]) {
+    return;
+  }
+  if (RUN_CACHE_LOCK != NULL) {
+    SDL_LockMutex(RUN_CACHE_LOCK);
+  }
+  int x = 0;
+  int newline_idx = gen->row_texture_idx[row + 1] - 1;
+  for (int i = gen->row_texture_idx[row]; i <= newline_idx; i += 1) {
+    Texture *texture = gen->textures[i];
+    Token *token = texture->token;
+    int w = 0;
+    if (texture->codepoint > 0) {
+      w = atlas_glyph_metrics(metrics, texture->codepoint)->advance;
+    } else if (texture->codepoint == 0) {
+      w = 0; // NOTE: continuation byte, drawn with its codepoint
+    } else if (metrics->monospace_advance > 0 && token->t != TOKEN_TABS &&
+               token->t != TOKEN_NEWLINE) {
+      // NOTE: monospace widths are arithmetic, nothing is looked up
+      w = token->vlen * metrics->monospace_advance;
+    } else {
+      bool is_new = false;
+      texture->run = run_acquire(&run_cache, token->v, token->vlen,
+                                 gen->font_size, &is_new);
+      if (is_new) {
+        for (int j = 0; j < token->vlen; j += 1) {
+          texture->run->w += atlas_glyph_metrics(metrics, token->v[j])->advance;
+        }
+      }
+      w = texture->run->w;
+    }
+    texture->x = x;
+    texture->w = w;
+    x += w;
+  }
+  if (RUN_CACHE_LOCK != NULL) {
+    SDL_UnlockMutex(RUN_CACHE_LOCK);
+  }
+  gen->row_laid_out[row] = true;
+  state->laid_out_rows += 1;
 
-  scale_texture_font(textures, textures_count, state);
+  int width = gen->textures[newline_idx]->x;
+  if (width > gen->max_horizontal_offset) {
+    gen->max_horizontal_offset = width;
+    state->max_horizontal_offset = gt(view_px(width, state), 1);
+  }
 }
 
-void reset_scale_texture_font(Texture **textures, int textures_count,
-                              State *state) {
-  for (int i = 0; i < textures_count; i += 1) {
-    textures[i]->x = rint((float)textures[i]->x / state->font_scale_factor);
-    textures[i]->y = rint((float)textures[i]->y / state->font_scale_factor);
-    textures[i]->w = rint((float)textures[i]->w / state->font_scale_factor);
-    textures[i]->h = rint((float)textures[i]->h / state->font_scale_factor);
+// row_at_y returns the row containing document y, in window pixels.
+// NOTE: rows are equally high, so it's computed from the row height
+// and only corrected for rows placed on rounded pixels
+int row_at_y(int y, State *state) {
+  if (state->generation == NULL || state->rows_count <= 0) {
+    return 0;
+  }
+  double height =
+      (double)state->generation->line_height * state->font_scale_factor;
+  int row = clamp(floor(y / height), 0, state->rows_count - 1);
+  while (row > 0 && y < row_y(row, state)) {
+    row -= 1;
+  }
+  while (row + 1 < state->rows_count && row_y(row + 1, state) <= y) {
+    row += 1;
   }
+  return row;
 }
 
-void reset_font_scale(Texture **textures, int textures_count, State *state) {
+// first_row_at returns the row at window_y, rows above can be skipped
+// when iterating.
+// NOTE: starts one row earlier to include rows touching window_y
+int first_row_at(int window_y, State *state) {
+  int row =
+      row_at_y(window_y - VERTICAL_PADDING - state->vertical_scroll, state);
+  return gt(row - 1, 0);
+}
 
-  state->highlight_stationary_coord->x = rint(
-      (float)state->highlight_stationary_coord->x / state->font_scale_factor);
-  state->highlight_moving_coord->x =
-      rint((float)state->highlight_moving_coord->x / state->font_scale_factor);
+// layout_window_rows lays out the rows in the window and the rows glyphs
+// are prefetched for, so the frame is compared with the widest row known
+void layout_window_rows(State *state) {
+  if (state->generation == NULL || state->rows_count <= 0) {
+    return;
+  }
+  int first = row_at_y(-VERTICAL_PADDING - state->vertical_scroll, state);
+  int last = row_at_y(state->window_height - VERTICAL_PADDING -
+                          state->vertical_scroll,
+                      state);
+  for (int row = gt(first - GLYPH_PREFETCH_ROWS, 0);
+       row <= lt(last + GLYPH_PREFETCH_ROWS, state->rows_count - 1);
+       row += 1) {
+    layout_row(row, state);
+  }
+}
 
-  state->max_horizontal_offset =
-      rint((float)state->max_horizontal_offset / state->font_scale_factor);
-  state->max_vertical_offset =
-      rint((float)state->max_vertical_offset / state->font_scale_factor);
+// row_texture_at_x returns the first texture of the row that ends right
+// of document x in window pixels, or the newline of the row if there is none.
+// NOTE: binary search, so long rows cost as much as short ones
+int row_texture_at_x(Texture **textures, int row, int x, State *state) {
+  layout_row(row, state);
+  int lo = state->row_texture_idx[row];
+  int hi = state->row_texture_idx[row + 1] - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (view_px(textures[mid]->x + textures[mid]->w, state) <= x) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
 
-  state->horizontal_scroll =
-      rint((float)state->horizontal_scroll / state->font_scale_factor);
-  state->vertical_scroll =
-      rint((float)state->vertical_scroll / state->font_scale_factor);
+// window_left_x and window_right_x return document x in window pixels
+// of the edges of the text area
+int window_left_x(State *state) { return -state->horizontal_scroll; }
 
-  state->highlight_stationary_coord->x = rint(
-      (float)state->highlight_stationary_coord->x / state->font_scale_factor);
-  state->highlight_stationary_coord->y = rint(
-      (float)state->highlight_stationary_coord->y / state->font_scale_factor);
+int window_right_x(State *state) {
+  return state->window_width - HORIZONTAL_PADDING - state->horizontal_scroll;
+}
 
-  state->highlight_moving_coord->x =
-      rint((float)state->highlight_moving_coord->x / state->font_scale_factor);
-  state->highlight_moving_coord->y =
-      rint((float)state->highlight_moving_coord->y / state->font_scale_factor);
+// clip_top and clip_bottom return window rows that are being redrawn
+int clip_top(State *state) {
+  return state->clip != NULL ? state->clip->y : 0;
+}
 
-  reset_scale_texture_font(textures, textures_count, state);
+int clip_bottom(State *state) {
+  return state->clip != NULL ? state->clip->y + state->clip->h
+                             : state->window_height;
 }
 
+// texture_idx_from_mouse_pos returns the texture under the mouse.
+// Mouse out of window is clamped to the visible rows, left of the text
+// to the row start and right of the window to the newline of the row
 int texture_idx_from_mouse_pos(Texture **textures, int textures_count,
                                int mouse_x, int mouse_y, State *state) {
+  if (state->row_texture_idx == NULL || state->rows_count <= 0 ||
+      textures_count <= 0) {
+    return -1;
+  }
+  int y = clamp(mouse_y, 0, state->window_height - 1) - VERTICAL_PADDING -
+          state->vertical_scroll;
+  int row = row_at_y(y, state);
+  int x = mouse_x - HORIZONTAL_PADDING - state->horizontal_scroll;
+  if (mouse_x < HORIZONTAL_PADDING) {
+    x = window_left_x(state) - 1;
+  } else if (mouse_x > state->window_width) {
+    x = INT_MAX;
+  }
+  return row_texture_at_x(textures, row, x, state);
+}
 
-  for (int i = 0; i < textures_count; i += 1) {
-    int texture_start_width =
-        HORIZONTAL_PADDING + textures[i]->x + state->horizontal_scroll;
-    int texture_start_height =
-        VERTICAL_PADDING + textures[i]->y + state->vertical_scroll;
-
-    // NOTE: only render what fits on window
-    // continue if before window
-    // break if after window
-    if (texture_start_height + textures[i]->h < 0 ||
-        texture_start_width > state->window_width ||
-        texture_start_width + textures[i]->w < 0) {
-      continue;
-    } else if (state->window_height <= texture_start_height) {
-      // NOTE: mouse is out of window to the bottom
-      // use the last texture index that was still inside the window
-      if (mouse_y > state->window_height) {
-        return i - 1;
-      }
-      break;
+// texture_chars_at returns how many characters of the texture end left
+// of dx, or start left of dx when round_up is set.
+// NOTE: monospace layouts compute it without looking at glyphs
+int texture_chars_at(Texture *texture, int dx, bool round_up,
+                     State *state) {
+  int vlen = texture->codepoint >= 0 ? 1 : texture->token->vlen;
+  if (dx <= 0) {
+    return 0;
+  } else if (view_px(texture->w, state) <= dx) {
+    return vlen;
+  } else if (vlen == 1 || texture->token->t == TOKEN_NEWLINE) {
+    return round_up;
+  }
+  GlyphAtlas *metrics = state->metrics;
+  float scale = (float)row_height(state) / metrics->line_height;
+  if (metrics->monospace_advance > 0 && texture->token->t != TOKEN_TABS) {
+    float advance = metrics->monospace_advance * scale;
+    return clamp(round_up ? ceilf(dx / advance) : floorf(dx / advance), 0,
+                 vlen);
+  }
+  float pen_x = 0;
+  for (int j = 0; j < vlen; j += 1) {
+    int advance = atlas_glyph_metrics(metrics, texture->token->v[j])->advance;
+    float next_x = pen_x + advance * scale;
+    if (round_up ? dx <= pen_x : dx < next_x) {
+      return j;
     }
+    pen_x = next_x;
+  }
+  return vlen;
+}
+
+// texture_char_x returns the x offset of the character in the texture
+int texture_char_x(Texture *texture, int chars, State *state) {
+  int vlen = texture->codepoint >= 0 ? 1 : texture->token->vlen;
+  if (chars <= 0) {
+    return 0;
+  } else if (vlen <= chars) {
+    return view_px(texture->w, state);
+  }
+  GlyphAtlas *metrics = state->metrics;
+  float scale = (float)row_height(state) / metrics->line_height;
+  if (metrics->monospace_advance > 0 && texture->token->t != TOKEN_TABS) {
+    return rint(chars * metrics->monospace_advance * scale);
+  }
+  float pen_x = 0;
+  for (int j = 0; j < chars; j += 1) {
+    pen_x += atlas_glyph_metrics(metrics, texture->token->v[j])->advance;
+  }
+  return rint(pen_x * scale);
+}
+
+// offset_row returns the row of the byte offset, rows are the lines of
+// the text
+int offset_row(int offset, State *state) {
+  return clamp(piece_table_line_at(state->text, offset), 0,
+               state->rows_count - 1);
+}
 
-    if (
-        // mouse is out of window to the top
-        mouse_y < 0 ||
-        // check based on cursor being on the same line
-        (texture_start_height <= mouse_y &&
-         mouse_y < texture_start_height + textures[i]->h &&
-         (
-             // direct hit on the token
-             (texture_start_width < mouse_x &&
-              mouse_x < texture_start_width + textures[i]->w)
-             //
-             ||
-             // mouse is out of window to the left
-             mouse_x < HORIZONTAL_PADDING
-             //
-             ||
-             // mouse is out of window to the right
-             mouse_x > state->window_width
-             //
-             ))) {
-      return i;
+// texture_idx_at_offset returns the texture containing the byte offset,
+// binary searching token offsets of its row
+int texture_idx_at_offset(Texture **textures, int offset, State *state) {
+  int row = offset_row(offset, state);
+  int lo = state->row_texture_idx[row];
+  int hi = state->row_texture_idx[row + 1] - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (textures[mid]->token->offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
     }
   }
-  return -1;
+  return lo;
 }
 
-// TODO: FIXME: when font is scaled, existing highlight might move or get gaps
-// NOTE: MAYBE: FIXME: when highlighting with mouse downwards and cursor is out
-// of window to left/right, then currently last highlighted line's first token
-// is also highlighted
-// NOTE: code shared with handle_copy_to_clipboard,
-// but too early to abstract anything.
-// Just a note that any changes here might also be needed to be done in
-// handle_copy_to_clipboard.
-void handle_highlight(SDL_Renderer *renderer, Texture **textures,
-                      int textures_count, State *state) {
-  if (
-      // stationary token index was neg
-      state->highlight_stationary_texture_idx < 0 ||
-      // mouse click, no moving
-      (state->highlight_stationary_coord->x ==
-           state->highlight_moving_coord->x &&
-       state->highlight_stationary_coord->y ==
-           state->highlight_moving_coord->y)) {
-    return;
+// texture_offset_x returns the x offset of the byte offset in the texture
+int texture_offset_x(Texture *texture, int offset, State *state) {
+  int bytes = offset - texture->token->offset;
+  if (texture->codepoint >= 0) {
+    // NOTE: bytes of a codepoint are selected together
+    return bytes > 0 ? view_px(texture->w, state) : 0;
+  } else if (texture->token->t == TOKEN_TABS) {
+    return texture_char_x(texture, bytes * TAB_WIDTH, state);
   }
+  return texture_char_x(texture, bytes, state);
+}
 
-  int start_idx = state->highlight_stationary_texture_idx;
-  int end_idx = state->highlight_moving_texture_idx;
+// offset_x returns document x of the byte offset, in window pixels
+int offset_x(Texture **textures, int offset, State *state) {
+  Texture *texture = textures[texture_idx_at_offset(textures, offset, state)];
+  layout_row(texture->r, state);
+  return view_px(texture->x, state) + texture_offset_x(texture, offset, state);
+}
 
-  int highlight_start_x = state->highlight_stationary_coord->x;
-  int highlight_end_x = state->highlight_moving_coord->x;
+// offset_y returns document y of the row of the byte offset,
+// in window pixels
+int offset_y(int offset, State *state) {
+  return row_y(offset_row(offset, state), state);
+}
 
-  if (end_idx < start_idx) {
-    start_idx = state->highlight_moving_texture_idx;
-    end_idx = state->highlight_stationary_texture_idx;
+// offset_at_mouse returns the byte offset of the character boundary
+// nearest to the mouse, -1 if there is no text under it
+int offset_at_mouse(Texture **textures, int textures_count, int mouse_x,
+                    int mouse_y, State *state) {
+  int idx = texture_idx_from_mouse_pos(textures, textures_count, mouse_x,
+                                       mouse_y, state);
+  if (idx < 0) {
+    return -1;
+  }
+  Texture *texture = textures[idx];
+  int dx = mouse_x - (HORIZONTAL_PADDING + view_px(texture->x, state) +
+                      state->horizontal_scroll);
+
+  if (texture->token->t == TOKEN_NEWLINE || dx <= 0) {
+    return texture->token->offset;
+  } else if (texture->codepoint >= 0) {
+    if (2 * dx < view_px(texture->w, state)) {
+      return texture->token->offset;
+    }
+    // NOTE: continuation bytes are selected with their codepoint
+    int end = idx + 1;
+    for (; end < textures_count && textures[end]->codepoint == 0; end += 1) {
+      ;
+    }
+    return textures[end - 1]->token->offset +
+           token_bytes(textures[end - 1]->token);
+  }
 
-    highlight_start_x = state->highlight_moving_coord->x;
-    highlight_end_x = state->highlight_stationary_coord->x;
+  int vlen = texture->token->vlen;
+  int chars = texture_chars_at(texture, dx, false, state);
+  if (chars < vlen && 2 * dx > texture_char_x(texture, chars, state) +
+                                   texture_char_x(texture, chars + 1, state)) {
+    chars += 1;
   }
+  if (texture->token->t == TOKEN_TABS) {
+    chars = (chars + TAB_WIDTH / 2) / TAB_WIDTH;
+  }
+  return texture->token->offset + chars;
+}
 
-  for (int i = start_idx; i <= end_idx; i += 1) {
+// NOTE: cost depends only on the visible rows, not the selection size
+void handle_highlight(Texture **textures, int textures_count, State *state) {
+  int start = lt(state->selection_anchor, state->selection_head);
+  int end = gt(state->selection_anchor, state->selection_head);
+  if (state->selection_anchor < 0 || start == end ||
+      state->row_texture_idx == NULL || textures_count <= 0) {
+    return;
+  }
 
-    // NOTE: texture_start_width doesn't account for scroll,
-    // because we want to leave highlight in place when horizontal scrolling
-    int texture_start_width = HORIZONTAL_PADDING + textures[i]->x;
-    int texture_start_height =
-        VERTICAL_PADDING + textures[i]->y + state->vertical_scroll;
-
-    int texture_char_size = textures[i]->w / textures[i]->token->vlen;
-    int highlight_start_offset = 0;
-    int hightlight_end_offset = 0;
-
-    int start_diff = highlight_start_x - texture_start_width;
-    if (i == start_idx && start_diff > 0 &&
-        // only trim highlight start if mouse is inside the token
-        texture_start_width <= highlight_start_x &&
-        highlight_start_x <= texture_start_width + textures[i]->w) {
-      highlight_start_offset =
-          clamp(start_diff - start_diff % texture_char_size, 0, textures[i]->w);
-    }
-    int end_diff = texture_start_width + textures[i]->w - highlight_end_x;
-    if (i == end_idx && end_diff > 0 &&
-        // only trim highlight end if mouse is inside the token
-        texture_start_width <= highlight_end_x &&
-        highlight_start_x <= texture_start_width + textures[i]->w) {
-      hightlight_end_offset =
-          clamp(end_diff - end_diff % texture_char_size, 0, textures[i]->w);
+  // NOTE: only highlight what fits on window, one rect per row
+  int row = row_at_y(
+      clip_top(state) - VERTICAL_PADDING - state->vertical_scroll, state);
+  for (row = gt(row - 1, 0); row < state->rows_count; row += 1) {
+    Texture *first = textures[state->row_texture_idx[row]];
+    Texture *newline = textures[state->row_texture_idx[row + 1] - 1];
+    int y = VERTICAL_PADDING + row_y(row, state) + state->vertical_scroll;
+    if (clip_bottom(state) <= y || end <= first->token->offset) {
+      break;
+    } else if (newline->token->offset < start) {
+      continue;
     }
-
+    layout_row(row, state);
+
+    // NOTE: selection that continues on the next row
+    // covers the rest of the window
+    int x0 = start <= first->token->offset
+                 ? view_px(first->x, state)
+                 : offset_x(textures, start, state);
+    int x1 = newline->token->offset < end
+                 ? gt(view_px(newline->x + newline->w, state),
+                      window_right_x(state))
+                 : offset_x(textures, end, state);
+
+    // NOTE: x doesn't account for scroll,
+    // because we want to leave highlight in place when horizontal scrolling
     SDL_Rect highlight_rect = {
-        texture_start_width + highlight_start_offset + state->horizontal_scroll,
-        texture_start_height,
-        textures[i]->w - (highlight_start_offset + hightlight_end_offset),
-        textures[i]->h};
-    SDL_Color prev = {0};
-    SDL_GetRenderDrawColor(renderer, (Uint8 *)&prev.r, (Uint8 *)&prev.g,
-                           (Uint8 *)&prev.b, (Uint8 *)&prev.a);
-    SDL_SetRenderDrawColor(renderer, color_scheme->mouse_highlight.r,
-                           color_scheme->mouse_highlight.g,
-                           color_scheme->mouse_highlight.b,
-                           color_scheme->mouse_highlight.a);
-
-    SDL_RenderFillRect(renderer, &highlight_rect);
-    SDL_SetRenderDrawColor(renderer, prev.r, prev.g, prev.b, prev.a);
+        HORIZONTAL_PADDING + x0 + state->horizontal_scroll, y, x1 - x0,
+        row_height(state)};
+    draw_list_rect(&state->draw_list, highlight_rect,
+                   color_scheme->mouse_highlight);
   }
 }
 
@@ -463,29 +809,18 @@ void handle_double_click(Texture **textures, int textures_count, int idx,
     idx_local -= 1;
   }
 
-  state->highlight_stationary_texture_idx = idx;
-  state->highlight_moving_texture_idx = idx_local;
-  state->highlight_stationary_coord->x = HORIZONTAL_PADDING + textures[idx]->x;
-  state->highlight_stationary_coord->y = VERTICAL_PADDING + textures[idx]->y;
-  state->highlight_moving_coord->x =
-      HORIZONTAL_PADDING + textures[idx_local]->x + textures[idx_local]->w;
-  state->highlight_moving_coord->y =
-      VERTICAL_PADDING + textures[idx_local]->y + textures[idx_local]->h;
+  state->selection_anchor = textures[idx]->token->offset;
+  state->selection_head = textures[idx_local]->token->offset +
+                          token_bytes(textures[idx_local]->token);
 }
 
-void handle_scrollbars(SDL_Renderer *renderer, State *state) {
-
-  SDL_Color prev = {0};
-  SDL_GetRenderDrawColor(renderer, (Uint8 *)&prev.r, (Uint8 *)&prev.g,
-                         (Uint8 *)&prev.b, (Uint8 *)&prev.a);
+void handle_scrollbars(State *state) {
+  DrawList *list = &state->draw_list;
 
   // vertical scrollbar background
   SDL_Rect vertical_scrollbar_bg_rect = {
       ROW_NUMBER_WIDTH, 0, VERTICAL_SCROLLBAR_WIDTH, state->window_height};
-  SDL_SetRenderDrawColor(
-      renderer, color_scheme->scrollbar_bg.r, color_scheme->scrollbar_bg.g,
-      color_scheme->scrollbar_bg.b, color_scheme->scrollbar_bg.a);
-  SDL_RenderFillRect(renderer, &vertical_scrollbar_bg_rect);
+  draw_list_rect(list, vertical_scrollbar_bg_rect, color_scheme->scrollbar_bg);
 
   // vertical scrollbar foreground
   int height_hundred_percent = state->window_height;
@@ -496,10 +831,7 @@ void handle_scrollbars(SDL_Renderer *renderer, State *state) {
       VERTICAL_SCROLLBAR_WIDTH,
       height_hundred_percent * state->window_height /
           state->max_vertical_offset};
-  SDL_SetRenderDrawColor(
-      renderer, color_scheme->scrollbar_fg.r, color_scheme->scrollbar_fg.g,
-      color_scheme->scrollbar_fg.b, color_scheme->scrollbar_fg.a);
-  SDL_RenderFillRect(renderer, &vertical_scrollbar_fg_rect);
+  draw_list_rect(list, vertical_scrollbar_fg_rect, color_scheme->scrollbar_fg);
 
   // horizontal scrollbar background
   if (state->horizontal_scroll != 0) {
@@ -507,10 +839,8 @@ void handle_scrollbars(SDL_Renderer *renderer, State *state) {
         HORIZONTAL_PADDING - ROW_NUMBER_PADDING,
         state->window_height - HORIZONTAL_SCROLLBAR_HEIGHT, state->window_width,
         HORIZONTAL_SCROLLBAR_HEIGHT};
-    SDL_SetRenderDrawColor(
-        renderer, color_scheme->scrollbar_bg.r, color_scheme->scrollbar_bg.g,
-        color_scheme->scrollbar_bg.b, color_scheme->scrollbar_bg.a);
-    SDL_RenderFillRect(renderer, &horizontal_scrollbar_bg_rect);
+    draw_list_rect(list, horizontal_scrollbar_bg_rect,
+                   color_scheme->scrollbar_bg);
 
     // horizontal scrollbar foreground
     int width_hundred_percent = state->window_width;
@@ -521,13 +851,66 @@ void handle_scrollbars(SDL_Renderer *renderer, State *state) {
         width_hundred_percent * state->window_height /
             state->max_horizontal_offset,
         HORIZONTAL_SCROLLBAR_HEIGHT};
-    SDL_SetRenderDrawColor(
-        renderer, color_scheme->scrollbar_fg.r, color_scheme->scrollbar_fg.g,
-        color_scheme->scrollbar_fg.b, color_scheme->scrollbar_fg.a);
-    SDL_RenderFillRect(renderer, &horizontal_scrollbar_fg_rect);
+    draw_list_rect(list, horizontal_scrollbar_fg_rect,
+                   color_scheme->scrollbar_fg);
+  }
+}
+
+// handle_minimap draws the minimap on the right edge of the window,
+// with the visible rows outlined.
+// NOTE: rects queued so far are drawn under the tiles, the outline is
+// left queued
+void handle_minimap(SDL_Renderer *renderer, State *state) {
+  Minimap *minimap =
+      state->generation != NULL ? state->generation->minimap : NULL;
+  if (minimap == NULL) {
+    return;
+  }
+  int x = state->window_width - MINIMAP_WIDTH;
+  // NOTE: cell 0 is background, others are token types + 1
+  Uint32 palette[TOKEN_TOKEN_COUNT + 1] = {minimap_color(color_scheme->bg)};
+  for (int t = 0; t < TOKEN_TOKEN_COUNT; t += 1) {
+    palette[t + 1] = minimap_color(TOKEN_COLORS[t]);
   }
 
-  SDL_SetRenderDrawColor(renderer, prev.r, prev.g, prev.b, prev.a);
+  SDL_Rect bg_rect = {x, 0, MINIMAP_WIDTH, state->window_height};
+  draw_list_rect(&state->draw_list, bg_rect, color_scheme->bg);
+  draw_list_flush(&state->draw_list, renderer);
+
+  if (state->draw_list.fb != NULL) {
+    // NOTE: cells are colored straight into the frame, tiles aren't needed
+    minimap_blend(state->draw_list.fb, minimap, palette, x,
+                  state->window_height);
+    draw_list_count(&state->draw_list, 0, 1);
+  } else {
+    minimap_upload(renderer, &state->minimap_tiles, minimap, palette,
+                   TOKEN_TOKEN_COUNT + 1);
+    int tiles = minimap_draw(renderer, &state->minimap_tiles, minimap, x,
+                             state->window_height);
+    draw_list_count(&state->draw_list, tiles, tiles);
+  }
+
+  int first_row = row_at_y(-state->vertical_scroll, state);
+  int last_row = row_at_y(state->window_height - state->vertical_scroll, state);
+  int y0 = minimap_line_y(minimap, first_row, state->window_height);
+  int y1 = minimap_line_y(minimap, last_row + 1, state->window_height);
+  SDL_Rect view_rect = {x, y0, MINIMAP_WIDTH, gt(y1 - y0, 1)};
+  draw_list_outline(&state->draw_list, view_rect, color_scheme->scrollbar_fg);
+}
+
+// handle_minimap_click centers the window on the line clicked
+// in the minimap
+void handle_minimap_click(int mouse_y, State *state) {
+  Minimap *minimap = state->generation->minimap;
+  int line = lt(minimap_line_at(minimap, mouse_y, state->window_height),
+                state->rows_count - 1);
+  if (line < 0 ||
+      state->row_texture_idx[line] >= state->generation->textures_count) {
+    return;
+  }
+  int y = row_y(line, state);
+  state->vertical_scroll = clamp(-(y - state->window_height / 2),
+                                 -state->max_vertical_offset, 0);
 }
 
 void handle_actionbox(SDL_Renderer *renderer, State *state, bool handle,
@@ -536,6 +919,11 @@ void handle_actionbox(SDL_Renderer *renderer, State *state, bool handle,
   if (!handle) {
     return;
   }
+  // NOTE: actionbox is at the bottom of the window
+  int actionbox_top = state->window_height - TTF_FontHeight(state->font);
+  if (clip_bottom(state) <= actionbox_top) {
+    return;
+  }
 
   SDL_Surface *actionbox_surface =
       TTF_RenderUTF8_Solid(state->font, buf, color_scheme->actionbox_text_fg);
@@ -545,465 +933,1566 @@ void handle_actionbox(SDL_Renderer *renderer, State *state, bool handle,
     return;
   }
 
-  SDL_Texture *actionbox_texture =
-      SDL_CreateTextureFromSurface(renderer, actionbox_surface);
-
-  if (actionbox_texture == NULL) {
-    fprintf(stderr, "failed to create actionbox text texture: %s\n",
-            SDL_GetError());
-    SDL_FreeSurface(actionbox_surface);
-    return;
-  }
-
   int start_x = 0;
   int start_y = state->window_height - actionbox_surface->h;
 
-  SDL_Color prev = {0};
-  SDL_GetRenderDrawColor(renderer, (Uint8 *)&prev.r, (Uint8 *)&prev.g,
-                         (Uint8 *)&prev.b, (Uint8 *)&prev.a);
   // NOTE: actionbox bar
-  SDL_SetRenderDrawColor(
-      renderer, color_scheme->actionbox_box.r, color_scheme->actionbox_box.g,
-      color_scheme->actionbox_box.b, color_scheme->actionbox_box.a);
   SDL_Rect clearing_rect = {start_x, start_y, state->window_width,
                             actionbox_surface->h};
-  SDL_RenderFillRect(renderer, &clearing_rect);
+  draw_list_rect(&state->draw_list, clearing_rect,
+                 color_scheme->actionbox_box);
 
   // NOTE: actionbox text bg
-  SDL_SetRenderDrawColor(renderer, color_scheme->actionbox_text_bg.r,
-                         color_scheme->actionbox_text_bg.g,
-                         color_scheme->actionbox_text_bg.b,
-                         color_scheme->actionbox_text_bg.a);
   SDL_Rect rect_text_bg = {start_x, start_y, actionbox_surface->w,
                            actionbox_surface->h};
-  SDL_RenderFillRect(renderer, &rect_text_bg);
-
-  SDL_SetRenderDrawColor(renderer, prev.r, prev.g, prev.b, prev.a);
+  draw_list_rect(&state->draw_list, rect_text_bg,
+                 color_scheme->actionbox_text_bg);
+  draw_list_flush(&state->draw_list, renderer);
 
   // NOTE: actionbox text fg
   SDL_Rect rect_text_fg = {start_x, start_y, actionbox_surface->w,
                            actionbox_surface->h};
+  if (state->draw_list.fb != NULL) {
+    fb_blend_surface(state->draw_list.fb, actionbox_surface, rect_text_fg,
+                     color_scheme->actionbox_text_fg);
+    draw_list_count(&state->draw_list, 0, 1);
+    SDL_FreeSurface(actionbox_surface);
+    return;
+  }
+
+  SDL_Texture *actionbox_texture =
+      SDL_CreateTextureFromSurface(renderer, actionbox_surface);
+  if (actionbox_texture == NULL) {
+    fprintf(stderr, "failed to create actionbox text texture: %s\n",
+            SDL_GetError());
+    SDL_FreeSurface(actionbox_surface);
+    return;
+  }
   SDL_RenderCopy(renderer, actionbox_texture, NULL, &rect_text_fg);
+  draw_list_count(&state->draw_list, 1, 1);
 
   SDL_FreeSurface(actionbox_surface);
   SDL_DestroyTexture(actionbox_texture);
 }
 
-void handle_search_results(Texture **textures, int textures_count,
-                           State *state) {
+// handle_search_results finds all occurences of the search
+// in the document contents
+void handle_search_results(State *state) {
+  Document *doc = state->generation->doc;
+  char *query = SEARCH_BUF + 1;
+  int query_len = strlen(query);
+  if (query_len == 0) {
+    return;
+  }
+  char *cur = doc->contents;
+  char *end = doc->contents + doc->contents_len;
+  while (end - cur >= query_len) {
+    cur = memchr(cur, *query, end - cur - query_len + 1);
+    if (cur == NULL) {
+      break;
+    }
+    if (memcmp(cur, query, query_len) == 0) {
+      int start = cur - doc->contents;
+      add_search_result(start, start + query_len);
+    }
+    cur += 1;
+  }
+}
+
+// NOTE: there is small delay when pasting after copying
+// from application, might need to investigate in the future
+void handle_copy_to_clipboard(State *state) {
+  Document *doc = state->generation->doc;
+  int start = clamp(lt(state->selection_anchor, state->selection_head), 0,
+                    doc->contents_len);
+  int end = clamp(gt(state->selection_anchor, state->selection_head), 0,
+                  doc->contents_len);
+  if (state->selection_anchor < 0 || start == end) {
+    return;
+  }
+
+  char *copy_to_clipboard = calloc(end - start + 1, sizeof(char));
+  memcpy(copy_to_clipboard, doc->contents + start, end - start);
+  SDL_SetClipboardText((const char *)copy_to_clipboard);
+  free(copy_to_clipboard);
+}
+
+int digits_count(int n) {
+  int count = 1;
+  for (; n >= 10; n /= 10) {
+    count += 1;
+  }
+  return count;
+}
 
-  char *sliding_window = calloc(SEARCH_BUF_OFFSET, sizeof(char));
-  int sliding_window_filled = 0;
+// update_row_number_width computes the gutter width from
+// the digit count of the last row, nothing is rendered
+void update_row_number_width(State *state) {
+  if (state->metrics == NULL || state->rows_count <= 0) {
+    return;
+  }
+  int digit_advance = 0;
+  for (int digit = '0'; digit <= '9'; digit += 1) {
+    digit_advance =
+        gt(digit_advance, atlas_glyph_metrics(state->metrics, digit)->advance);
+  }
+  ROW_NUMBER_WIDTH =
+      rint(digits_count(state->rows_count) * digit_advance *
+           state->font_scale_factor) +
+      ROW_NUMBER_PADDING;
+  HORIZONTAL_PADDING = HORIZONTAL_PADDING_BASE + ROW_NUMBER_WIDTH;
+}
 
-  int textures_offset_start = 0;
-  int char_offset_start = 0;
+// NOTE: tokenize splits non-ascii bytes into single byte tokens,
+// token_codepoint joins them back into one codepoint.
+// continuation_bytes is set to the number of following tokens
+// that belong to the same codepoint
+int token_codepoint(Token **tokens, int tokens_count, int idx,
+                    int *continuation_bytes) {
+  char buf[4] = {0};
+  int len = 0;
+  for (; len < 4 && idx + len < tokens_count && tokens[idx + len]->vlen == 1;
+       len += 1) {
+    buf[len] = *tokens[idx + len]->v;
+  }
+  int codepoint = ATLAS_REPLACEMENT_CHAR;
+  int seq_len = utf8_decode(buf, len, &codepoint);
+  if (seq_len == 0) {
+    *continuation_bytes = 0;
+    return ATLAS_REPLACEMENT_CHAR;
+  }
+  *continuation_bytes = seq_len - 1;
+  return codepoint;
+}
 
-  int textures_offset_end = 0;
-  int char_offset_end = 0;
+// tokens_to_textures makes textures of tokens of the generation's document
+// and indexes its rows. Textures are placed in their rows when the rows
+// are shown, see layout_row, so nothing here depends on the file's width.
+// Only line height of the atlas is used, so it's safe to call
+// from the builder thread with builder's own atlas.
+// allocs memory
+void tokens_to_textures(Generation *gen, GlyphAtlas *atlas) {
+  Token **tokens = gen->doc->tokens;
+  int tokens_count = gen->doc->tokens_count;
 
-  Coord start_coord = {0};
-  Coord end_coord = {0};
+  Texture **textures = calloc(tokens_count, sizeof(Texture *));
+  int *textures_count = &gen->textures_count;
 
-  while (textures_offset_start < textures_count) {
+  // NOTE: every row ends with a newline token, so there are
+  // at most tokens_count rows
+  gen->row_texture_idx = calloc(tokens_count + 1, sizeof(int));
 
-    int texture_char_size = textures[textures_offset_start]->w /
-                            textures[textures_offset_start]->token->vlen;
+  int row = 0;
+  int col = 0;
 
-    start_coord.x = HORIZONTAL_PADDING + textures[textures_offset_start]->x +
-                    texture_char_size * char_offset_start;
-    start_coord.y = VERTICAL_PADDING + textures[textures_offset_start]->y;
+  int continuation_bytes = 0;
 
-    // NOTE: fill sliding window
-    while (sliding_window_filled <
-           SEARCH_BUF_OFFSET - 1) { // -1 to account for '/'
-      if (char_offset_end >= textures[textures_offset_end]->token->vlen) {
-        textures_offset_end += 1;
-        if (textures_offset_end >= textures_count) {
-          free(sliding_window);
-          return;
-        }
-        char_offset_end = 0;
-      }
-      memcpy(sliding_window + sliding_window_filled,
-             (textures[textures_offset_end]->token->v + char_offset_end), 1);
-      sliding_window_filled += 1;
-      char_offset_end += 1;
+  for (int i = 0; i < tokens_count; i += 1) {
+    int codepoint = -1;
+    if (continuation_bytes > 0) {
+      codepoint = 0;
+      continuation_bytes -= 1;
+    } else if ((unsigned char)*tokens[i]->v >= 0x80) {
+      codepoint =
+          token_codepoint(tokens, tokens_count, i, &continuation_bytes);
     }
 
-    if (strcmp(SEARCH_BUF + 1, sliding_window) == 0) {
-      end_coord.x = HORIZONTAL_PADDING + textures[textures_offset_end]->x +
-                    texture_char_size * char_offset_end;
-      end_coord.y = VERTICAL_PADDING + textures[textures_offset_end]->y;
-      add_search_result(&start_coord, &end_coord, textures_offset_start,
-                        textures_offset_end, state);
+    Texture *tp = calloc(1, sizeof(Texture));
+    tp->token = tokens[i];
+    tp->r = row;
+    tp->c = col;
+    tp->codepoint = codepoint;
+
+    textures[*textures_count] = tp;
+    *textures_count += 1;
+
+    if (tokens[i]->t == TOKEN_NEWLINE) {
+      col = 0;
+      row += 1;
+      gen->row_texture_idx[row] = i + 1;
+    } else {
+      col += tokens[i]->vlen;
     }
+  }
 
-    sliding_window_filled -= 1;
-    memmove(sliding_window, sliding_window + 1, SEARCH_BUF_OFFSET - 2);
+  gen->row_laid_out = calloc(row + 1, sizeof(bool));
+  gen->line_height = atlas->line_height;
+  gen->max_horizontal_offset = 1;
+  // NOTE: rows aren't wrapped, so the height comes from the row count
+  gen->max_vertical_offset = gt(row * atlas->line_height, 1);
+  gen->rows_count = row;
+  gen->textures = textures;
+  gen->font_size = atlas->font_size;
+}
 
-    char_offset_start += 1;
-    if (char_offset_start >= textures[textures_offset_start]->token->vlen) {
-      textures_offset_start += 1;
-      if (textures_offset_start >= textures_count) {
-        free(sliding_window);
-        return;
-      }
-      char_offset_start = 0;
+// build_minimap colors the minimap from the layout of the generation
+// allocs memory
+Minimap *build_minimap(Generation *gen) {
+  Minimap *minimap = minimap_create(gen->rows_count);
+  for (int i = 0; i < gen->textures_count; i += 1) {
+    Texture *texture = gen->textures[i];
+    enum TOKEN_TYPE t = texture->token->t;
+    if (t == TOKEN_NEWLINE || t == TOKEN_SPACES || t == TOKEN_TABS ||
+        texture->codepoint == 0) {
+      continue;
     }
+    minimap_fill(minimap, texture->r, texture->c,
+                 texture->codepoint > 0 ? 1 : texture->token->vlen, t + 1);
   }
+  minimap_finish(minimap);
+  return minimap;
+}
 
-  free(sliding_window);
+// frees memory
+void free_textures(Texture **textures, int textures_count) {
+  if (textures == NULL) {
+    return;
+  }
+  if (RUN_CACHE_LOCK != NULL) {
+    SDL_LockMutex(RUN_CACHE_LOCK);
+  }
+  for (int i = 0; i < textures_count; i++) {
+    if (textures[i] != NULL) {
+      run_release(&run_cache, textures[i]->run);
+      free(textures[i]);
+    }
+  }
+  if (RUN_CACHE_LOCK != NULL) {
+    SDL_UnlockMutex(RUN_CACHE_LOCK);
+  }
+  free(textures);
 }
 
-// NOTE: code shared with handle_highlight, but too early to abstract
-// anything. Just a note that any changes here might also be needed to be done
-// in handle_highlight. NOTE: there is small delay when pasting after copying
-// from application, might need to investigate in the future
-void handle_copy_to_clipboard(Texture **textures, int textures_count,
-                              State *state) {
-  if (
-      // stationary token index was neg
-      state->highlight_stationary_texture_idx < 0 ||
-      // mouse click, no moving
-      (state->highlight_stationary_coord->x ==
-           state->highlight_moving_coord->x &&
-       state->highlight_stationary_coord->y ==
-           state->highlight_moving_coord->y)) {
+void update_clearing_texture(SDL_Renderer *renderer, State *state) {
+  if (state->clearing != NULL) {
+    SDL_DestroyTexture(state->clearing);
+  }
+  state->clearing = SDL_CreateTexture(renderer, 0, 0, state->window_width,
+                                      state->window_height);
+  SDL_SetTextureColorMod(state->clearing, color_scheme->bg.r,
+                         color_scheme->bg.g, color_scheme->bg.b);
+}
+
+// frees memory
+void document_release(Document *doc) {
+  if (doc == NULL) {
+    return;
+  }
+  doc->refs -= 1;
+  if (doc->refs > 0) {
     return;
   }
+  free_tokens(doc->tokens, doc->tokens_count);
+  free_contents(doc->contents);
+  if (doc->line_hashes != NULL) {
+    free(doc->line_hashes);
+  }
+  free(doc);
+}
 
-  int start_idx = state->highlight_stationary_texture_idx;
-  int end_idx = state->highlight_moving_texture_idx;
+// hash_lines hashes types and values of the tokens of each line,
+// so a reload can tell which lines changed
+// allocs memory
+void hash_lines(Document *doc) {
+  // NOTE: every line ends with a newline token
+  doc->line_hashes = calloc(doc->tokens_count + 1, sizeof(uint64_t));
+  doc->lines_count = 0;
+  uint64_t hash = 14695981039346656037ull; // NOTE: FNV-1a
+  for (int i = 0; i < doc->tokens_count; i += 1) {
+    Token *token = doc->tokens[i];
+    hash = (hash ^ (uint64_t)token->t) * 1099511628211ull;
+    for (int j = 0; j < token->vlen; j += 1) {
+      hash = (hash ^ (unsigned char)token->v[j]) * 1099511628211ull;
+    }
+    if (token->t == TOKEN_NEWLINE) {
+      doc->line_hashes[doc->lines_count] = hash;
+      doc->lines_count += 1;
+      hash = 14695981039346656037ull;
+    }
+  }
+}
 
-  int highlight_start_x = state->highlight_stationary_coord->x;
-  int highlight_end_x = state->highlight_moving_coord->x;
+// diff_lines counts the lines old and doc have in common at the start
+// and at the end, lines between them changed
+void diff_lines(Document *old, Document *doc, int *prefix, int *suffix) {
+  int common = lt(old->lines_count, doc->lines_count);
+  *prefix = 0;
+  while (*prefix < common &&
+         old->line_hashes[*prefix] == doc->line_hashes[*prefix]) {
+    *prefix += 1;
+  }
+  *suffix = 0;
+  while (*suffix < common - *prefix &&
+         old->line_hashes[old->lines_count - 1 - *suffix] ==
+             doc->line_hashes[doc->lines_count - 1 - *suffix]) {
+    *suffix += 1;
+  }
+}
 
-  if (end_idx < start_idx) {
-    start_idx = state->highlight_moving_texture_idx;
-    end_idx = state->highlight_stationary_texture_idx;
+// frees memory
+void free_generation(Generation *gen) {
+  if (gen == NULL) {
+    return;
+  }
+  free_textures(gen->textures, gen->textures_count);
+  if (gen->row_texture_idx != NULL) {
+    free(gen->row_texture_idx);
+  }
+  if (gen->row_laid_out != NULL) {
+    free(gen->row_laid_out);
+  }
+  document_release(gen->doc);
+  free_minimap(gen->minimap);
+  free(gen);
+}
 
-    highlight_start_x = state->highlight_moving_coord->x;
-    highlight_end_x = state->highlight_stationary_coord->x;
+// NOTE: contents is NULL when only the layout changes,
+// then the last built document is reused
+typedef struct {
+  char *contents;
+  int contents_len;
+  int font_size;
+} BuildRequest;
+
+typedef struct {
+  SDL_Thread *thread;
+  TokenizerConfig *tokenizer_config;
+  //
+  SDL_mutex *lock;
+  SDL_cond *wake;
+  // NOTE: guarded by lock
+  BuildRequest request;
+  bool has_request;
+  bool quit;
+  Generation *retired;
+  //
+  void *ready; // NOTE: newest built generation, swapped atomically
+  // NOTE: owned by the builder thread
+  GlyphAtlas *metrics;
+  Document *doc;
+  int generations_count;
+  int last_font_size;
+  Uint64 layout_ticks;
+  Uint64 minimap_ticks;
+  long diffed_reloads;
+  long changed_rows;
+} Builder;
+
+Uint32 GENERATION_READY_EVENT = (Uint32)-1; // NOTE: registered in gui_loop
+
+// builder_publish makes gen the newest built generation
+// and wakes the main loop to adopt it
+void builder_publish(Builder *builder, Generation *gen) {
+  // NOTE: generation that was never adopted is replaced
+  free_generation(SDL_AtomicSetPtr(&builder->ready, gen));
+  if (GENERATION_READY_EVENT != (Uint32)-1) {
+    SDL_Event event = {.type = GENERATION_READY_EVENT};
+    SDL_PushEvent(&event);
   }
+}
 
-  int copy_text_len = 0;
-  for (int i = start_idx; i <= end_idx; i += 1) {
-    copy_text_len += textures[i]->token->vlen;
+// build_generation tokenizes and lays out requested contents.
+// NOTE: called on the builder thread, or before it's started
+// allocs memory
+Generation *build_generation(Builder *builder, BuildRequest *request) {
+  if (builder->metrics == NULL ||
+      builder->metrics->font_size != request->font_size) {
+    atlas_free(builder->metrics);
+    builder->metrics = atlas_create(GUI_FONT, request->font_size);
+    if (builder->metrics == NULL) {
+      free_contents(request->contents);
+      return NULL;
+    }
   }
 
-  char *copy_to_clipboard = calloc(copy_text_len + 1, sizeof(char));
+  // NOTE: on reload only the lines that changed since the last
+  // generation have to be drawn again, see damage_changed_rows
+  bool is_diffed = false;
+  int prefix = 0;
+  int suffix = 0;
+  int rows_shift = 0;
+  if (request->contents != NULL) {
+    Document *doc = calloc(1, sizeof(Document));
+    doc->refs = 1;
+    doc->tokens = tokenize(request->contents, request->contents_len,
+                           builder->tokenizer_config, &doc->tokens_count);
+    doc->contents = request->contents;
+    doc->contents_len = request->contents_len;
+    hash_lines(doc);
+    if (builder->doc != NULL) {
+      diff_lines(builder->doc, doc, &prefix, &suffix);
+      rows_shift = doc->lines_count - builder->doc->lines_count;
+      is_diffed = builder->last_font_size == request->font_size;
+    }
+    document_release(builder->doc);
+    builder->doc = doc;
+  }
+  if (builder->doc == NULL) {
+    return NULL;
+  }
 
-  int offset = 0;
-  for (int i = start_idx; i <= end_idx; i += 1) {
+  Generation *gen = calloc(1, sizeof(Generation));
+  builder->generations_count += 1;
+  gen->id = builder->generations_count;
+  gen->doc = builder->doc;
+  gen->doc->refs += 1;
+  Uint64 start = SDL_GetPerformanceCounter();
+  tokens_to_textures(gen, builder->metrics);
+  builder->layout_ticks += SDL_GetPerformanceCounter() - start;
+  if (is_diffed) {
+    // NOTE: previous generation has the previous id
+    gen->base_id = gen->id - 1;
+    gen->changed_first_row = prefix;
+    gen->changed_rows_end = gen->rows_count - suffix;
+    gen->rows_shift = rows_shift;
+    builder->diffed_reloads += 1;
+    builder->changed_rows += gen->changed_rows_end - prefix;
+  }
+  builder->last_font_size = request->font_size;
+  if (SHOW_MINIMAP) {
+    start = SDL_GetPerformanceCounter();
+    gen->minimap = build_minimap(gen);
+    builder->minimap_ticks += SDL_GetPerformanceCounter() - start;
+  }
+  return gen;
+}
 
-    int texture_start_width =
-        HORIZONTAL_PADDING + textures[i]->x + state->horizontal_scroll;
-    // int texture_start_height = VERTICAL_PADDING + textures[i]->y +
-    // state->vertical_scroll;
+// frees memory
+void builder_reclaim(Builder *builder) {
+  SDL_LockMutex(builder->lock);
+  Generation *retired = builder->retired;
+  builder->retired = NULL;
+  SDL_UnlockMutex(builder->lock);
+
+  while (retired != NULL) {
+    Generation *next = retired->next;
+    free_generation(retired);
+    retired = next;
+  }
+}
 
-    int texture_char_size = textures[i]->w / textures[i]->token->vlen;
-    int highlight_start_offset = 0;
-    int hightlight_end_offset = 0;
+int builder_run(void *data) {
+  Builder *builder = data;
+  while (true) {
+    SDL_LockMutex(builder->lock);
+    while (!builder->quit && !builder->has_request &&
+           builder->retired == NULL) {
+      SDL_CondWait(builder->wake, builder->lock);
+    }
+    if (builder->quit) {
+      SDL_UnlockMutex(builder->lock);
+      break;
+    }
+    bool has_request = builder->has_request;
+    BuildRequest request = builder->request;
+    builder->has_request = false;
+    SDL_UnlockMutex(builder->lock);
 
-    int start_diff = highlight_start_x - texture_start_width;
-    if (i == start_idx && start_diff > 0 &&
-        // only trim highlight start if mouse is inside the token
-        texture_start_width <= highlight_start_x &&
-        highlight_start_x <= texture_start_width + textures[i]->w) {
-      highlight_start_offset =
-          clamp(start_diff - start_diff % texture_char_size, 0, textures[i]->w);
+    builder_reclaim(builder);
+    if (!has_request) {
+      continue;
     }
-    int end_diff = texture_start_width + textures[i]->w - highlight_end_x;
-    if (i == end_idx && end_diff > 0 &&
-        // only trim highlight end if mouse is inside the token
-        texture_start_width <= highlight_end_x &&
-        highlight_start_x <= texture_start_width + textures[i]->w) {
-      hightlight_end_offset =
-          clamp(end_diff - end_diff % texture_char_size, 0, textures[i]->w);
+
+    Generation *gen = build_generation(builder, &request);
+    if (gen != NULL) {
+      builder_publish(builder, gen);
     }
+  }
+  return EXIT_SUCCESS;
+}
 
-    int start_char_offset = highlight_start_offset / texture_char_size;
-    int end_char_offset = hightlight_end_offset / texture_char_size;
+// builder_post requests a new generation, replacing a pending request.
+// Builder takes ownership of the contents, NULL contents only change
+// the layout
+void builder_post(Builder *builder, char *contents, int contents_len,
+                  int font_size) {
+  // NOTE: without the builder thread, build right away
+  if (builder->thread == NULL) {
+    BuildRequest request = {contents, contents_len, font_size};
+    builder_reclaim(builder);
+    Generation *gen = build_generation(builder, &request);
+    if (gen != NULL) {
+      builder_publish(builder, gen);
+    }
+    return;
+  }
 
-    memcpy(copy_to_clipboard + offset,
-           textures[i]->token->v + start_char_offset,
-           textures[i]->token->vlen - end_char_offset);
-    offset += textures[i]->token->vlen - start_char_offset - end_char_offset;
+  SDL_LockMutex(builder->lock);
+  BuildRequest *request = &builder->request;
+  if (builder->has_request && contents == NULL) {
+    // NOTE: keep pending contents, only the layout parameters change
+    contents = request->contents;
+    contents_len = request->contents_len;
+  } else if (builder->has_request) {
+    free_contents(request->contents);
   }
-  SDL_SetClipboardText((const char *)copy_to_clipboard);
-  free(copy_to_clipboard);
+  *request = (BuildRequest){
+      .contents = contents,
+      .contents_len = contents_len,
+      .font_size = font_size,
+  };
+  builder->has_request = true;
+  SDL_CondSignal(builder->wake);
+  SDL_UnlockMutex(builder->lock);
 }
 
+// builder_start builds the first generation of contents right away
+// and starts the builder thread for the following ones.
+// Builder takes ownership of the contents
 // allocs memory
-void row_nrs_to_textures(SDL_Renderer *renderer, int font_size, int rows,
-                         State *state) {
-  Texture **textures = calloc(rows, sizeof(Texture *));
-
-  SDL_Color color = color_scheme->numbers;
+Builder *builder_start(TokenizerConfig *tokenizer_config, char *contents,
+                       int contents_len, int font_size) {
+  Builder *builder = calloc(1, sizeof(Builder));
+  builder->tokenizer_config = tokenizer_config;
+  builder->lock = SDL_CreateMutex();
+  builder->wake = SDL_CreateCond();
+
+  BuildRequest request = {0};
+  request.contents = contents;
+  request.contents_len = contents_len;
+  request.font_size = font_size;
+  SDL_AtomicSetPtr(&builder->ready, build_generation(builder, &request));
+
+  builder->thread = SDL_CreateThread(builder_run, "builder", builder);
+  if (builder->thread == NULL) {
+    fprintf(stderr, "failed to create builder thread: %s\n", SDL_GetError());
+  }
+  return builder;
+}
 
-  int local_vertical_offset = 0;
+void print_layout_stats(Builder *builder) {
+  double frequency = (double)SDL_GetPerformanceFrequency();
+  GlyphAtlas *metrics = builder->metrics;
+  printf("[STATS]: layout: %d generations, %.2fms per layout, %s\n",
+         builder->generations_count,
+         builder->generations_count > 0 && frequency > 0
+             ? 1000.0 * builder->layout_ticks / frequency /
+                   builder->generations_count
+             : 0.0,
+         metrics != NULL && metrics->monospace_advance > 0
+             ? "monospace"
+             : "proportional");
+  printf("[STATS]: reload: %ld diffed, %.1f changed rows per reload\n",
+         builder->diffed_reloads,
+         builder->diffed_reloads > 0
+             ? (double)builder->changed_rows / builder->diffed_reloads
+             : 0.0);
+  if (SHOW_MINIMAP) {
+    printf("[STATS]: minimap: %.2fms per build\n",
+           builder->generations_count > 0 && frequency > 0
+               ? 1000.0 * builder->minimap_ticks / frequency /
+                     builder->generations_count
+               : 0.0);
+  }
+}
 
-  char buf[10] = {0};
+// frees memory
+void builder_stop(Builder *builder) {
+  if (builder == NULL) {
+    return;
+  }
+  SDL_LockMutex(builder->lock);
+  builder->quit = true;
+  SDL_CondSignal(builder->wake);
+  SDL_UnlockMutex(builder->lock);
+  if (builder->thread != NULL) {
+    SDL_WaitThread(builder->thread, NULL);
+  }
+  if (PRINT_STATS) {
+    print_layout_stats(builder);
+  }
 
-  for (int i = 0; i < rows; i += 1) {
+  builder_reclaim(builder);
+  if (builder->has_request) {
+    free_contents(builder->request.contents);
+  }
+  free_generation(SDL_AtomicSetPtr(&builder->ready, NULL));
+  document_release(builder->doc);
+  atlas_free(builder->metrics);
+  SDL_DestroyCond(builder->wake);
+  SDL_DestroyMutex(builder->lock);
+  free(builder);
+}
 
-    snprintf(buf, sizeof(buf), "%d", i + 1);
-    SDL_Surface *row_nr_surface = TTF_RenderUTF8_Solid(state->font, buf, color);
-    if (row_nr_surface == NULL) {
-      fprintf(stderr, "failed to create row nr surface: %s\n", TTF_GetError());
-      return;
+// take_zoom_atlas removes the kept atlas of font_size and returns it,
+// NULL if there isn't one. line_height is only checked for sdf atlases
+GlyphAtlas *take_zoom_atlas(State *state, int font_size, int line_height) {
+  for (int i = 0; i < ZOOM_ATLASES_CAP; i += 1) {
+    GlyphAtlas *atlas = state->zoom_atlases[i];
+    if (atlas == NULL || atlas->font_size != font_size ||
+        (atlas->sdf != NULL && atlas->line_height != line_height)) {
+      continue;
     }
-    memset(buf, '\0', sizeof(buf));
+    memmove(&state->zoom_atlases[i], &state->zoom_atlases[i + 1],
+            (ZOOM_ATLASES_CAP - i - 1) * sizeof(GlyphAtlas *));
+    state->zoom_atlases[ZOOM_ATLASES_CAP - 1] = NULL;
+    return atlas;
+  }
+  return NULL;
+}
 
-    SDL_Texture *row_nr_texture =
-        SDL_CreateTextureFromSurface(renderer, row_nr_surface);
+// keep_zoom_atlas releases textures of the atlas and keeps it as the most
+// recent one, the least recent atlas is freed if there are too many
+void keep_zoom_atlas(State *state, GlyphAtlas *atlas) {
+  if (atlas == NULL) {
+    return;
+  }
+  atlas_unload(atlas);
+  atlas_free(state->zoom_atlases[ZOOM_ATLASES_CAP - 1]);
+  memmove(&state->zoom_atlases[1], &state->zoom_atlases[0],
+          (ZOOM_ATLASES_CAP - 1) * sizeof(GlyphAtlas *));
+  state->zoom_atlases[0] = atlas;
+}
+
+// update_draw_atlas switches the glyph atlas to the current FONT_SIZE.
+// NOTE: sdf atlases only resample distance fields of the glyphs,
+// without sdf the font is rasterized in the new size.
+// Atlases of recent sizes are kept, so zooming back to them
+// only uploads their pages again
+void update_draw_atlas(State *state) {
+  if (state->atlas != NULL && state->atlas->font_size == FONT_SIZE) {
+    return;
+  }
+  int line_height = 0;
+  bool is_sdf = state->sdf != NULL && state->metrics != NULL;
+  if (is_sdf) {
+    // NOTE: glyphs are as high as the scaled rows, so they aren't scaled
+    line_height = rint(state->metrics->line_height * state->font_scale_factor);
+  }
+  state->zoom_switches += state->atlas != NULL;
+  GlyphAtlas *atlas = take_zoom_atlas(state, FONT_SIZE, line_height);
+  if (atlas != NULL) {
+    state->zoom_hits += 1;
+  } else if (is_sdf) {
+    atlas = atlas_create_sdf(state->sdf, FONT_SIZE, line_height);
+  } else {
+    atlas = atlas_create(GUI_FONT, FONT_SIZE);
+  }
+  if (atlas == NULL) {
+    return; // NOTE: previous atlas is scaled instead
+  }
+  keep_zoom_atlas(state, state->atlas);
+  state->atlas = atlas;
+}
+
+// adopt_generation swaps in the newest built generation, if there is one.
+// NOTE: called between frames, when the previous generation isn't used
+// by any frame anymore, so it's retired right away.
+// returns true if the generation was swapped
+bool adopt_generation(Builder *builder, State *state) {
+  if (SDL_AtomicGetPtr(&builder->ready) == NULL) {
+    return false;
+  }
+  Generation *gen = SDL_AtomicSetPtr(&builder->ready, NULL);
+  if (gen == NULL) {
+    return false;
+  }
 
-    if (row_nr_texture == NULL) {
-      fprintf(stderr, "failed to create row nr texture: %s\n", SDL_GetError());
-      return;
+  Generation *prev = state->generation;
+
+  if (state->metrics == NULL || state->metrics->font_size != gen->font_size) {
+    atlas_free(state->metrics);
+    state->metrics = atlas_create(GUI_FONT, gen->font_size);
+  }
+
+  state->generation = gen;
+  state->rows_count = gen->rows_count;
+  state->row_texture_idx = gen->row_texture_idx;
+  // NOTE: text follows the adopted contents, so its lines are the rows.
+  // Generations that only change the layout share the document
+  if (prev == NULL || prev->doc != gen->doc) {
+    piece_table_update(state->text, gen->doc->contents,
+                       gen->doc->contents_len);
+  }
+
+  BASE_FONT_SIZE = gen->font_size;
+  zoom_view(state);
+  update_draw_atlas(state);
+
+  state->vertical_scroll =
+      clamp(state->vertical_scroll, -state->max_vertical_offset, 0);
+  // NOTE: snap back if text fits on screen, but horizontal scroll is non-zero.
+  // Only the rows around the window are known, the rest isn't laid out
+  layout_window_rows(state);
+  if (state->max_horizontal_offset < state->window_width) {
+    state->horizontal_scroll = 0;
+  }
+  update_row_number_width(state);
+  // NOTE: selection is kept in bytes, the reloaded file might be shorter
+  if (state->selection_anchor >= 0) {
+    state->selection_anchor =
+        clamp(state->selection_anchor, 0, gen->doc->contents_len);
+    state->selection_head =
+        clamp(state->selection_head, 0, gen->doc->contents_len);
+  }
+
+  if (prev != NULL) {
+    SDL_LockMutex(builder->lock);
+    prev->next = builder->retired;
+    builder->retired = prev;
+    SDL_CondSignal(builder->wake);
+    SDL_UnlockMutex(builder->lock);
+  }
+  return true;
+}
+
+// row_cache_epoch hashes everything glyph quads of a row depend on,
+// besides its tokens
+uint64_t row_cache_epoch(State *state) {
+  uint64_t values[] = {
+      state->atlas->id,
+      state->atlas->evictions,
+      state->metrics->id,
+      (uintptr_t)color_scheme,
+      (uint64_t)lrintf(state->font_scale_factor * 1000000),
+  };
+  uint64_t hash = 14695981039346656037ull; // NOTE: FNV-1a
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i += 1) {
+    hash = (hash ^ values[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// cache_row_quads fills the cached row with glyph quads of the row that
+// start in the segment, relative to the start of the row
+void cache_row_quads(SDL_Renderer *renderer, Texture **textures, int row,
+                     int segment, CachedRow *cached, State *state) {
+  GlyphAtlas *atlas = state->atlas;
+  int segment_x = segment * ROW_CACHE_SEGMENT_WIDTH;
+  int segment_end = segment_x + ROW_CACHE_SEGMENT_WIDTH;
+  int newline_idx = state->row_texture_idx[row + 1] - 1;
+  for (int i = row_texture_at_x(textures, row, segment_x, state);
+       i < newline_idx && view_px(textures[i]->x, state) < segment_end;
+       i += 1) {
+    Texture *texture = textures[i];
+    if (texture->codepoint == 0) {
+      continue;
     }
+    // NOTE: glyphs are placed with advances of the layout,
+    // and drawn from the atlas of the current font size
+    float layout_scale = state->font_scale_factor;
+    float scale = (float)row_height(state) / atlas->line_height;
+    float pen_x = view_px(texture->x, state);
+    for (int j = 0; j < texture->token->vlen && pen_x < segment_end;
+         j += 1) {
+      int codepoint =
+          texture->codepoint > 0 ? texture->codepoint : texture->token->v[j];
+      int advance = atlas_glyph_metrics(state->metrics, codepoint)->advance;
+      // NOTE: glyphs of a token left of the segment are only measured
+      Glyph *glyph = pen_x >= segment_x
+                         ? atlas_glyph(atlas, renderer, codepoint)
+                         : NULL;
+      if (glyph != NULL && glyph->page >= 0) {
+        // NOTE: page isn't evicted while the rest of the row is rasterized
+        atlas->pages[glyph->page].last_used_frame = atlas->frame;
+        SDL_FRect dst = {pen_x, 0, glyph->rect.w * scale,
+                         glyph->rect.h * scale};
+        SDL_Vertex vertices[4];
+        atlas_glyph_quad(glyph, dst, TOKEN_COLORS[texture->token->t],
+                         vertices);
+        cached_row_add(cached, glyph->page, vertices);
+      }
+      pen_x += advance * layout_scale;
+      if (texture->codepoint > 0) {
+        break;
+      }
+    }
+  }
+}
 
-    /*
-      worst to best scaled font
-      SDL_ScaleModeNearest < nearest pixel sampling>
-      SDL_ScaleModeLinear < linear filtering>
-      SDL_ScaleModeBest < anisotropic filtering>
-    */
-    SDL_SetTextureScaleMode(row_nr_texture, SDL_ScaleModeBest);
+// cached_row_segment returns the cached segment of the row,
+// its quads are made if it isn't cached
+CachedRow *cached_row_segment(SDL_Renderer *renderer, Texture **textures,
+                              int row, int segment, State *state) {
+  uint64_t hash = state->generation->doc->line_hashes[row];
+  // NOTE: rasterizing glyphs might evict pages and change the epoch
+  row_cache_begin(&state->row_cache, row_cache_epoch(state));
+  bool is_new = false;
+  CachedRow *cached = row_cache_get(&state->row_cache, hash, segment, &is_new);
+  if (is_new) {
+    cache_row_quads(renderer, textures, row, segment, cached, state);
+    if (row_cache_epoch(state) != state->row_cache.epoch) {
+      // NOTE: an evicted page might have had glyphs of the row
+      row_cache_begin(&state->row_cache, row_cache_epoch(state));
+      cached = row_cache_get(&state->row_cache, hash, segment, &is_new);
+      cache_row_quads(renderer, textures, row, segment, cached, state);
+    }
+  }
+  return cached;
+}
 
-    Texture *tp = calloc(1, sizeof(Texture));
-    tp->texture = row_nr_texture;
-    tp->token = NULL;
-    tp->x = 0;
-    tp->y = local_vertical_offset;
-    tp->w = row_nr_surface->w;
-    tp->h = row_nr_surface->h;
-    tp->r = i + 1;
-    tp->c = 0;
+// batch_row queues glyph quads of the row that are in the window,
+// the row starts at x, y
+void batch_row(SDL_Renderer *renderer, Texture **textures, int row, int x,
+               int y, State *state) {
+  // NOTE: only the slice of the row in the window is queued. A glyph is
+  // in the segment it starts in, glyphs aren't wider than a row is high
+  float left = window_left_x(state);
+  float right = window_right_x(state);
+  int first_segment =
+      gt(floorf((left - row_height(state)) / ROW_CACHE_SEGMENT_WIDTH), 0);
+  int last_segment = gt(floorf(right / ROW_CACHE_SEGMENT_WIDTH), 0);
+  for (int segment = first_segment; segment <= last_segment; segment += 1) {
+    CachedRow *cached =
+        cached_row_segment(renderer, textures, row, segment, state);
+    for (int i = cached_row_first_quad(cached, left);
+         i < cached->quads_count &&
+         cached->quads[i].vertices[0].position.x <= right;
+         i += 1) {
+      atlas_batch_quad(state->atlas, cached->quads[i].page,
+                       cached->quads[i].vertices, x, y);
+    }
+  }
+}
 
-    local_vertical_offset += row_nr_surface->h;
-    textures[i] = tp;
+// raster_rows rasterizes missing glyphs of rows first to last that are
+// in the window, all of them in one batch (see raster_pool.h)
+void raster_rows(SDL_Renderer *renderer, Texture **textures, int first,
+                 int last, State *state) {
+  if (state->atlas == NULL) {
+    return;
+  }
+  int count = 0;
+  for (int row = gt(first, 0); row <= lt(last, state->rows_count - 1);
+       row += 1) {
+    int newline_idx = state->row_texture_idx[row + 1] - 1;
+    for (int i = row_texture_at_x(textures, row, window_left_x(state), state);
+         i < newline_idx &&
+         view_px(textures[i]->x, state) <= window_right_x(state);
+         i += 1) {
+      Texture *texture = textures[i];
+      if (texture->codepoint == 0) {
+        continue;
+      }
+      int vlen = texture->codepoint > 0 ? 1 : texture->token->vlen;
+      for (int j = 0; j < vlen; j += 1) {
+        int codepoint =
+            texture->codepoint > 0 ? texture->codepoint : texture->token->v[j];
+        if (!atlas_is_missing(state->atlas, codepoint)) {
+          continue;
+        }
+        if (count == state->raster_codepoints_cap) {
+          state->raster_codepoints_cap =
+              gt(2 * state->raster_codepoints_cap, 256);
+          state->raster_codepoints =
+              realloc(state->raster_codepoints,
+                      state->raster_codepoints_cap * sizeof(int));
+        }
+        state->raster_codepoints[count] = codepoint;
+        count += 1;
+      }
+    }
+  }
+  raster_glyphs(state->raster_pool, state->atlas, renderer,
+                state->raster_codepoints, count);
+}
+
+// prefetch_glyphs rasterizes glyphs of the rows just outside the window
+// in the scroll direction, so they are ready when they are scrolled into view
+void prefetch_glyphs(SDL_Renderer *renderer, Texture **textures,
+                     int first_visible_row, int last_visible_row,
+                     State *state) {
+  if (first_visible_row < 0 || last_visible_row < 0) {
+    return;
+  }
+  if (state->scroll_direction < 0) {
+    raster_rows(renderer, textures, first_visible_row - GLYPH_PREFETCH_ROWS,
+                first_visible_row - 1, state);
+  } else {
+    raster_rows(renderer, textures, last_visible_row + 1,
+                last_visible_row + GLYPH_PREFETCH_ROWS, state);
+  }
+}
 
-    SDL_FreeSurface(row_nr_surface);
+// handle_row_numbers draws numbers of the visible rows
+// from the digit glyphs of the atlas
+void handle_row_numbers(SDL_Renderer *renderer, State *state) {
+  if (state->atlas == NULL || state->metrics == NULL ||
+      state->row_texture_idx == NULL) {
+    return;
   }
+  char buf[12] = {0};
+
+  int first_row = row_at_y(
+      clip_top(state) - VERTICAL_PADDING - state->vertical_scroll, state);
+  for (int i = gt(first_row - 1, 0); i < state->rows_count; i += 1) {
+    float layout_scale = state->font_scale_factor;
+    int row_h = row_height(state);
+    float scale = (float)row_h / state->atlas->line_height;
+
+    int texture_start_height =
+        VERTICAL_PADDING + row_y(i, state) + state->vertical_scroll;
+
+    // NOTE: only render what fits on window
+    // continue if before window
+    // break if after window
+    if (texture_start_height + row_h < clip_top(state)) {
+      continue;
+    } else if (clip_bottom(state) <= texture_start_height) {
+      break;
+    }
+
+    int len = snprintf(buf, sizeof(buf), "%d", i + 1);
+    float w = 0;
+    for (int j = 0; j < len; j += 1) {
+      w += atlas_glyph_metrics(state->metrics, buf[j])->advance * layout_scale;
+    }
 
-  state->row_nr_textures = textures;
-  state->rows_count = rows;
+    float pen_x = ROW_NUMBER_WIDTH - ROW_NUMBER_PADDING / 2 - w;
+    for (int j = 0; j < len; j += 1) {
+      int advance = atlas_glyph_metrics(state->metrics, buf[j])->advance;
+      Glyph *glyph = atlas_glyph(state->atlas, renderer, buf[j]);
+      SDL_FRect dst = {pen_x, texture_start_height, glyph->rect.w * scale,
+                       glyph->rect.h * scale};
+      atlas_batch_glyph(state->atlas, glyph, dst, color_scheme->numbers);
+      pen_x += advance * layout_scale;
+    }
+  }
+  atlas_flush(state->atlas, renderer, &state->draw_list);
 }
 
-// allocs memory
-Texture **tokens_to_textures(SDL_Renderer *renderer, int font_size,
-                             Token **tokens, int tokens_count,
-                             int *textures_count, State *state) {
-  Texture **textures = calloc(tokens_count, sizeof(Texture *));
+int cpy_to_renderer(SDL_Renderer *renderer, Texture **textures,
+                    int textures_count, State *state) {
+
+  // NOTE: highlight is under the text
+  handle_highlight(textures, textures_count, state);
+  draw_list_flush(&state->draw_list, renderer);
+
+  atlas_begin_frame(state->atlas);
+  int first_visible_row = -1;
+  int last_visible_row = -1;
+
+  // NOTE: text isn't drawn left of HORIZONTAL_PADDING
+  int first_row = state->rows_count;
+  if (state->row_texture_idx != NULL &&
+      (state->clip == NULL ||
+       HORIZONTAL_PADDING < state->clip->x + state->clip->w)) {
+    first_row = first_row_at(clip_top(state), state);
+    // NOTE: glyphs missing from the rows in the window are rasterized
+    // together, before the rows are drawn
+    raster_rows(renderer, textures, first_row,
+                row_at_y(clip_bottom(state) - VERTICAL_PADDING -
+                             state->vertical_scroll,
+                         state),
+                state);
+  }
+
+  for (int row = first_row; row < state->rows_count; row += 1) {
+    int row_h = row_height(state);
+    int texture_start_height =
+        VERTICAL_PADDING + row_y(row, state) + state->vertical_scroll;
+
+    // NOTE: only render what fits on window
+    // continue if before window
+    // break if after window
+    if (texture_start_height + row_h < VERTICAL_PADDING ||
+        texture_start_height + row_h < clip_top(state)) {
+      continue;
+    } else if (clip_bottom(state) <= texture_start_height) {
+      break;
+    }
+
+    if (first_visible_row < 0) {
+      first_visible_row = row;
+    }
+    last_visible_row = row;
+
+    batch_row(renderer, textures, row,
+              HORIZONTAL_PADDING + state->horizontal_scroll,
+              texture_start_height, state);
+  }
+  atlas_flush(state->atlas, renderer, &state->draw_list);
+  prefetch_glyphs(renderer, textures, first_visible_row, last_visible_row,
+                  state);
+
+  // NOTE: we clear the area where we need to draw scrollbar and row numbers
+  if (state->clearing != NULL) {
+    SDL_Rect clearing_rect = {0, 0, HORIZONTAL_PADDING, state->window_height};
+    draw_list_rect(&state->draw_list, clearing_rect, color_scheme->bg);
+  }
 
-  int local_horizontal_offset = 0;
-  int local_vertical_offset = 0;
+  handle_scrollbars(state);
+  handle_minimap(renderer, state);
+  draw_list_flush(&state->draw_list, renderer);
 
-  int max_horizontal_offset = 0;
+  handle_row_numbers(renderer, state);
 
-  int row = 0;
-  int col = 0;
+  // handle search
+  handle_actionbox(renderer, state, state->search_mode, SEARCH_BUF);
+  handle_actionbox(renderer, state, state->goto_line_mode, GOTO_LINE_BUF);
 
-  SDL_Color text_color = color_scheme->fg;
+  return EXIT_SUCCESS;
+}
 
-  for (int i = 0; i < tokens_count; i += 1) {
+FrameView frame_view(State *state) {
+  return (FrameView){
+      .generation = state->generation,
+      .generation_id = state->generation->id,
+      .color_scheme = color_scheme,
+      .window_width = state->window_width,
+      .window_height = state->window_height,
+      .font_scale_factor = state->font_scale_factor,
+      .row_number_width = ROW_NUMBER_WIDTH,
+      .max_horizontal_offset = state->max_horizontal_offset,
+      .horizontal_scroll = state->horizontal_scroll,
+      .vertical_scroll = state->vertical_scroll,
+      .selection_anchor = state->selection_anchor,
+      .selection_head = state->selection_head,
+      .search_mode = state->search_mode,
+      .goto_line_mode = state->goto_line_mode,
+      .actionbox_hash = run_hash(SEARCH_BUF, SEARCH_BUF_OFFSET, 0) ^
+                        run_hash(GOTO_LINE_BUF, GOTO_LINE_BUF_OFFSET, 1),
+  };
+}
 
-    if (tokens[i]->t == TOKEN_STRING) {
-      text_color = color_scheme->strings;
-    } else if (tokens[i]->t == TOKEN_NUMBER) {
-      text_color = color_scheme->numbers;
-    } else if (tokens[i]->t == TOKEN_CODE_KEYWORD) {
-      text_color = color_scheme->code_keywords;
-    } else if (tokens[i]->t == TOKEN_COMMENT_KEYWORD) {
-      text_color = color_scheme->comment_keywords;
-    } else if (tokens[i]->t == TOKEN_COMMENT) {
-      text_color = color_scheme->comments;
-    } else {
-      text_color = color_scheme->fg;
-    }
+void damage_rect(FrameCache *frame, SDL_Rect rect) {
+  if (rect.w <= 0 || rect.h <= 0) {
+    return;
+  }
+  // NOTE: too many regions, grow the last one
+  if (frame->damage_count == FRAME_DAMAGE_CAP) {
+    SDL_Rect *last = &frame->damage[FRAME_DAMAGE_CAP - 1];
+    SDL_UnionRect(last, &rect, last);
+    return;
+  }
+  frame->damage[frame->damage_count] = rect;
+  frame->damage_count += 1;
+}
 
-    SDL_Surface *text_surface =
-        TTF_RenderUTF8_Solid(state->font, tokens[i]->v, text_color);
-    if (text_surface == NULL) {
-      fprintf(stderr, "failed to create text surface: %s\n", TTF_GetError());
-      return NULL;
-    }
+// damage_highlight damages the rows between selection offsets
+void damage_highlight(FrameCache *frame, int anchor, int head,
+                      State *state) {
+  if (anchor < 0 || anchor == head || state->rows_count <= 0) {
+    return;
+  }
+  int first_y = offset_y(lt(anchor, head), state);
+  int last_y = offset_y(gt(anchor, head), state);
+  int y = VERTICAL_PADDING + first_y + state->vertical_scroll;
+  int h = last_y + row_height(state) - first_y;
+  damage_rect(frame, (SDL_Rect){0, y, state->window_width, h});
+}
 
-    SDL_Texture *text_texture =
-        SDL_CreateTextureFromSurface(renderer, text_surface);
+// damage_changed_rows damages rows of the generation that differ from
+// its base generation, and the rows below them if they moved
+void damage_changed_rows(FrameCache *frame, Generation *gen, State *state) {
+  int first = gen->changed_first_row;
+  if (first >= gen->changed_rows_end && gen->rows_shift == 0) {
+    return;
+  }
+  int y = VERTICAL_PADDING + state->vertical_scroll;
+  if (first < gen->rows_count) {
+    y += row_y(first, state);
+  } else if (gen->textures_count > 0) {
+    // NOTE: only rows at the end were removed
+    y += row_y(gen->rows_count, state);
+  }
+  int h = state->window_height - y;
+  if (gen->rows_shift == 0) {
+    h = VERTICAL_PADDING + state->vertical_scroll +
+        row_y(gen->changed_rows_end, state) - y;
+  }
+  damage_rect(frame, (SDL_Rect){0, y, state->window_width, h});
+  // NOTE: scrollbar and minimap depend on the whole document
+  damage_rect(frame, (SDL_Rect){ROW_NUMBER_WIDTH, 0, VERTICAL_SCROLLBAR_WIDTH,
+                                state->window_height});
+  if (gen->minimap != NULL) {
+    damage_rect(frame, (SDL_Rect){state->window_width - MINIMAP_WIDTH, 0,
+                                  MINIMAP_WIDTH, state->window_height});
+  }
+}
 
-    if (text_texture == NULL) {
-      fprintf(stderr, "failed to create text texture: %s\n", SDL_GetError());
-      return NULL;
+// handle_render_reset drops the retained frame after the renderer lost
+// the contents of its render targets. Device reset loses every texture,
+// they are created again, atlas pages are uploaded from their surfaces
+void handle_render_reset(SDL_Renderer *renderer, bool is_device_reset,
+                         State *state) {
+  FrameCache *frame = &state->frame;
+  frame->valid = false;
+  if (!is_device_reset) {
+    return;
+  }
+  // NOTE: frame_targets_ready creates them again before the next frame
+  for (int i = 0; i < 2; i += 1) {
+    if (frame->targets[i] != NULL) {
+      SDL_DestroyTexture(frame->targets[i]);
+      frame->targets[i] = NULL;
     }
+  }
+  // NOTE: kept zoom atlases are unloaded already
+  GlyphAtlas *atlases[] = {state->atlas, state->metrics};
+  for (int i = 0; i < 2; i += 1) {
+    if (atlases[i] != NULL && !atlases[i]->unloaded) {
+      atlas_unload(atlases[i]);
+      atlas_reload(atlases[i], renderer);
+    }
+  }
+  Framebuffer *fb = &state->framebuffer;
+  if (fb->texture != NULL) {
+    SDL_DestroyTexture(fb->texture);
+    fb->texture = NULL;
+    fb->w = 0; // NOTE: fb_ready creates it again
+  }
+  free_minimap_tiles(&state->minimap_tiles);
+  update_clearing_texture(renderer, state);
+}
 
-    /*
-      worst to best scaled font
-      SDL_ScaleModeNearest < nearest pixel sampling>
-      SDL_ScaleModeLinear < linear filtering>
-      SDL_ScaleModeBest < anisotropic filtering>
-    */
-    SDL_SetTextureScaleMode(text_texture, SDL_ScaleModeBest);
-
-    Texture *tp = calloc(1, sizeof(Texture));
-    tp->texture = text_texture;
-    tp->token = tokens[i];
-    tp->x = local_horizontal_offset;
-    tp->y = local_vertical_offset;
-    tp->w = text_surface->w;
-    tp->h = text_surface->h;
-    tp->r = row;
-    tp->c = col;
+// frame_targets_ready (re)creates render targets when window size changes.
+// returns false if frames can't be retained
+bool frame_targets_ready(SDL_Renderer *renderer, State *state) {
+  FrameCache *frame = &state->frame;
+  if (frame->unsupported) {
+    return false;
+  }
+  if (frame->targets[0] != NULL && frame->w == state->window_width &&
+      frame->h == state->window_height) {
+    return true;
+  }
+  for (int i = 0; i < 2; i += 1) {
+    if (frame->targets[i] != NULL) {
+      SDL_DestroyTexture(frame->targets[i]);
+      frame->targets[i] = NULL;
+    }
+  }
+  frame->valid = false;
+  if (!SDL_RenderTargetSupported(renderer)) {
+    frame->unsupported = true;
+    return false;
+  }
+  for (int i = 0; i < 2; i += 1) {
+    frame->targets[i] = SDL_CreateTexture(
+        renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+        state->window_width, state->window_height);
+    if (frame->targets[i] == NULL) {
+      fprintf(stderr, "[WARNING]: failed to create frame target: %s\n",
+              SDL_GetError());
+      frame->unsupported = true;
+      return false;
+    }
+    // NOTE: frames are copied as is, not blended
+    SDL_SetTextureBlendMode(frame->targets[i], SDL_BLENDMODE_NONE);
+  }
+  frame->w = state->window_width;
+  frame->h = state->window_height;
+  return true;
+}
 
-    textures[*textures_count] = tp;
-    *textures_count += 1;
+// damage_frame compares the view with the one of the retained frame
+// and collects regions that need to be redrawn.
+// returns how much the retained frame has to be shifted vertically
+int damage_frame(Texture **textures, int textures_count, State *state,
+                 FrameView *view) {
+  FrameCache *frame = &state->frame;
+  FrameView *prev = &frame->view;
+  frame->damage_count = 0;
+
+  // NOTE: reloaded generation diffed against the retained one only needs
+  // its changed rows, as long as selection and horizontal scrollbar,
+  // that depend on the whole layout, aren't drawn
+  bool is_reload = prev->generation_id != view->generation_id;
+  bool is_diffed = view->generation->base_id == prev->generation_id &&
+                   view->selection_anchor == view->selection_head &&
+                   view->horizontal_scroll == 0;
+
+  SDL_Rect window = {0, 0, state->window_width, state->window_height};
+  if (!frame->valid || (is_reload && !is_diffed) ||
+      prev->color_scheme != view->color_scheme ||
+      prev->window_width != view->window_width ||
+      prev->window_height != view->window_height ||
+      prev->font_scale_factor != view->font_scale_factor ||
+      prev->row_number_width != view->row_number_width ||
+      prev->horizontal_scroll != view->horizontal_scroll) {
+    damage_rect(frame, window);
+    return 0;
+  }
 
-    SDL_FreeSurface(text_surface);
+  int actionbox_height = TTF_FontHeight(state->font);
+  int overlay_height = 0;
+  if (view->search_mode || view->goto_line_mode) {
+    overlay_height = actionbox_height;
+  }
+  if (view->horizontal_scroll != 0) {
+    overlay_height = gt(overlay_height, HORIZONTAL_SCROLLBAR_HEIGHT);
+  }
 
-    if (tokens[i]->t == TOKEN_NEWLINE) {
-      max_horizontal_offset =
-          gt(max_horizontal_offset, local_horizontal_offset);
-      // NOTE: if newline, extend the texture width to end of screen
-      tp->w += 4 * state->window_width - local_horizontal_offset -
-               tp->w; // FIXME: HACK: vertical scrolling fix
-      local_horizontal_offset = 0;
-      local_vertical_offset += text_surface->h;
-      col = 0;
-      row += 1;
+  int dy = view->vertical_scroll - prev->vertical_scroll;
+  if (abs(dy) >= state->window_height) {
+    damage_rect(frame, window);
+    return 0;
+  }
+  if (dy != 0) {
+    // NOTE: exposed strip, padding on top and fixed overlays at the bottom,
+    // that were shifted along with the text
+    if (dy > 0) {
+      damage_rect(frame,
+                  (SDL_Rect){0, 0, state->window_width, VERTICAL_PADDING + dy});
+      damage_rect(frame, (SDL_Rect){0, state->window_height - overlay_height,
+                                    state->window_width, overlay_height});
     } else {
-      local_horizontal_offset += text_surface->w;
-      col += tokens[i]->vlen;
+      damage_rect(frame,
+                  (SDL_Rect){0, 0, state->window_width, VERTICAL_PADDING});
+      damage_rect(frame,
+                  (SDL_Rect){0, state->window_height + dy - overlay_height,
+                             state->window_width, overlay_height - dy});
+    }
+    damage_rect(frame, (SDL_Rect){ROW_NUMBER_WIDTH, 0,
+                                  VERTICAL_SCROLLBAR_WIDTH,
+                                  state->window_height});
+    if (view->generation->minimap != NULL) {
+      damage_rect(frame, (SDL_Rect){state->window_width - MINIMAP_WIDTH, 0,
+                                    MINIMAP_WIDTH, state->window_height});
     }
   }
 
-  state->max_horizontal_offset = max(max_horizontal_offset, 1);
-  state->max_vertical_offset = max(local_vertical_offset, 1);
+  if (is_reload) {
+    damage_changed_rows(frame, view->generation, state);
+  }
 
-  // NOTE: snap back if text fits on screen, but horizontal scroll is non-zero
-  if (max_horizontal_offset < state->window_width) {
-    state->horizontal_scroll = 0;
+  if (prev->selection_anchor != view->selection_anchor ||
+      prev->selection_head != view->selection_head) {
+    damage_highlight(frame, prev->selection_anchor, prev->selection_head,
+                     state);
+    damage_highlight(frame, view->selection_anchor, view->selection_head,
+                     state);
   }
 
-  row_nrs_to_textures(renderer, font_size, row, state);
-  if (row - 1 >= 0) {
-    ROW_NUMBER_WIDTH = state->row_nr_textures[row - 1]->w + ROW_NUMBER_PADDING;
-    HORIZONTAL_PADDING = HORIZONTAL_PADDING_BASE + ROW_NUMBER_WIDTH;
+  if (prev->search_mode != view->search_mode ||
+      prev->goto_line_mode != view->goto_line_mode ||
+      prev->actionbox_hash != view->actionbox_hash) {
+    damage_rect(frame, (SDL_Rect){0, state->window_height - actionbox_height,
+                                  state->window_width, actionbox_height});
   }
 
-  return textures;
+  // NOTE: horizontal scrollbar grows with the widest row laid out
+  if (view->horizontal_scroll != 0 &&
+      prev->max_horizontal_offset != view->max_horizontal_offset) {
+    damage_rect(frame, (SDL_Rect){0, state->window_height -
+                                         HORIZONTAL_SCROLLBAR_HEIGHT,
+                                  state->window_width,
+                                  HORIZONTAL_SCROLLBAR_HEIGHT});
+  }
+  return dy;
 }
 
-// frees memory
-void free_textures(Texture **textures, int textures_count) {
-  for (int i = 0; i < textures_count; i++) {
-    if (textures[i] != NULL) {
-      SDL_DestroyTexture(textures[i]->texture);
-      free(textures[i]);
-    }
+// redraw_rect clears rect and draws what's inside of it
+int redraw_rect(SDL_Renderer *renderer, Texture **textures, int textures_count,
+                State *state, SDL_Rect *rect) {
+  SDL_Rect window = {0, 0, state->window_width, state->window_height};
+  SDL_Rect clip = {0};
+  if (!SDL_IntersectRect(rect, &window, &clip)) {
+    return EXIT_SUCCESS;
+  }
+  Framebuffer *fb = state->draw_list.fb;
+  if (fb != NULL) {
+    fb_set_clip(fb, &clip);
+    fb_fill_rect(fb, clip, color_scheme->bg);
+    draw_list_count(&state->draw_list, 0, 1);
+  } else {
+    SDL_RenderSetClipRect(renderer, &clip);
+    SDL_RenderFillRect(renderer, &clip);
+    draw_list_count(&state->draw_list, 1, 1);
+  }
+  state->clip = &clip;
+  int err = cpy_to_renderer(renderer, textures, textures_count, state);
+  state->clip = NULL;
+  if (fb != NULL) {
+    fb_set_clip(fb, NULL);
+  } else {
+    SDL_RenderSetClipRect(renderer, NULL);
   }
+
+  state->frame.redrawn_pixels += (double)clip.w * clip.h;
+  return err;
 }
 
-void update_clearing_texture(SDL_Renderer *renderer, State *state) {
-  if (state->clearing != NULL) {
-    SDL_DestroyTexture(state->clearing);
+// handle_draw_calls_overlay shows draw calls of the presented frame and
+// the primitives they drew, that were a draw call each without batching.
+// NOTE: drawn on the window after the retained frame, so it's never
+// part of the damage
+void handle_draw_calls_overlay(SDL_Renderer *renderer, State *state) {
+  if (!SHOW_DRAW_CALLS) {
+    return;
   }
-  state->clearing = SDL_CreateTexture(renderer, 0, 0, state->window_width,
-                                      state->window_height);
-  SDL_SetTextureColorMod(state->clearing, color_scheme->bg.r,
-                         color_scheme->bg.g, color_scheme->bg.b);
-}
+  DrawCounts *counts = &state->draw_list.counts;
+  char buf[128] = {0};
+  snprintf(buf, sizeof(buf), " %ld draw calls, %ld primitives ",
+           counts->calls, counts->primitives);
 
-// update_textures frees existing textures
-// and creates new textures from tokens
-// frees and allocs memory
-Texture **update_textures(Texture **textures, SDL_Renderer *renderer,
-                          int font_size, Token **tokens, int tokens_count,
-                          int *textures_count, State *state) {
-  free_textures(textures, *textures_count);
-  free_textures(state->row_nr_textures, state->rows_count);
-  *textures_count = 0;
-  return tokens_to_textures(renderer, FONT_SIZE, tokens, tokens_count,
-                            textures_count, state);
+  SDL_Surface *surface =
+      TTF_RenderUTF8_Solid(state->font, buf, color_scheme->actionbox_text_fg);
+  if (surface == NULL) {
+    fprintf(stderr, "[WARNING]: failed to create overlay surface: %s\n",
+            TTF_GetError());
+    return;
+  }
+  SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+  if (texture == NULL) {
+    fprintf(stderr, "failed to create overlay texture: %s\n", SDL_GetError());
+    SDL_FreeSurface(surface);
+    return;
+  }
+  SDL_Rect rect = {state->window_width - surface->w, 0, surface->w,
+                   surface->h};
+  // NOTE: drawn on the window also when rendering on the CPU
+  Framebuffer *fb = state->draw_list.fb;
+  state->draw_list.fb = NULL;
+  draw_list_rect(&state->draw_list, rect, color_scheme->actionbox_box);
+  draw_list_flush(&state->draw_list, renderer);
+  state->draw_list.fb = fb;
+  SDL_RenderCopy(renderer, texture, NULL, &rect);
+
+  SDL_FreeSurface(surface);
+  SDL_DestroyTexture(texture);
 }
 
-int cpy_to_renderer(SDL_Renderer *renderer, Texture **textures,
-                    int textures_count, State *state) {
+// redraw_framebuffer redraws damaged regions of the framebuffer on the CPU
+// and copies it to the window, uploading only what changed
+int redraw_framebuffer(SDL_Renderer *renderer, Texture **textures,
+                       int textures_count, int dy, State *state) {
+  FrameCache *frame = &state->frame;
+  Framebuffer *fb = state->draw_list.fb;
+  if (fb->w != state->window_width || fb->h != state->window_height) {
+    frame->valid = false;
+  }
+  if (!fb_ready(fb, renderer, state->window_width, state->window_height)) {
+    return EXIT_FAILURE;
+  }
+  if (!frame->valid) {
+    frame->damage_count = 0;
+    damage_rect(frame,
+                (SDL_Rect){0, 0, state->window_width, state->window_height});
+    dy = 0;
+  }
+  if (dy != 0) {
+    fb_scroll(fb, dy);
+    frame->scroll_blits += 1;
+  }
 
-  handle_highlight(renderer, textures, textures_count, state);
+  int err = EXIT_SUCCESS;
+  for (int i = 0; i < frame->damage_count && err == EXIT_SUCCESS; i += 1) {
+    fb_damage(fb, frame->damage[i]);
+    err = redraw_rect(renderer, textures, textures_count, state,
+                      &frame->damage[i]);
+  }
+  if (frame->damage_count == 1 && frame->damage[0].w == state->window_width &&
+      frame->damage[0].h == state->window_height) {
+    frame->full_redraws += 1;
+  } else if (frame->damage_count > 0) {
+    frame->partial_redraws += 1;
+  }
 
-  for (int i = 0; i < textures_count; i += 1) {
+  fb_present(fb, renderer);
+  draw_list_count(&state->draw_list, 1, 1);
+  frame->valid = true;
+  return err;
+}
 
-    int texture_start_width =
-        HORIZONTAL_PADDING + textures[i]->x + state->horizontal_scroll;
-    int texture_start_height =
-        VERTICAL_PADDING + textures[i]->y + state->vertical_scroll;
+// present_frame redraws damaged regions of the retained frame
+// and presents it. Nothing is drawn or presented if the view is unchanged.
+int present_frame(SDL_Renderer *renderer, Texture **textures,
+                  int textures_count, State *state) {
+  FrameCache *frame = &state->frame;
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  layout_window_rows(state);
+  FrameView view = frame_view(state);
+  int dy = damage_frame(textures, textures_count, state, &view);
+  if (frame->damage_count == 0 && !frame->exposed) {
+    frame->skipped += 1;
+    return EXIT_SUCCESS;
+  }
+  frame->exposed = false;
+  state->draw_list.counts = (DrawCounts){0};
 
-    // NOTE: only render what fits on window
-    // continue if before window
-    // break if after window
-    if (texture_start_height + textures[i]->h < VERTICAL_PADDING ||
-        texture_start_width > state->window_width ||
-        texture_start_width + textures[i]->w < HORIZONTAL_PADDING) {
-      continue;
-    } else if (state->window_height <= texture_start_height) {
-      break;
+  int err = EXIT_SUCCESS;
+  if (state->draw_list.fb != NULL) {
+    err = redraw_framebuffer(renderer, textures, textures_count, dy, state);
+  } else if (!frame_targets_ready(renderer, state)) {
+    SDL_RenderClear(renderer);
+    draw_list_count(&state->draw_list, 1, 1);
+    err = cpy_to_renderer(renderer, textures, textures_count, state);
+    frame->full_redraws += 1;
+    frame->redrawn_pixels += (double)state->window_width * state->window_height;
+  } else {
+    // NOTE: targets might have been recreated
+    if (!frame->valid) {
+      frame->damage_count = 0;
+      damage_rect(frame,
+                  (SDL_Rect){0, 0, state->window_width, state->window_height});
+      dy = 0;
     }
 
-    // NOTE: don't render newline char
-    if (textures[i]->token->t == TOKEN_NEWLINE) {
-      continue;
+    if (dy != 0) {
+      int scratch = 1 - frame->current;
+      SDL_SetRenderTarget(renderer, frame->targets[scratch]);
+      SDL_Rect shifted = {0, dy, state->window_width, state->window_height};
+      SDL_RenderCopy(renderer, frame->targets[frame->current], NULL,
+                     &shifted);
+      draw_list_count(&state->draw_list, 1, 1);
+      frame->current = scratch;
+      frame->scroll_blits += 1;
     }
+    SDL_SetRenderTarget(renderer, frame->targets[frame->current]);
 
-    SDL_Rect text_rect = {texture_start_width, texture_start_height,
-                          textures[i]->w, textures[i]->h};
-    SDL_RenderCopy(renderer, textures[i]->texture, NULL, &text_rect);
-  }
-
-  // NOTE: we clear the area where we need to draw scrollbar and row numbers
-  if (state->clearing != NULL) {
     SDL_Color prev = {0};
     SDL_GetRenderDrawColor(renderer, (Uint8 *)&prev.r, (Uint8 *)&prev.g,
                            (Uint8 *)&prev.b, (Uint8 *)&prev.a);
     SDL_SetRenderDrawColor(renderer, color_scheme->bg.r, color_scheme->bg.g,
                            color_scheme->bg.b, color_scheme->bg.a);
-    SDL_Rect clearing_rect = {0, 0, HORIZONTAL_PADDING, state->window_height};
-    SDL_RenderFillRect(renderer, &clearing_rect);
+    for (int i = 0; i < frame->damage_count && err == EXIT_SUCCESS; i += 1) {
+      err = redraw_rect(renderer, textures, textures_count, state,
+                        &frame->damage[i]);
+    }
     SDL_SetRenderDrawColor(renderer, prev.r, prev.g, prev.b, prev.a);
+
+    if (frame->damage_count == 1 && frame->damage[0].w == state->window_width &&
+        frame->damage[0].h == state->window_height) {
+      frame->full_redraws += 1;
+    } else if (frame->damage_count > 0) {
+      frame->partial_redraws += 1;
+    }
+
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_RenderCopy(renderer, frame->targets[frame->current], NULL, NULL);
+    draw_list_count(&state->draw_list, 1, 1);
+    frame->valid = true;
   }
+  // NOTE: counted before the overlay, that's not part of the frame
+  frame->draw_calls += state->draw_list.counts.calls;
+  frame->primitives += state->draw_list.counts.primitives;
+  handle_draw_calls_overlay(renderer, state);
+  SDL_RenderPresent(renderer);
+
+  frame->view = view;
+  frame->presented += 1;
+  frame->window_pixels += (double)state->window_width * state->window_height;
+  frame->render_ticks += SDL_GetPerformanceCounter() - start;
+  return err;
+}
 
-  handle_scrollbars(renderer, state);
+// frees memory
+void free_frame(FrameCache *frame) {
+  for (int i = 0; i < 2; i += 1) {
+    if (frame->targets[i] != NULL) {
+      SDL_DestroyTexture(frame->targets[i]);
+      frame->targets[i] = NULL;
+    }
+  }
+}
 
-  for (int i = 0; i < state->rows_count; i += 1) {
+void print_frame_stats(FrameCache *frame) {
+  double frequency = (double)SDL_GetPerformanceFrequency();
+  double seconds = (SDL_GetTicks64() - frame->started) / (double)SECOND;
+  // NOTE: process cpu time, includes builder and watch threads
+  double cpu_seconds =
+      (double)(clock() - frame->cpu_started) / (double)CLOCKS_PER_SEC;
+  if (seconds > 0) {
+    printf("[STATS]: %.1f events/s, %.1f frames/s presented, "
+           "%.2f wakeups/s, %.2f%% cpu over %.1fs%s\n",
+           frame->events / seconds, frame->presented / seconds,
+           frame->loops / seconds, 100.0 * cpu_seconds / seconds, seconds,
+           frame->vsync ? " (vsync)" : "");
+  }
+  printf("[STATS]: frames: %ld presented (%ld full, %ld partial, "
+         "%ld scroll blits), %ld skipped, %.2fms per presented frame, "
+         "%.1f%% of window pixels redrawn\n",
+         frame->presented, frame->full_redraws, frame->partial_redraws,
+         frame->scroll_blits, frame->skipped,
+         frame->presented > 0 && frequency > 0
+             ? 1000.0 * frame->render_ticks / frequency / frame->presented
+             : 0.0,
+         frame->window_pixels > 0
+             ? 100.0 * frame->redrawn_pixels / frame->window_pixels
+             : 0.0);
+  printf("[STATS]: draw calls: %.1f per presented frame, "
+         "%.1f primitives drawn by them\n",
+         frame->presented > 0 ? (double)frame->draw_calls / frame->presented
+                              : 0.0,
+         frame->presented > 0 ? (double)frame->primitives / frame->presented
+                              : 0.0);
+}
 
-    int texture_start_width = state->row_nr_textures[i]->x + ROW_NUMBER_WIDTH -
-                              ROW_NUMBER_PADDING / 2 -
-                              state->row_nr_textures[i]->w;
+void resize_font(int steps, State *state) {
+  FONT_SIZE += FONT_INCREMENT * steps;
+  FONT_SIZE = clamp(FONT_SIZE, FONT_LOWER_BOUND, FONT_UPPER_BOUND);
+  TTF_SetFontSize(state->font, FONT_SIZE);
 
-    int texture_start_height = VERTICAL_PADDING + state->row_nr_textures[i]->y +
-                               state->vertical_scroll;
+  zoom_view(state);
+  update_row_number_width(state);
+  update_draw_atlas(state);
+}
 
-    // NOTE: only render what fits on window
-    // continue if before window
-    // break if after window
-    if (texture_start_height + state->row_nr_textures[i]->h < 0) {
-      continue;
-    } else if (state->window_height <= texture_start_height) {
-      break;
-    }
+// NOTE: wheel and mouse motion events come in bursts,
+// they are folded into deltas and applied once
+typedef struct {
+  int wheel_x;
+  int wheel_y;
+  int zoom_steps;
+  bool mouse_moved;
+  int mouse_x; // NOTE: position of the last motion event
+  int mouse_y;
+} InputDeltas;
+
+// fold_input_event returns true if the event was folded into input
+bool fold_input_event(SDL_Event *sdl_event, InputDeltas *input,
+                      State *state) {
+  if (sdl_event->type == SDL_MOUSEMOTION) {
+    input->mouse_moved |= state->left_mouse_button_pressed;
+    input->mouse_x = sdl_event->motion.x;
+    input->mouse_y = sdl_event->motion.y;
+    return true;
+  }
+  if (sdl_event->type != SDL_MOUSEWHEEL) {
+    return false;
+  }
+  if (!state->ctrl_pressed && sdl_event->wheel.y != 0) {
+    input->wheel_y += sdl_event->wheel.y;
+  } else if (!state->ctrl_pressed && sdl_event->wheel.x != 0) {
+    input->wheel_x += sdl_event->wheel.x;
+  } else if (state->ctrl_pressed && sdl_event->wheel.y != 0) {
+    input->zoom_steps += sign(sdl_event->wheel.y);
+  }
+  return true;
+}
 
-    SDL_Rect row_nr_rect = {texture_start_width, texture_start_height,
-                            state->row_nr_textures[i]->w,
-                            state->row_nr_textures[i]->h};
-    SDL_RenderCopy(renderer, state->row_nr_textures[i]->texture, NULL,
-                   &row_nr_rect);
+void apply_input(InputDeltas *input, Texture **textures, int textures_count,
+                 State *state) {
+  // SCROLL VERTICAL START
+  if (input->wheel_y != 0) {
+    state->vertical_scroll =
+        clamp(state->vertical_scroll + VERTICAL_SCROLL_MULT * input->wheel_y,
+              -state->max_vertical_offset, 0);
+    state->scroll_direction = -sign(input->wheel_y);
   }
+  // SCROLL VERTICAL END
+
+  // SCROLL HORIZONTAL START
+  if (input->wheel_x != 0) {
+    // NOTE: if lower_bound is 0, then no horizontal scrolling
+    state->horizontal_scroll = clamp(
+        state->horizontal_scroll + HORIZONTAL_SCROLL_MULT * input->wheel_x,
+        state->max_horizontal_offset >= state->window_width
+            ? -state->max_horizontal_offset
+            : 0,
+        0);
+  }
+  // SCROLL HORIZONTAL END
 
-  // handle search
-  handle_actionbox(renderer, state, state->search_mode, SEARCH_BUF);
-  handle_actionbox(renderer, state, state->goto_line_mode, GOTO_LINE_BUF);
+  // FONT RESIZE WITH MOUSEWHEEL START
+  if (input->zoom_steps != 0) {
+    resize_font(input->zoom_steps, state);
+  }
+  // FONT RESIZE WITH MOUSEWHEEL END
+
+  // NOTE: only the last mouse position matters
+  if (input->mouse_moved) {
+    int offset = offset_at_mouse(textures, textures_count, input->mouse_x,
+                                 input->mouse_y, state);
+    if (offset >= 0) {
+      state->selection_head = offset;
+    }
+  }
 
-  return EXIT_SUCCESS;
+  *input = (InputDeltas){0};
 }
 
 int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
@@ -1011,17 +2500,29 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
                       int textures_count, State *state) {
 
   int event_count = 0;
-  int err = 0;
+  InputDeltas input = {0};
 
   while (SDL_PollEvent(&sdl_event) > 0) {
     event_count += 1;
 
-    SDL_RenderClear(renderer);
-
-    // Q(UIT) START
-    if (sdl_event.type == SDL_QUIT ||
-        (sdl_event.type == SDL_KEYDOWN && sdl_event.key.state == SDL_PRESSED &&
-         sdl_event.key.keysym.sym == SDLK_q)) {
+    if (fold_input_event(&sdl_event, &input, state)) {
+      continue;
+    }
+    // NOTE: discrete events see the input that happened before them
+    apply_input(&input, text_textures, textures_count, state);
+
+    // WAKEUPS START
+    if (sdl_event.type == WATCH_EVENT) {
+      state->file_changed = true;
+    } else if (sdl_event.type == GENERATION_READY_EVENT) {
+      ; // NOTE: adopted by gui_loop before the next frame
+      // WAKEUPS END
+
+      // Q(UIT) START
+    } else if (sdl_event.type == SDL_QUIT ||
+               (sdl_event.type == SDL_KEYDOWN &&
+                sdl_event.key.state == SDL_PRESSED &&
+                sdl_event.key.keysym.sym == SDLK_q)) {
       state->keep_window_open = false;
       return event_count;
       // Q(UIT) END
@@ -1052,43 +2553,33 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       state->shift_pressed = false;
       // SHIFT END
 
-      // MOUSE START
-    } else if (state->left_mouse_button_pressed &&
-               sdl_event.type == SDL_MOUSEMOTION) {
-      int mouse_x = 0;
-      int mouse_y = 0;
-      (void)SDL_GetMouseState(&mouse_x, &mouse_y);
-      int idx = texture_idx_from_mouse_pos(text_textures, textures_count,
-                                           mouse_x, mouse_y, state);
-      if (idx >= 0) {
-        state->highlight_moving_texture_idx = idx;
-        state->highlight_moving_coord->x = mouse_x;
-        state->highlight_moving_coord->y = mouse_y;
-      }
+      // MINIMAP START
+    } else if (state->generation->minimap != NULL &&
+               sdl_event.type == SDL_MOUSEBUTTONDOWN &&
+               sdl_event.button.button == SDL_BUTTON_LEFT &&
+               sdl_event.button.x >= state->window_width - MINIMAP_WIDTH) {
+      // NOTE: no selection is started from the minimap
+      handle_minimap_click(sdl_event.button.y, state);
+      // MINIMAP END
 
+      // MOUSE START
     } else if (sdl_event.type == SDL_MOUSEBUTTONDOWN &&
                sdl_event.button.button == SDL_BUTTON_LEFT &&
                sdl_event.button.state == SDL_PRESSED) {
       Uint64 current_tick = SDL_GetTicks64();
       state->left_mouse_button_pressed = true;
-      int mouse_x = 0;
-      int mouse_y = 0;
-      (void)SDL_GetMouseState(&mouse_x, &mouse_y);
+      // NOTE: position of the event, so pushed events select too
+      int mouse_x = sdl_event.button.x;
+      int mouse_y = sdl_event.button.y;
 
       int idx = texture_idx_from_mouse_pos(text_textures, textures_count,
                                            mouse_x, mouse_y, state);
       if (idx >= 0) {
-        state->highlight_stationary_texture_idx = idx;
-        state->highlight_stationary_coord->x = mouse_x;
-        state->highlight_stationary_coord->y = mouse_y;
-
-        // NOTE: set moving values to stationary ones
-        // to not highlight on click
-        // if mouse is moved, then will highlight
-        state->highlight_moving_texture_idx =
-            state->highlight_stationary_texture_idx;
-        state->highlight_moving_coord->x = mouse_x;
-        state->highlight_moving_coord->y = mouse_y;
+        // NOTE: empty selection on click, if mouse is moved,
+        // then will highlight
+        state->selection_anchor = offset_at_mouse(
+            text_textures, textures_count, mouse_x, mouse_y, state);
+        state->selection_head = state->selection_anchor;
       }
 
       if (current_tick - state->last_mouse_click_tick <= 250 * MILLISECOND) {
@@ -1107,88 +2598,18 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
                sdl_event.type == SDL_KEYDOWN &&
                sdl_event.key.state == SDL_PRESSED &&
                sdl_event.key.keysym.sym == SDLK_c) {
-      if (state->highlight_moving_coord->x !=
-              state->highlight_stationary_coord->x &&
-          state->highlight_moving_coord->y !=
-              state->highlight_stationary_coord->y) {
-        handle_copy_to_clipboard(text_textures, textures_count, state);
-      }
+      handle_copy_to_clipboard(state);
       // COPY HIGHLIGHTED TEXT END
 
-      // SCROLL VERTICAL START
-    } else if (!state->ctrl_pressed && sdl_event.type == SDL_MOUSEWHEEL &&
-               sdl_event.wheel.y != 0) {
-      state->vertical_scroll = clamp(
-          state->vertical_scroll + VERTICAL_SCROLL_MULT * sdl_event.wheel.y,
-          -state->max_vertical_offset, 0);
-      // SCROLL VERTICAL END
-
-      // SCROLL HORIZONTAL START
-    } else if (!state->ctrl_pressed && sdl_event.type == SDL_MOUSEWHEEL &&
-               sdl_event.wheel.x != 0) {
-
-      // NOTE: if lower_bound is 0, then no horizontal scrolling
-      state->horizontal_scroll = clamp(
-          state->horizontal_scroll + HORIZONTAL_SCROLL_MULT * sdl_event.wheel.x,
-          state->max_horizontal_offset >= state->window_width
-              ? -state->max_horizontal_offset
-              : 0,
-          0);
-      // SCROLL HORIZONTAL END
-
-      // FONT RESIZE WITH MOUSEWHEEL START
-    } else if (state->ctrl_pressed && sdl_event.type == SDL_MOUSEWHEEL &&
-               sdl_event.wheel.y != 0) {
-
-      reset_font_scale(text_textures, textures_count, state);
-      reset_scale_texture_font(state->row_nr_textures, state->rows_count,
-                               state);
-
-      FONT_SIZE += FONT_INCREMENT * sign(sdl_event.wheel.y);
-      FONT_SIZE = clamp(FONT_SIZE, FONT_LOWER_BOUND, FONT_UPPER_BOUND);
-      TTF_SetFontSize(state->font, FONT_SIZE);
-
-      state->is_font_resized = true;
-      state->font_scale_factor = (float)FONT_SIZE / (float)BASE_FONT_SIZE;
-      state->font_size_unchanged_since = SDL_GetTicks64();
-      scale_font(text_textures, textures_count, state);
-
-      scale_texture_font(state->row_nr_textures, state->rows_count, state);
-      if (state->rows_count - 1 >= 0) {
-        ROW_NUMBER_WIDTH = state->row_nr_textures[state->rows_count - 1]->w +
-                           ROW_NUMBER_PADDING;
-        HORIZONTAL_PADDING = HORIZONTAL_PADDING_BASE + ROW_NUMBER_WIDTH;
-      }
-
-      // FONT RESIZE WITH MOUSEWHEEL END
-
       // FONT RESIZE +/- START
     } else if (state->ctrl_pressed && !state->shift_pressed &&
                sdl_event.type == SDL_KEYDOWN &&
                sdl_event.key.state == SDL_PRESSED &&
                (sdl_event.key.keysym.sym == SDLK_EQUALS ||
                 sdl_event.key.keysym.sym == SDLK_MINUS)) {
-
-      reset_font_scale(text_textures, textures_count, state);
-      reset_scale_texture_font(state->row_nr_textures, state->rows_count,
-                               state);
-
-      FONT_SIZE += FONT_INCREMENT * (sdl_event.key.keysym.sym == SDLK_EQUALS) -
-                   FONT_INCREMENT * (sdl_event.key.keysym.sym == SDLK_MINUS);
-      FONT_SIZE = clamp(FONT_SIZE, FONT_LOWER_BOUND, FONT_UPPER_BOUND);
-      TTF_SetFontSize(state->font, FONT_SIZE);
-
-      state->is_font_resized = true;
-      state->font_scale_factor = (float)FONT_SIZE / (float)BASE_FONT_SIZE;
-      state->font_size_unchanged_since = SDL_GetTicks64();
-      scale_font(text_textures, textures_count, state);
-
-      scale_texture_font(state->row_nr_textures, state->rows_count, state);
-      if (state->rows_count - 1 >= 0) {
-        ROW_NUMBER_WIDTH = state->row_nr_textures[state->rows_count - 1]->w +
-                           ROW_NUMBER_PADDING;
-        HORIZONTAL_PADDING = HORIZONTAL_PADDING_BASE + ROW_NUMBER_WIDTH;
-      }
+      resize_font((sdl_event.key.keysym.sym == SDLK_EQUALS) -
+                      (sdl_event.key.keysym.sym == SDLK_MINUS),
+                  state);
       // FONT RESIZE +/- END
 
       // FONT RESIZE TO DEFAULT START
@@ -1200,12 +2621,9 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       if (FONT_SIZE != DEFAULT_FONT_SIZE) {
         FONT_SIZE = DEFAULT_FONT_SIZE;
         TTF_SetFontSize(state->font, DEFAULT_FONT_SIZE);
-        state->is_font_resized = true;
-        // NOTE: + FONT_RENDERING_DELAY because we want to render right away
-        state->font_size_unchanged_since =
-            SDL_GetTicks64() + FONT_RENDERING_DELAY * SECOND;
-        // NOTE: factor to 0 to pass the condition
-        state->font_scale_factor = 0;
+        zoom_view(state);
+        update_row_number_width(state);
+        update_draw_atlas(state);
       }
       // FONT RESIZE TO DEFAULT END
 
@@ -1217,6 +2635,19 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       update_clearing_texture(renderer, state);
       // WINDOW RESIZE END
 
+      // WINDOW EXPOSED START
+    } else if (sdl_event.type == SDL_WINDOWEVENT &&
+               sdl_event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+      state->frame.exposed = true;
+      // WINDOW EXPOSED END
+
+      // RENDER RESET START
+    } else if (sdl_event.type == SDL_RENDER_TARGETS_RESET ||
+               sdl_event.type == SDL_RENDER_DEVICE_RESET) {
+      handle_render_reset(renderer,
+                          sdl_event.type == SDL_RENDER_DEVICE_RESET, state);
+      // RENDER RESET END
+
       // NEXT COLORSCHEME START
     } else if (state->ctrl_pressed && state->shift_pressed &&
                sdl_event.type == SDL_KEYDOWN &&
@@ -1233,7 +2664,9 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       color_scheme = &color_schemes[color_scheme_idx];
       SDL_SetRenderDrawColor(renderer, color_scheme->bg.r, color_scheme->bg.g,
                              color_scheme->bg.b, color_scheme->bg.a);
-      state->color_scheme_modified = true;
+      // NOTE: colors are looked up when drawing, the frame is redrawn
+      // because its color scheme changed, see damage_frame
+      update_token_colors(color_scheme);
       // NEXT COLORSCHEME END
 
       // ENABLE SEARCH START
@@ -1447,13 +2880,13 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
 
       // NOTE: no search yet
       if (search_results == NULL) {
-        handle_search_results(text_textures, textures_count, state);
+        handle_search_results(state);
 
         // NOTE: find first search result >= to current vertical scroll
         {
           SearchResult *cur = search_results;
           for (; cur != NULL && cur->next != search_results &&
-                 cur->start->y < abs(state->vertical_scroll);
+                 offset_y(cur->start, state) < abs(state->vertical_scroll);
                cur = cur->next) {
             ;
           }
@@ -1464,13 +2897,13 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       } else if (search_results != NULL &&
                  strcmp(SEARCH_BUF + 1, search_results->val) != 0) {
         search_results = free_search_results();
-        handle_search_results(text_textures, textures_count, state);
+        handle_search_results(state);
 
         // NOTE: find first search result >= to current vertical scroll
         {
           SearchResult *cur = search_results;
           for (; cur != NULL && cur->next != search_results &&
-                 cur->start->y < abs(state->vertical_scroll);
+                 offset_y(cur->start, state) < abs(state->vertical_scroll);
                cur = cur->next) {
             ;
           }
@@ -1489,18 +2922,15 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
 
       if (search_results != NULL) {
         // NOTE: jump scroll, if search result not in view
-        if (search_results->start->y < abs(state->vertical_scroll) ||
-            abs(state->vertical_scroll) + state->window_height <
-                search_results->start->y) {
-          state->vertical_scroll = -search_results->start->y;
+        int start_y = offset_y(search_results->start, state);
+        if (start_y < abs(state->vertical_scroll) ||
+            abs(state->vertical_scroll) + state->window_height < start_y) {
+          state->vertical_scroll = -start_y;
         }
 
         // NOTE: set highlight
-        state->highlight_stationary_coord = search_results->start;
-        state->highlight_moving_coord = search_results->end;
-        state->highlight_stationary_texture_idx =
-            search_results->start_texture_idx;
-        state->highlight_moving_texture_idx = search_results->end_texture_idx;
+        state->selection_anchor = search_results->start;
+        state->selection_head = search_results->end;
       }
 
       add_to_search_history();
@@ -1515,6 +2945,7 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       state->vertical_scroll =
           clamp(state->vertical_scroll - state->window_height / 2,
                 -state->max_vertical_offset, 0);
+      state->scroll_direction = 1;
       // JUMP HALF PAGE DOWN END
 
       // JUMP HALF PAGE UP START
@@ -1526,6 +2957,7 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       state->vertical_scroll =
           clamp(state->vertical_scroll + state->window_height / 2,
                 -state->max_vertical_offset, 0);
+      state->scroll_direction = -1;
       // JUMP HALF PAGE UP END
 
       // JUMP TO BEGINNING START
@@ -1590,8 +3022,11 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       int idx = atoi(GOTO_LINE_BUF + 1) - 1;
       memset(GOTO_LINE_BUF + 1, 0, GOTO_LINE_BUF_OFFSET - 1);
       GOTO_LINE_BUF_OFFSET = 1;
-      if (0 <= idx && idx < state->rows_count) {
-        state->vertical_scroll = -state->row_nr_textures[idx]->y;
+      // NOTE: lines past the end go to the last line
+      if (0 <= idx) {
+        int offset = piece_table_line_offset(state->text, idx);
+        state->vertical_scroll = clamp(-offset_y(offset, state),
+                                       -state->max_vertical_offset, 0);
       }
       state->goto_line_mode = false;
       // GOTO_LINE END
@@ -1599,17 +3034,89 @@ int handle_sdl_events(SDL_Window *window, SDL_Event sdl_event,
       //
     }
 
-    SDL_RenderClear(renderer);
-    err = cpy_to_renderer(renderer, text_textures, textures_count, state);
-    if (err != EXIT_SUCCESS) {
-      state->keep_window_open = false;
-      return event_count;
-    }
-    SDL_RenderPresent(renderer);
   }
+  apply_input(&input, text_textures, textures_count, state);
   return event_count;
 }
 
+// next_wakeup_timeout returns how long the main loop can wait for events
+// in milliseconds, -1 to wait until the next event
+int next_wakeup_timeout(State *state) {
+  if (WHEEL_STORM > 0 || DRAG_STORM > 0 || RELOAD_STORM > 0 ||
+      GENERATION_READY_EVENT == (Uint32)-1) {
+    return 0;
+  }
+  Uint64 now = SDL_GetTicks64();
+  Uint64 due = 0; // NOTE: tick of the earliest due work, 0 if none
+  if (state->watch == NULL) {
+    due = now + WATCH_POLL_DELAY;
+  }
+  if (state->recheck_at != 0 && (due == 0 || state->recheck_at < due)) {
+    due = state->recheck_at;
+  }
+  if (due == 0) {
+    return -1;
+  }
+  return due > now ? (int)(due - now) : 0;
+}
+
+// push_storm_events pushes wheel and mouse motion events of the frame,
+// direction changes every second.
+// NOTE: motion sweeps the selection head over the middle of the window
+void push_storm_events(State *state) {
+  if (state->frame.loops >= STORM_FRAMES) {
+    SDL_Event quit_event = {.type = SDL_QUIT};
+    SDL_PushEvent(&quit_event);
+    return;
+  }
+  bool is_down = (state->frame.loops / 60) % 2 == 0;
+  SDL_Event wheel_event = {.type = SDL_MOUSEWHEEL};
+  wheel_event.wheel.y = is_down ? -1 : 1;
+  for (int i = 0; i < WHEEL_STORM; i += 1) {
+    SDL_PushEvent(&wheel_event);
+  }
+
+  if (DRAG_STORM <= 0) {
+    return;
+  }
+  int x = state->window_width / 2;
+  int top = state->window_height / 4;
+  int height = state->window_height / 2;
+  if (state->frame.loops == 0) {
+    SDL_Event press_event = {.type = SDL_MOUSEBUTTONDOWN};
+    press_event.button.button = SDL_BUTTON_LEFT;
+    press_event.button.state = SDL_PRESSED;
+    press_event.button.x = x;
+    press_event.button.y = top;
+    SDL_PushEvent(&press_event);
+  }
+  SDL_Event motion_event = {.type = SDL_MOUSEMOTION};
+  motion_event.motion.state = SDL_BUTTON_LMASK;
+  motion_event.motion.x = x;
+  for (int i = 0; i < DRAG_STORM; i += 1) {
+    int step = (int)(state->frame.loops % 60) * DRAG_STORM + i;
+    int dy = height * step / (60 * DRAG_STORM);
+    motion_event.motion.y = is_down ? top + dy : top + height - dy;
+    SDL_PushEvent(&motion_event);
+  }
+}
+
+// post_reload_storm posts RELOAD_STORM builds of the file,
+// every other one only changes the layout.
+// NOTE: posts replace pending ones and race with the builder thread,
+// so generations are built, replaced, adopted and retired concurrently
+void post_reload_storm(Builder *builder, char *filename, State *state) {
+  for (int i = 0; i < RELOAD_STORM; i += 1) {
+    if ((state->frame.loops + i) % 2 == 1) {
+      builder_post(builder, NULL, 0, BASE_FONT_SIZE);
+      continue;
+    }
+    int contents_len = 0;
+    char *contents = read_contents(filename, &contents_len);
+    builder_post(builder, contents, contents_len, BASE_FONT_SIZE);
+  }
+}
+
 int gui_loop(char *filename, TokenizerConfig *tokenizer_config) {
 
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -1633,7 +3140,13 @@ int gui_loop(char *filename, TokenizerConfig *tokenizer_config) {
     return EXIT_FAILURE;
   }
 
-  SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
+  // NOTE: presenting waits for vertical retrace, so scrolling and zooming
+  // are paced by the display; not every driver supports it
+  SDL_Renderer *renderer =
+      SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+  if (renderer == NULL) {
+    renderer = SDL_CreateRenderer(window, -1, 0);
+  }
   if (renderer == NULL) {
     fprintf(stderr, "failed to create renderer: '%s'\n", SDL_GetError());
     SDL_DestroyWindow(window);
@@ -1643,14 +3156,6 @@ int gui_loop(char *filename, TokenizerConfig *tokenizer_config) {
   SDL_SetRenderDrawColor(renderer, color_scheme->bg.r, color_scheme->bg.g,
                          color_scheme->bg.b, color_scheme->bg.a);
 
-  int contents_len = 0;
-  char *contents = read_contents(filename, &contents_len);
-  time_t last_modified = get_last_modified(filename);
-
-  int tokens_count = 0;
-  Token **tokens =
-      tokenize(contents, contents_len, tokenizer_config, &tokens_count);
-
   TTF_Font *font = TTF_OpenFont(GUI_FONT, FONT_SIZE);
   if (font == NULL) {
     fprintf(stderr, "failed to load font: %s\n", TTF_GetError());
@@ -1660,12 +3165,37 @@ int gui_loop(char *filename, TokenizerConfig *tokenizer_config) {
     return EXIT_FAILURE;
   }
 
+  // NOTE: binary files and files with extremely long lines
+  // skip the highlighting pipeline
+  enum FILE_KIND file_kind = sniff_file(filename);
+  if (file_kind != FILE_KIND_TEXT) {
+    int err = fallback_loop(window, renderer, font, filename, file_kind);
+    TTF_CloseFont(font);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return err;
+  }
+
+  int contents_len = 0;
+  char *contents = read_contents(filename, &contents_len);
+  time_t last_modified = get_last_modified(filename);
+
+  // NOTE: worker threads wake the main loop with user events
+  Uint32 user_events = SDL_RegisterEvents(2);
+  if (user_events != (Uint32)-1) {
+    WATCH_EVENT = user_events;
+    GENERATION_READY_EVENT = user_events + 1;
+  }
+
   State *state = calloc(1, sizeof(State));
-  state->highlight_stationary_coord = calloc(1, sizeof(Coord));
-  state->highlight_moving_coord = calloc(1, sizeof(Coord));
+  state->selection_anchor = -1;
   (void)SDL_GetWindowSize(window, &state->window_width, &state->window_height);
   state->font_scale_factor = 1.0f;
-  state->font_size_unchanged_since = SDL_GetTicks64();
+  state->zoomed_font_size = FONT_SIZE;
+  if (CPU_RENDER) {
+    state->draw_list.fb = &state->framebuffer;
+  }
   update_clearing_texture(renderer, state);
   state->font = font;
 
@@ -1675,14 +3205,59 @@ int gui_loop(char *filename, TokenizerConfig *tokenizer_config) {
   GOTO_LINE_BUF[GOTO_LINE_BUF_OFFSET] = ':';
   GOTO_LINE_BUF_OFFSET += 1;
 
-  int textures_count = 0;
-  Texture **text_textures = tokens_to_textures(
-      renderer, FONT_SIZE, tokens, tokens_count, &textures_count, state);
+  ATLAS_FONT_LOCK = SDL_CreateMutex();
+  RUN_CACHE_LOCK = SDL_CreateMutex();
+  // NOTE: sdf font is opened before the pool workers open theirs,
+  // and closed after they are stopped, so it needs no ATLAS_FONT_LOCK
+  state->sdf = sdf_create(GUI_FONT);
+  if (state->sdf == NULL) {
+    fprintf(stdout, "[WARNING]: glyphs are rasterized for every font size\n");
+  }
+  state->raster_pool = raster_pool_start(GUI_FONT);
+  update_token_colors(color_scheme);
+  // NOTE: text starts empty and gets the contents with the first generation
+  state->text = piece_table_create(NULL, 0);
+  Builder *builder =
+      builder_start(tokenizer_config, contents, contents_len, FONT_SIZE);
+  (void)adopt_generation(builder, state);
+  Generation *gen = state->generation;
+  if (gen == NULL) {
+    fprintf(stderr, "failed to build the first generation\n");
+    // NOTE: same order as at the end of the loop
+    builder_stop(builder);
+    raster_pool_stop(state->raster_pool);
+    sdf_free(state->sdf);
+    TTF_CloseFont(state->font);
+    SDL_DestroyWindow(window);
+    SDL_DestroyRenderer(renderer);
+    SDL_Quit();
+    if (state->clearing != NULL) {
+      SDL_DestroyTexture(state->clearing);
+    }
+    free_run_cache(&run_cache);
+    free_piece_table(state->text);
+    SDL_DestroyMutex(ATLAS_FONT_LOCK);
+    ATLAS_FONT_LOCK = NULL;
+    SDL_DestroyMutex(RUN_CACHE_LOCK);
+    RUN_CACHE_LOCK = NULL;
+    free(state);
+    return EXIT_FAILURE;
+  }
 
-  SDL_RenderClear(renderer);
+  SDL_RendererInfo renderer_info = {0};
+  if (SDL_GetRendererInfo(renderer, &renderer_info) == 0) {
+    state->frame.vsync = renderer_info.flags & SDL_RENDERER_PRESENTVSYNC;
+  }
+  state->watch = watch_start(filename);
+  if (state->watch == NULL) {
+    fprintf(stdout, "[WARNING]: file watch failed, polling every %dms\n",
+            WATCH_POLL_DELAY);
+  }
 
   int err = EXIT_SUCCESS;
-  err = cpy_to_renderer(renderer, text_textures, textures_count, state);
+  state->frame.started = SDL_GetTicks64();
+  state->frame.cpu_started = clock();
+  err = present_frame(renderer, gen->textures, gen->textures_count, state);
   if (err != EXIT_SUCCESS) {
     SDL_DestroyWindow(window);
     SDL_DestroyRenderer(renderer);
@@ -1690,97 +3265,118 @@ int gui_loop(char *filename, TokenizerConfig *tokenizer_config) {
     return err;
   }
 
-  SDL_RenderPresent(renderer);
-
-  Uint32 start = SDL_GetTicks64();
-  Uint32 end = SDL_GetTicks64();
-  float elapsed = 0;
-
-  int handled_event_count = 0;
-
   state->keep_window_open = true;
   while (state->keep_window_open) {
 
-    start = SDL_GetTicks64();
+    Uint64 start = SDL_GetTicks64();
+
+    if (WHEEL_STORM > 0 || DRAG_STORM > 0 || RELOAD_STORM > 0) {
+      push_storm_events(state);
+    }
 
     SDL_Event sdl_event = {0};
-    handled_event_count = handle_sdl_events(
-        window, sdl_event, renderer, text_textures, textures_count, state);
+    state->frame.events += handle_sdl_events(
+        window, sdl_event, renderer, gen->textures, gen->textures_count, state);
     if (!state->keep_window_open) {
       break;
     }
 
-    contents = check_contents(filename, contents, &contents_len, &last_modified,
-                              &state->file_modified);
-    if (state->file_modified) {
-      state->file_modified = false;
-
-      tokens = update_tokens(tokens, contents, contents_len, tokenizer_config,
-                             &tokens_count);
-
-      text_textures =
-          update_textures(text_textures, renderer, FONT_SIZE, tokens,
-                          tokens_count, &textures_count, state);
-
-      SDL_RenderClear(renderer);
-      err = cpy_to_renderer(renderer, text_textures, textures_count, state);
-      if (err != EXIT_SUCCESS) {
-        break;
+    // NOTE: modification time has a resolution of a second, so a change
+    // in the same second as the previous one is caught by a recheck
+    bool recheck = state->recheck_at != 0 && state->recheck_at <= start;
+    if (state->file_changed || recheck || state->watch == NULL) {
+      if (state->file_changed) {
+        state->recheck_at = start + WATCH_RECHECK_DELAY;
+      } else if (recheck) {
+        state->recheck_at = 0;
       }
-
-      // NOTE: if we need to refresh tokens (eg font resize)
-      // and the font hasn't changed in x seconds
-      // recalculate the textures for better quality text
-      // NOTE: if we go back to default font size, update textures right away
-    } else if (state->color_scheme_modified) {
-      state->color_scheme_modified = false;
-      text_textures =
-          update_textures(text_textures, renderer, FONT_SIZE, tokens,
-                          tokens_count, &textures_count, state);
-
-      SDL_RenderClear(renderer);
-      err = cpy_to_renderer(renderer, text_textures, textures_count, state);
-      if (err != EXIT_SUCCESS) {
-        break;
-      }
-    } else if (state->is_font_resized &&
-               (FONT_RENDERING_DELAY * SECOND <
-                SDL_GetTicks64() - state->font_size_unchanged_since)) {
-      state->is_font_resized = false;
-
-      // NOTE: only recalc textures if font is scaled
-      if (state->font_scale_factor != 1.0f) {
-        BASE_FONT_SIZE = FONT_SIZE;
-        state->font_scale_factor = 1.0f;
-        // MAYBE: TODO: make update_textures parallel safe
-        text_textures =
-            update_textures(text_textures, renderer, FONT_SIZE, tokens,
-                            tokens_count, &textures_count, state);
-
-        SDL_RenderClear(renderer);
-        err = cpy_to_renderer(renderer, text_textures, textures_count, state);
-        if (err != EXIT_SUCCESS) {
-          break;
-        }
-        SDL_RenderPresent(renderer);
+      state->file_changed = false;
+      watch_handled(state->watch);
+      // NOTE: builder tokenizes the contents as read, the text is
+      // updated when their generation is adopted
+      int contents_len = 0;
+      char *contents = check_contents(filename, NULL, &contents_len,
+                                      &last_modified, &state->file_modified);
+      if (state->file_modified) {
+        state->file_modified = false;
+        builder_post(builder, contents, contents_len, BASE_FONT_SIZE);
+
+        // NOTE: layout stays in BASE_FONT_SIZE, zooming only scales it
       }
     }
+    if (RELOAD_STORM > 0) {
+      post_reload_storm(builder, filename, state);
+    }
+
+    // NOTE: the generation is only swapped here, between frames.
+    // A generation published later wakes the loop with its event
+    if (adopt_generation(builder, state)) {
+      gen = state->generation;
+    }
+
+    // NOTE: all events of the frame are handled, render once.
+    // Frames are presented only when they change, see present_frame
+    long presented = state->frame.presented;
+    err = present_frame(renderer, gen->textures, gen->textures_count, state);
+    if (err != EXIT_SUCCESS) {
+      break;
+    }
+    state->frame.loops += 1;
 
-    end = SDL_GetTicks64();
-    elapsed = end - start;
-    if (elapsed <= FRAME_DELAY) {
+    // NOTE: without vsync, presented frames are paced by sleeping
+    Uint64 elapsed = SDL_GetTicks64() - start;
+    if (!state->frame.vsync && presented != state->frame.presented &&
+        elapsed <= FRAME_DELAY) {
       SDL_Delay(FRAME_DELAY - elapsed);
     }
-    // NOTE: render only when event happened, otherwise don't present.
-    // Aim is to improve idle performance.
-    // However, if this doesn't feel good, remove the if-statement
-    // and just present render.
-    if (handled_event_count > 0) {
-      SDL_RenderPresent(
-          renderer); // MAYBE: NOTE: always present current renderer
+
+    // NOTE: sleep until the next event, or until something is due
+    (void)SDL_WaitEventTimeout(NULL, next_wakeup_timeout(state));
+  }
+
+  // NOTE: builder thread releases runs until it's stopped
+  builder_stop(builder);
+  watch_stop(state->watch);
+
+  if (PRINT_STATS) {
+    print_run_cache_stats(&run_cache, gen->textures_count);
+    printf("[STATS]: layout: %ld rows laid out on demand, %d in the file\n",
+           state->laid_out_rows, gen->rows_count);
+    print_atlas_stats(state->atlas, gen->textures_count);
+    print_row_cache_stats(&state->row_cache);
+    printf("[STATS]: zoom: %ld of %ld font size switches reused an atlas\n",
+           state->zoom_hits, state->zoom_switches);
+    print_sdf_stats(state->sdf);
+    print_raster_pool_stats(state->raster_pool);
+    if (SHOW_MINIMAP) {
+      printf("[STATS]: minimap: %ld tile uploads\n",
+             state->minimap_tiles.uploads);
+    }
+    print_frame_stats(&state->frame);
+    if (CPU_RENDER) {
+      printf("[STATS]: cpu render: %.1f%% of window pixels uploaded\n",
+             state->frame.window_pixels > 0
+                 ? 100.0 * state->framebuffer.uploaded_pixels /
+                       state->frame.window_pixels
+                 : 0.0);
     }
   }
 
+  atlas_free(state->atlas);
+  for (int i = 0; i < ZOOM_ATLASES_CAP; i += 1) {
+    atlas_free(state->zoom_atlases[i]);
+  }
+  atlas_free(state->metrics);
+  raster_pool_stop(state->raster_pool);
+  if (state->raster_codepoints != NULL) {
+    free(state->raster_codepoints);
+  }
+  sdf_free(state->sdf);
+  free_frame(&state->frame);
+  free_draw_list(&state->draw_list);
+  free_framebuffer(&state->framebuffer);
+  free_row_cache(&state->row_cache);
+  free_minimap_tiles(&state->minimap_tiles);
   TTF_CloseFont(state->font);
   SDL_DestroyWindow(window);
   SDL_DestroyRenderer(renderer);
@@ -1789,17 +3385,14 @@ int gui_loop(char *filename, TokenizerConfig *tokenizer_config) {
   if (state->clearing != NULL) {
     SDL_DestroyTexture(state->clearing);
   }
-  free_textures(state->row_nr_textures, state->rows_count);
-  free_textures(text_textures, textures_count);
-  free_tokens(tokens, tokens_count);
-  free_contents(contents);
+  free_generation(state->generation);
+  free_run_cache(&run_cache);
+  free_piece_table(state->text);
+  SDL_DestroyMutex(ATLAS_FONT_LOCK);
+  ATLAS_FONT_LOCK = NULL;
+  SDL_DestroyMutex(RUN_CACHE_LOCK);
+  RUN_CACHE_LOCK = NULL;
   if (state != NULL) {
-    if (state->highlight_stationary_coord != NULL) {
-      free(state->highlight_stationary_coord);
-    }
-    if (state->highlight_moving_coord != NULL) {
-      free(state->highlight_moving_coord);
-    }
     free(state);
   }
   search_results = free_search_results();
@@ -23,7 +23,15 @@ void help() {
   printf("\tMeelis Utt (meelis.utt@gmail.com)\n");
 }
 
-enum MODE { MODE_GUI = 0, MODE_TUI, MODE_TOKENS, MODE_COUNT };
+enum MODE {
+  MODE_GUI = 0,
+  MODE_TUI,
+  MODE_TOKENS,
+  MODE_SNIFF,
+  MODE_CHECK_PIECE_TABLE,
+  MODE_CHECK_BLEND,
+  MODE_COUNT
+};
 enum COLOR { COLOR_NOT_SET = -1, COLOR_NO = false, COLOR_YES = true };
 
 int main(int argc, char **argv) {
@@ -52,6 +60,14 @@ int main(int argc, char **argv) {
       mode = MODE_TUI;
     } else if (strcmp("--tokens", flag) == 0) {
       mode = MODE_TOKENS;
+    } else if (strcmp("--sniff", flag) == 0) {
+      mode = MODE_SNIFF;
+    } else if (strcmp("--check-piece-table", flag) == 0) {
+      mode = MODE_CHECK_PIECE_TABLE;
+    } else if (strcmp("--check-blend", flag) == 0) {
+      mode = MODE_CHECK_BLEND;
+    } else if (strcmp("--stats", flag) == 0) {
+      PRINT_STATS = true;
       //
     } else if (strcmp("--color-codes", flag) == 0) {
       color_code_keywords = COLOR_YES;
@@ -75,6 +91,31 @@ int main(int argc, char **argv) {
                i + 1 < argc) {
       filename = argv[i + 1];
       i += 1;
+    } else if (strcmp("--minimap", flag) == 0) {
+      SHOW_MINIMAP = true;
+    } else if (strcmp("--draw-calls", flag) == 0) {
+      SHOW_DRAW_CALLS = true;
+    } else if (strcmp("--cpu-render", flag) == 0) {
+      CPU_RENDER = true;
+    } else if (strcmp("--atlas-budget", flag) == 0 && i + 1 < argc) {
+      // NOTE: in MiB
+      ATLAS_BUDGET_BYTES = atol(argv[i + 1]) * 1024 * 1024;
+      i += 1;
+    } else if (strcmp("--wheel-storm", flag) == 0 && i + 1 < argc) {
+      // NOTE: wheel events per frame, prints stats on exit
+      WHEEL_STORM = atoi(argv[i + 1]);
+      PRINT_STATS = true;
+      i += 1;
+    } else if (strcmp("--drag-storm", flag) == 0 && i + 1 < argc) {
+      // NOTE: selecting mouse motion events per frame, prints stats on exit
+      DRAG_STORM = atoi(argv[i + 1]);
+      PRINT_STATS = true;
+      i += 1;
+    } else if (strcmp("--reload-storm", flag) == 0 && i + 1 < argc) {
+      // NOTE: builds posted per frame, prints stats on exit
+      RELOAD_STORM = atoi(argv[i + 1]);
+      PRINT_STATS = true;
+      i += 1;
     } else if (strcmp("-cs", flag) == 0 && i + 1 < argc) {
       color_scheme_name = argv[i + 1];
     } else if (filename == NULL && i == argc - 1) {
@@ -223,6 +264,22 @@ int main(int argc, char **argv) {
     if (contents != NULL) {
       free(contents);
     }
+  } else if (mode == MODE_SNIFF) {
+    printf("%s\n", file_kind_name(sniff_file(filename)));
+  } else if (mode == MODE_CHECK_PIECE_TABLE) {
+    int contents_len = 0;
+    char *contents = read_contents(filename, &contents_len);
+    check_piece_table_edits(contents, contents_len);
+    if (contents != NULL) {
+      free(contents);
+    }
+  } else if (mode == MODE_CHECK_BLEND) {
+    int contents_len = 0;
+    char *contents = read_contents(filename, &contents_len);
+    check_blend_span(contents, contents_len);
+    if (contents != NULL) {
+      free(contents);
+    }
   }
 
   return ret;
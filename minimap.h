@@ -0,0 +1,229 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+#include "utils.h"
+
+// NOTE: minimap is a downsampled image of the document, one pixel row per
+// line and a pixel per MINIMAP_COLUMNS_PER_PIXEL columns, colored by token.
+// Long files bin several lines into a pixel row, so the image is at most
+// MINIMAP_MAX_HEIGHT rows and texture memory is bounded.
+// Cells are built on the builder thread with the generation, they hold
+// palette indices instead of colors, so switching color schemes doesn't
+// rebuild them. The render thread colors them into tiles, and only the
+// tiles that changed since the last upload (eg lines changed on reload,
+// or all of them on a new palette) are uploaded.
+
+#define MINIMAP_WIDTH 80 // in pixels
+#define MINIMAP_COLUMNS_PER_PIXEL 2
+#define MINIMAP_MAX_HEIGHT 2048 // in pixel rows
+#define MINIMAP_TILE_HEIGHT 256 // NOTE: MINIMAP_MAX_HEIGHT is a multiple
+#define MINIMAP_TILES_CAP (MINIMAP_MAX_HEIGHT / MINIMAP_TILE_HEIGHT)
+#define MINIMAP_ROW_HEIGHT 2 // NOTE: in window pixels, when the image fits
+
+typedef struct {
+  Uint8 *cells; // NOTE: palette indices, MINIMAP_WIDTH * height, 0 is bg
+  int height;
+  int lines_per_row;
+  int tiles_count;
+  uint32_t tile_hashes[MINIMAP_TILES_CAP];
+} Minimap;
+
+// NOTE: owned by the render thread
+typedef struct {
+  SDL_Texture *tiles[MINIMAP_TILES_CAP];
+  uint32_t tile_hashes[MINIMAP_TILES_CAP];
+  uint32_t palette_hash;
+  Uint32 *pixels; // NOTE: ARGB8888 scratch for coloring a tile
+  long uploads;
+} MinimapTiles;
+
+Uint32 minimap_color(SDL_Color color) {
+  return 0xFF000000 | (Uint32)color.r << 16 | (Uint32)color.g << 8 | color.b;
+}
+
+// allocs memory
+Minimap *minimap_create(int lines_count) {
+  Minimap *minimap = calloc(1, sizeof(Minimap));
+  minimap->lines_per_row =
+      gt((lines_count + MINIMAP_MAX_HEIGHT - 1) / MINIMAP_MAX_HEIGHT, 1);
+  minimap->height = gt((lines_count + minimap->lines_per_row - 1) /
+                           minimap->lines_per_row,
+                       1);
+  minimap->tiles_count =
+      (minimap->height + MINIMAP_TILE_HEIGHT - 1) / MINIMAP_TILE_HEIGHT;
+  minimap->cells = calloc(MINIMAP_WIDTH * minimap->height, sizeof(Uint8));
+  return minimap;
+}
+
+// minimap_fill colors len columns of the line starting at col.
+// NOTE: in binned rows the first line to color a pixel wins
+void minimap_fill(Minimap *minimap, int line, int col, int len, Uint8 cell) {
+  int row = line / minimap->lines_per_row;
+  int first = col / MINIMAP_COLUMNS_PER_PIXEL;
+  int last = lt((col + len + MINIMAP_COLUMNS_PER_PIXEL - 1) /
+                    MINIMAP_COLUMNS_PER_PIXEL,
+                MINIMAP_WIDTH);
+  if (row >= minimap->height) {
+    return;
+  }
+  Uint8 *cells = minimap->cells + row * MINIMAP_WIDTH;
+  for (int x = first; x < last; x += 1) {
+    if (cells[x] == 0) {
+      cells[x] = cell;
+    }
+  }
+}
+
+// minimap_finish hashes the tiles, so unchanged ones aren't uploaded again
+void minimap_finish(Minimap *minimap) {
+  for (int t = 0; t < minimap->tiles_count; t += 1) {
+    int first = t * MINIMAP_TILE_HEIGHT;
+    int rows = lt(MINIMAP_TILE_HEIGHT, minimap->height - first);
+    uint32_t hash = 2166136261u; // NOTE: FNV-1a
+    for (int i = first * MINIMAP_WIDTH; i < (first + rows) * MINIMAP_WIDTH;
+         i += 1) {
+      hash = (hash ^ minimap->cells[i]) * 16777619u;
+    }
+    // NOTE: 0 is left for tiles that were never uploaded
+    minimap->tile_hashes[t] = (hash ^ (uint32_t)rows) | 1;
+  }
+}
+
+// frees memory
+void free_minimap(Minimap *minimap) {
+  if (minimap == NULL) {
+    return;
+  }
+  free(minimap->cells);
+  free(minimap);
+}
+
+// minimap_scale returns window pixels per minimap row
+float minimap_scale(Minimap *minimap, int window_height) {
+  if (minimap->height * MINIMAP_ROW_HEIGHT <= window_height) {
+    return MINIMAP_ROW_HEIGHT;
+  }
+  return (float)window_height / (float)minimap->height;
+}
+
+// minimap_upload colors tiles that differ from the minimap with palette,
+// palette has a color for every cell value
+void minimap_upload(SDL_Renderer *renderer, MinimapTiles *tiles,
+                    Minimap *minimap, Uint32 *palette, int palette_count) {
+  uint32_t palette_hash = 2166136261u; // NOTE: FNV-1a
+  for (int i = 0; i < palette_count; i += 1) {
+    palette_hash = (palette_hash ^ palette[i]) * 16777619u;
+  }
+  if (tiles->palette_hash != palette_hash) {
+    memset(tiles->tile_hashes, 0, sizeof(tiles->tile_hashes));
+    tiles->palette_hash = palette_hash;
+  }
+  if (tiles->pixels == NULL) {
+    tiles->pixels =
+        calloc(MINIMAP_WIDTH * MINIMAP_TILE_HEIGHT, sizeof(Uint32));
+  }
+
+  for (int t = 0; t < minimap->tiles_count; t += 1) {
+    if (tiles->tile_hashes[t] == minimap->tile_hashes[t]) {
+      continue;
+    }
+    if (tiles->tiles[t] == NULL) {
+      tiles->tiles[t] = SDL_CreateTexture(
+          renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC,
+          MINIMAP_WIDTH, MINIMAP_TILE_HEIGHT);
+      if (tiles->tiles[t] == NULL) {
+        fprintf(stderr, "failed to create minimap tile: %s\n",
+                SDL_GetError());
+        return;
+      }
+    }
+    int first = t * MINIMAP_TILE_HEIGHT;
+    SDL_Rect rect = {0, 0, MINIMAP_WIDTH,
+                     lt(MINIMAP_TILE_HEIGHT, minimap->height - first)};
+    Uint8 *cells = minimap->cells + first * MINIMAP_WIDTH;
+    for (int i = 0; i < MINIMAP_WIDTH * rect.h; i += 1) {
+      tiles->pixels[i] = palette[cells[i]];
+    }
+    SDL_UpdateTexture(tiles->tiles[t], &rect, tiles->pixels,
+                      MINIMAP_WIDTH * sizeof(Uint32));
+    tiles->tile_hashes[t] = minimap->tile_hashes[t];
+    tiles->uploads += 1;
+  }
+}
+
+// minimap_draw draws the minimap at x, tiles have to be uploaded.
+// returns the number of tiles drawn
+int minimap_draw(SDL_Renderer *renderer, MinimapTiles *tiles,
+                  Minimap *minimap, int x, int window_height) {
+  float scale = minimap_scale(minimap, window_height);
+  int drawn = 0;
+  for (int t = 0; t < minimap->tiles_count; t += 1) {
+    if (tiles->tiles[t] == NULL) {
+      continue;
+    }
+    int first = t * MINIMAP_TILE_HEIGHT;
+    int rows = lt(MINIMAP_TILE_HEIGHT, minimap->height - first);
+    // NOTE: rounded per tile edge, so tiles don't leave seams
+    int y0 = rint(first * scale);
+    int y1 = rint((first + rows) * scale);
+    SDL_Rect src = {0, 0, MINIMAP_WIDTH, rows};
+    SDL_Rect dst = {x, y0, MINIMAP_WIDTH, y1 - y0};
+    SDL_RenderCopy(renderer, tiles->tiles[t], &src, &dst);
+    drawn += 1;
+  }
+  return drawn;
+}
+
+// minimap_blend draws the minimap at x into the framebuffer, colored with
+// palette, without tiles.
+// NOTE: pixel rows are rounded like tile edges of minimap_draw
+void minimap_blend(Framebuffer *fb, Minimap *minimap, Uint32 *palette, int x,
+                   int window_height) {
+  float scale = minimap_scale(minimap, window_height);
+  int x0 = gt(x, fb->clip.x);
+  int x1 = lt(x + MINIMAP_WIDTH, fb->clip.x + fb->clip.w);
+  int y0 = gt(0, fb->clip.y);
+  int y1 = lt(rint(minimap->height * scale), fb->clip.y + fb->clip.h);
+  for (int y = y0; y < y1 && x0 < x1; y += 1) {
+    int row = lt(y / scale, minimap->height - 1);
+    Uint8 *cells = minimap->cells + row * MINIMAP_WIDTH;
+    Uint32 *pixels = fb->pixels + (size_t)y * fb->w;
+    for (int px = x0; px < x1; px += 1) {
+      pixels[px] = palette[cells[px - x]];
+    }
+  }
+}
+
+// minimap_line_at returns the line at window y of the minimap
+int minimap_line_at(Minimap *minimap, int y, int window_height) {
+  int row = clamp(y / minimap_scale(minimap, window_height), 0,
+                  minimap->height - 1);
+  return row * minimap->lines_per_row;
+}
+
+// minimap_line_y returns window y of the line in the minimap
+int minimap_line_y(Minimap *minimap, int line, int window_height) {
+  return rint((float)line / minimap->lines_per_row *
+              minimap_scale(minimap, window_height));
+}
+
+// frees memory
+void free_minimap_tiles(MinimapTiles *tiles) {
+  for (int t = 0; t < MINIMAP_TILES_CAP; t += 1) {
+    if (tiles->tiles[t] != NULL) {
+      SDL_DestroyTexture(tiles->tiles[t]);
+    }
+  }
+  if (tiles->pixels != NULL) {
+    free(tiles->pixels);
+  }
+  *tiles = (MinimapTiles){0};
+}
@@ -0,0 +1,671 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// NOTE: piece table keeps the file contents it was read with untouched
+// and appends inserted text to an add buffer, so edits never copy the file.
+// Document is the sequence of pieces of the two buffers, held in a treap
+// ordered by position. Every node knows the bytes and newlines of its
+// subtree, so edits and lookups by byte offset or by line are O(log n)
+// in the number of pieces.
+
+#define PIECE_BUFFER_INITIAL_CAP 4096
+
+typedef struct {
+  char *v;
+  int len;
+  int cap;
+  int *newlines; // NOTE: offsets of '\n' in v, ascending
+  int newlines_count;
+  int newlines_cap;
+} PieceBuffer;
+
+typedef struct Piece {
+  struct Piece *left;
+  struct Piece *right;
+  unsigned int priority;
+  bool is_add; // NOTE: false if the piece is in the original buffer
+  int start;
+  int len;
+  int newlines;
+  // NOTE: of the subtree
+  int subtree_len;
+  int subtree_newlines;
+} Piece;
+
+typedef struct {
+  PieceBuffer original;
+  PieceBuffer add;
+  Piece *root;
+  int pieces_count;
+  unsigned int seed;
+} PieceTable;
+
+// piece_buffer_append appends v to the buffer and indexes its newlines
+void piece_buffer_append(PieceBuffer *buf, const char *v, int len) {
+  if (buf->len + len + 1 > buf->cap) {
+    int cap = gt(2 * buf->cap, PIECE_BUFFER_INITIAL_CAP);
+    while (cap < buf->len + len + 1) {
+      cap *= 2;
+    }
+    char *grown = calloc(cap, sizeof(char));
+    if (buf->v != NULL) {
+      memcpy(grown, buf->v, buf->len);
+      free(buf->v);
+    }
+    buf->v = grown;
+    buf->cap = cap;
+  }
+  memcpy(buf->v + buf->len, v, len);
+
+  for (int i = 0; i < len; i += 1) {
+    if (v[i] != '\n') {
+      continue;
+    }
+    if (buf->newlines_count == buf->newlines_cap) {
+      buf->newlines_cap = gt(2 * buf->newlines_cap, 64);
+      int *grown = calloc(buf->newlines_cap, sizeof(int));
+      if (buf->newlines != NULL) {
+        memcpy(grown, buf->newlines, buf->newlines_count * sizeof(int));
+        free(buf->newlines);
+      }
+      buf->newlines = grown;
+    }
+    buf->newlines[buf->newlines_count] = buf->len + i;
+    buf->newlines_count += 1;
+  }
+  buf->len += len;
+}
+
+// piece_buffer_newlines_before returns the number of newlines
+// in the buffer before offset
+int piece_buffer_newlines_before(PieceBuffer *buf, int offset) {
+  int lo = 0;
+  int hi = buf->newlines_count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (buf->newlines[mid] < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+PieceBuffer *piece_buffer(PieceTable *pt, Piece *piece) {
+  return piece->is_add ? &pt->add : &pt->original;
+}
+
+void piece_update(Piece *piece) {
+  piece->subtree_len = piece->len;
+  piece->subtree_newlines = piece->newlines;
+  if (piece->left != NULL) {
+    piece->subtree_len += piece->left->subtree_len;
+    piece->subtree_newlines += piece->left->subtree_newlines;
+  }
+  if (piece->right != NULL) {
+    piece->subtree_len += piece->right->subtree_len;
+    piece->subtree_newlines += piece->right->subtree_newlines;
+  }
+}
+
+// piece_set_range points the piece to start, len of its buffer
+void piece_set_range(PieceTable *pt, Piece *piece, int start, int len) {
+  PieceBuffer *buf = piece_buffer(pt, piece);
+  piece->start = start;
+  piece->len = len;
+  piece->newlines = piece_buffer_newlines_before(buf, start + len) -
+                    piece_buffer_newlines_before(buf, start);
+  piece_update(piece);
+}
+
+// allocs memory
+Piece *piece_create(PieceTable *pt, bool is_add, int start, int len) {
+  Piece *piece = calloc(1, sizeof(Piece));
+  // NOTE: xorshift
+  pt->seed ^= pt->seed << 13;
+  pt->seed ^= pt->seed >> 17;
+  pt->seed ^= pt->seed << 5;
+  piece->priority = pt->seed;
+  piece->is_add = is_add;
+  piece_set_range(pt, piece, start, len);
+  pt->pieces_count += 1;
+  return piece;
+}
+
+// piece_merge joins two treaps, all pieces of a come before pieces of b
+Piece *piece_merge(Piece *a, Piece *b) {
+  if (a == NULL) {
+    return b;
+  } else if (b == NULL) {
+    return a;
+  } else if (a->priority > b->priority) {
+    a->right = piece_merge(a->right, b);
+    piece_update(a);
+    return a;
+  }
+  b->left = piece_merge(a, b->left);
+  piece_update(b);
+  return b;
+}
+
+// piece_split splits the treap so that left holds the first offset bytes.
+// piece containing offset is cut in two
+void piece_split(PieceTable *pt, Piece *piece, int offset, Piece **left,
+                 Piece **right) {
+  if (piece == NULL) {
+    *left = NULL;
+    *right = NULL;
+    return;
+  }
+  int left_len = piece->left != NULL ? piece->left->subtree_len : 0;
+  if (offset <= left_len) {
+    piece_split(pt, piece->left, offset, left, &piece->left);
+    piece_update(piece);
+    *right = piece;
+  } else if (left_len + piece->len <= offset) {
+    piece_split(pt, piece->right, offset - left_len - piece->len,
+                &piece->right, right);
+    piece_update(piece);
+    *left = piece;
+  } else {
+    int cut = offset - left_len;
+    Piece *tail = piece_create(pt, piece->is_add, piece->start + cut,
+                               piece->len - cut);
+    Piece *rest = piece->right;
+    piece->right = NULL;
+    piece_set_range(pt, piece, piece->start, cut);
+    *left = piece;
+    *right = piece_merge(tail, rest);
+  }
+}
+
+// frees memory
+void free_pieces(PieceTable *pt, Piece *piece) {
+  if (piece == NULL) {
+    return;
+  }
+  free_pieces(pt, piece->left);
+  free_pieces(pt, piece->right);
+  pt->pieces_count -= 1;
+  free(piece);
+}
+
+int piece_table_len(PieceTable *pt) {
+  return pt->root != NULL ? pt->root->subtree_len : 0;
+}
+
+int piece_table_newlines(PieceTable *pt) {
+  return pt->root != NULL ? pt->root->subtree_newlines : 0;
+}
+
+void piece_table_insert(PieceTable *pt, int offset, const char *v, int len) {
+  if (len <= 0) {
+    return;
+  }
+  offset = clamp(offset, 0, piece_table_len(pt));
+  int start = pt->add.len;
+  piece_buffer_append(&pt->add, v, len);
+  Piece *piece = piece_create(pt, true, start, len);
+
+  Piece *left = NULL;
+  Piece *right = NULL;
+  piece_split(pt, pt->root, offset, &left, &right);
+  pt->root = piece_merge(piece_merge(left, piece), right);
+}
+
+void piece_table_delete(PieceTable *pt, int offset, int len) {
+  offset = clamp(offset, 0, piece_table_len(pt));
+  len = clamp(len, 0, piece_table_len(pt) - offset);
+  if (len == 0) {
+    return;
+  }
+  Piece *left = NULL;
+  Piece *middle = NULL;
+  Piece *right = NULL;
+  piece_split(pt, pt->root, offset, &left, &middle);
+  piece_split(pt, middle, len, &middle, &right);
+  free_pieces(pt, middle);
+  pt->root = piece_merge(left, right);
+}
+
+// piece_table_line_offset returns the byte offset where the line starts,
+// lines are counted from 0
+int piece_table_line_offset(PieceTable *pt, int line) {
+  if (line <= 0) {
+    return 0;
+  } else if (line > piece_table_newlines(pt)) {
+    return piece_table_len(pt);
+  }
+  // NOTE: line starts after its line-th newline
+  int offset = 0;
+  Piece *piece = pt->root;
+  while (piece != NULL) {
+    int left_len = piece->left != NULL ? piece->left->subtree_len : 0;
+    int left_newlines =
+        piece->left != NULL ? piece->left->subtree_newlines : 0;
+    if (line <= left_newlines) {
+      piece = piece->left;
+      continue;
+    }
+    line -= left_newlines;
+    offset += left_len;
+    if (line <= piece->newlines) {
+      PieceBuffer *buf = piece_buffer(pt, piece);
+      int idx = piece_buffer_newlines_before(buf, piece->start) + line - 1;
+      return offset + buf->newlines[idx] - piece->start + 1;
+    }
+    line -= piece->newlines;
+    offset += piece->len;
+    piece = piece->right;
+  }
+  return offset;
+}
+
+// piece_table_line_at returns the line of the byte offset,
+// lines are counted from 0
+int piece_table_line_at(PieceTable *pt, int offset) {
+  int line = 0;
+  Piece *piece = pt->root;
+  while (piece != NULL) {
+    int left_len = piece->left != NULL ? piece->left->subtree_len : 0;
+    if (offset < left_len) {
+      piece = piece->left;
+      continue;
+    }
+    if (piece->left != NULL) {
+      line += piece->left->subtree_newlines;
+    }
+    offset -= left_len;
+    if (offset < piece->len) {
+      PieceBuffer *buf = piece_buffer(pt, piece);
+      return line + piece_buffer_newlines_before(buf, piece->start + offset) -
+             piece_buffer_newlines_before(buf, piece->start);
+    }
+    line += piece->newlines;
+    offset -= piece->len;
+    piece = piece->right;
+  }
+  return line;
+}
+
+// piece_table_chunk returns contents at the byte offset,
+// chunk_len is set to the bytes left in its piece
+char *piece_table_chunk(PieceTable *pt, int offset, int *chunk_len) {
+  Piece *piece = pt->root;
+  while (piece != NULL) {
+    int left_len = piece->left != NULL ? piece->left->subtree_len : 0;
+    if (offset < left_len) {
+      piece = piece->left;
+    } else if (offset < left_len + piece->len) {
+      offset -= left_len;
+      *chunk_len = piece->len - offset;
+      return piece_buffer(pt, piece)->v + piece->start + offset;
+    } else {
+      offset -= left_len + piece->len;
+      piece = piece->right;
+    }
+  }
+  *chunk_len = 0;
+  return NULL;
+}
+
+// piece_table_chunk_before returns the end of contents before the byte
+// offset, chunk_len is set to the bytes before it in its piece
+char *piece_table_chunk_before(PieceTable *pt, int offset, int *chunk_len) {
+  Piece *piece = pt->root;
+  while (piece != NULL && offset > 0) {
+    int left_len = piece->left != NULL ? piece->left->subtree_len : 0;
+    if (offset <= left_len) {
+      piece = piece->left;
+    } else if (offset <= left_len + piece->len) {
+      offset -= left_len;
+      *chunk_len = offset;
+      return piece_buffer(pt, piece)->v + piece->start + offset;
+    } else {
+      offset -= left_len + piece->len;
+      piece = piece->right;
+    }
+  }
+  *chunk_len = 0;
+  return NULL;
+}
+
+// NOTE: iterates contents between offset and end chunk by chunk,
+// see piece_iter_next
+typedef struct {
+  PieceTable *pt;
+  int offset;
+  int end;
+} PieceIter;
+
+PieceIter piece_iter(PieceTable *pt, int offset, int end) {
+  return (PieceIter){pt, clamp(offset, 0, piece_table_len(pt)),
+                     clamp(end, 0, piece_table_len(pt))};
+}
+
+// piece_iter_next returns the next chunk of contents or NULL at the end
+char *piece_iter_next(PieceIter *iter, int *chunk_len) {
+  if (iter->end <= iter->offset) {
+    *chunk_len = 0;
+    return NULL;
+  }
+  char *chunk = piece_table_chunk(iter->pt, iter->offset, chunk_len);
+  *chunk_len = lt(*chunk_len, iter->end - iter->offset);
+  iter->offset += *chunk_len;
+  return chunk;
+}
+
+// piece_table_read copies len bytes from the offset to dst
+// returns number of bytes copied
+int piece_table_read(PieceTable *pt, int offset, int len, char *dst) {
+  PieceIter iter = piece_iter(pt, offset, offset + len);
+  int copied = 0;
+  int chunk_len = 0;
+  char *chunk = NULL;
+  while ((chunk = piece_iter_next(&iter, &chunk_len)) != NULL) {
+    memcpy(dst + copied, chunk, chunk_len);
+    copied += chunk_len;
+  }
+  return copied;
+}
+
+// piece_table_flatten returns the whole contents, null terminated
+// allocs memory
+char *piece_table_flatten(PieceTable *pt, int *contents_len) {
+  int len = piece_table_len(pt);
+  char *contents = calloc(len + 1, sizeof(char));
+  (void)piece_table_read(pt, 0, len, contents);
+  if (contents_len != NULL) {
+    *contents_len = len;
+  }
+  return contents;
+}
+
+// piece_table_rebuild replaces the text with a single piece of a copy of
+// contents and empties the add buffer
+void piece_table_rebuild(PieceTable *pt, const char *contents,
+                         int contents_len) {
+  free_pieces(pt, pt->root);
+  pt->root = NULL;
+  PieceBuffer *buffers[] = {&pt->original, &pt->add};
+  for (int i = 0; i < 2; i += 1) {
+    buffers[i]->len = 0;
+    buffers[i]->newlines_count = 0;
+  }
+  piece_buffer_append(&pt->original, contents, contents_len);
+  if (contents_len > 0) {
+    pt->root = piece_create(pt, false, 0, contents_len);
+  }
+}
+
+// piece_table_update makes the text equal to contents, only the bytes
+// between their common prefix and suffix are replaced, so unchanged
+// parts keep their pieces.
+// NOTE: add buffer only grows with updates, so the table is rebuilt
+// when it would outgrow the text or when most of the text changed
+void piece_table_update(PieceTable *pt, const char *contents,
+                        int contents_len) {
+  int len = piece_table_len(pt);
+  int chunk_len = 0;
+  char *chunk = NULL;
+
+  int prefix = 0;
+  PieceIter iter = piece_iter(pt, 0, len);
+  while ((chunk = piece_iter_next(&iter, &chunk_len)) != NULL) {
+    int n = lt(chunk_len, contents_len - prefix);
+    int i = 0;
+    while (i < n && chunk[i] == contents[prefix + i]) {
+      i += 1;
+    }
+    prefix += i;
+    if (i < chunk_len) {
+      break;
+    }
+  }
+
+  int suffix = 0;
+  int max_suffix = lt(len, contents_len) - prefix;
+  while (suffix < max_suffix) {
+    chunk = piece_table_chunk_before(pt, len - suffix, &chunk_len);
+    int n = lt(chunk_len, max_suffix - suffix);
+    int i = 0;
+    while (i < n &&
+           chunk[-1 - i] == contents[contents_len - 1 - suffix - i]) {
+      i += 1;
+    }
+    suffix += i;
+    if (i < chunk_len) {
+      break;
+    }
+  }
+
+  int changed = contents_len - prefix - suffix;
+  if (pt->add.len + changed > contents_len || 2 * changed > contents_len) {
+    piece_table_rebuild(pt, contents, contents_len);
+    return;
+  }
+  piece_table_delete(pt, prefix, len - prefix - suffix);
+  piece_table_insert(pt, prefix, contents + prefix, changed);
+}
+
+// piece_table_create takes ownership of the contents
+// allocs memory
+PieceTable *piece_table_create(char *contents, int contents_len) {
+  PieceTable *pt = calloc(1, sizeof(PieceTable));
+  pt->seed = 2463534242u;
+  PieceBuffer *buf = &pt->original;
+  buf->v = contents;
+  buf->len = contents_len;
+  buf->cap = contents_len;
+  // NOTE: only indexes newlines, contents isn't copied
+  for (int i = 0; i < contents_len; i += 1) {
+    buf->newlines_cap += contents[i] == '\n';
+  }
+  buf->newlines = calloc(gt(buf->newlines_cap, 1), sizeof(int));
+  for (int i = 0; i < contents_len; i += 1) {
+    if (contents[i] == '\n') {
+      buf->newlines[buf->newlines_count] = i;
+      buf->newlines_count += 1;
+    }
+  }
+  if (contents_len > 0) {
+    pt->root = piece_create(pt, false, 0, contents_len);
+  }
+  return pt;
+}
+
+// frees memory
+void free_piece_table(PieceTable *pt) {
+  if (pt == NULL) {
+    return;
+  }
+  free_pieces(pt, pt->root);
+  PieceBuffer *buffers[] = {&pt->original, &pt->add};
+  for (int i = 0; i < 2; i += 1) {
+    if (buffers[i]->v != NULL) {
+      free(buffers[i]->v);
+    }
+    if (buffers[i]->newlines != NULL) {
+      free(buffers[i]->newlines);
+    }
+  }
+  free(pt);
+}
+
+// piece_table_matches returns the first byte offset where the table and
+// plain differ, -1 if they are equal
+int piece_table_matches(PieceTable *pt, const char *plain, int plain_len) {
+  int len = 0;
+  char *contents = piece_table_flatten(pt, &len);
+  int diff = -1;
+  for (int i = 0; i < lt(len, plain_len) && diff < 0; i += 1) {
+    if (contents[i] != plain[i]) {
+      diff = i;
+    }
+  }
+  if (diff < 0 && len != plain_len) {
+    diff = lt(len, plain_len);
+  }
+  free(contents);
+  return diff;
+}
+
+// piece_table_lines_match returns the first line where line lookups of
+// the table disagree with plain, -1 if they agree
+int piece_table_lines_match(PieceTable *pt, const char *plain,
+                            int plain_len) {
+  int line = 0;
+  int start = 0;
+  for (int i = 0; i <= plain_len; i += 1) {
+    if (i < plain_len && plain[i] != '\n') {
+      continue;
+    }
+    if (piece_table_line_offset(pt, line) != start ||
+        piece_table_line_at(pt, start) != line ||
+        piece_table_line_at(pt, i) != line) {
+      return line;
+    }
+    line += 1;
+    start = i + 1;
+  }
+  return piece_table_newlines(pt) == line - 1 ? -1 : line - 1;
+}
+
+// NOTE: edits of check_piece_table_edits, on the table and a plain buffer,
+// line lookups are checked after every edit
+enum PIECE_CHECK {
+  PIECE_CHECK_INSERT = 0,
+  PIECE_CHECK_DELETE,
+  PIECE_CHECK_READ,
+  PIECE_CHECK_UPDATE,
+  PIECE_CHECK_LINES,
+  PIECE_CHECK_COUNT
+};
+
+const char *piece_check_names[PIECE_CHECK_COUNT] = {
+    "insert", "delete", "read", "update", "lines"};
+
+// piece_check_lines counts the line lookups of an edit in ok and total
+void piece_check_lines(PieceTable *pt, const char *plain, int plain_len,
+                       const char *edit, int *ok, int *total) {
+  total[PIECE_CHECK_LINES] += 1;
+  int line = piece_table_lines_match(pt, plain, plain_len);
+  if (line < 0) {
+    ok[PIECE_CHECK_LINES] += 1;
+  } else {
+    printf("lines after %s: mismatch at line %d\n", edit, line);
+  }
+}
+
+// check_piece_table_edits applies the same pseudo random edits to a piece
+// table of contents and to a plain copy of it, and prints how many of them
+// matched per kind of edit
+void check_piece_table_edits(const char *contents, int contents_len) {
+  const char snippet[] = "ab\n\xc3\xa4 {}\n\t//";
+  const int edits_count = 200;
+  int cap = contents_len + edits_count * (int)sizeof(snippet) + 1;
+  char *plain = calloc(cap, sizeof(char));
+  char *next = calloc(cap, sizeof(char));
+  char *read = calloc(cap, sizeof(char));
+  memcpy(plain, contents, contents_len);
+  int plain_len = contents_len;
+
+  char *original = calloc(contents_len + 1, sizeof(char));
+  memcpy(original, contents, contents_len);
+  PieceTable *pt = piece_table_create(original, contents_len);
+
+  int ok[PIECE_CHECK_COUNT] = {0};
+  int total[PIECE_CHECK_COUNT] = {0};
+  unsigned int seed = 88172645u;
+  for (int i = 0; i < edits_count; i += 1) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int offset = seed % (plain_len + 1);
+    int len = (seed >> 8) % sizeof(snippet);
+    enum PIECE_CHECK kind = (seed >> 16) % PIECE_CHECK_LINES;
+
+    if (kind == PIECE_CHECK_INSERT) {
+      piece_table_insert(pt, offset, snippet, len);
+      memmove(plain + offset + len, plain + offset, plain_len - offset);
+      memcpy(plain + offset, snippet, len);
+      plain_len += len;
+    } else if (kind == PIECE_CHECK_DELETE) {
+      len = lt(2 * len, plain_len - offset);
+      piece_table_delete(pt, offset, len);
+      memmove(plain + offset, plain + offset + len,
+              plain_len - offset - len);
+      plain_len -= len;
+    } else if (kind == PIECE_CHECK_READ) {
+      len = lt(4 * len, plain_len - offset);
+      total[kind] += 1;
+      if (piece_table_read(pt, offset, len, read) == len &&
+          memcmp(read, plain + offset, len) == 0) {
+        ok[kind] += 1;
+      } else {
+        printf("read %d: mismatch at byte %d\n", i, offset);
+      }
+      continue;
+    } else {
+      // NOTE: next replaces a span of plain, the span may be empty
+      // and may reach either end
+      len = lt(2 * len, plain_len - offset);
+      int replace_len = (seed >> 24) % sizeof(snippet);
+      memcpy(next, plain, offset);
+      memcpy(next + offset, snippet, replace_len);
+      memcpy(next + offset + replace_len, plain + offset + len,
+             plain_len - offset - len);
+      plain_len += replace_len - len;
+      memcpy(plain, next, plain_len);
+      piece_table_update(pt, next, plain_len);
+    }
+
+    total[kind] += 1;
+    int diff = piece_table_matches(pt, plain, plain_len);
+    if (diff >= 0) {
+      printf("%s %d: mismatch at byte %d\n", piece_check_names[kind], i,
+             diff);
+    } else if (kind == PIECE_CHECK_UPDATE && pt->add.len > plain_len) {
+      printf("update %d: add buffer of %d bytes for %d bytes of text\n", i,
+             pt->add.len, plain_len);
+    } else {
+      ok[kind] += 1;
+    }
+    piece_check_lines(pt, plain, plain_len, piece_check_names[kind], ok,
+                      total);
+  }
+
+  // NOTE: updates to the original contents and to nothing at all
+  const char *updates[] = {contents, ""};
+  int updates_len[] = {contents_len, 0};
+  for (int i = 0; i < 2; i += 1) {
+    piece_table_update(pt, updates[i], updates_len[i]);
+    total[PIECE_CHECK_UPDATE] += 1;
+    int diff = piece_table_matches(pt, updates[i], updates_len[i]);
+    if (diff >= 0) {
+      printf("update to %d bytes: mismatch at byte %d\n", updates_len[i],
+             diff);
+    } else if (pt->add.len > updates_len[i]) {
+      printf("update to %d bytes: add buffer of %d bytes\n", updates_len[i],
+             pt->add.len);
+    } else {
+      ok[PIECE_CHECK_UPDATE] += 1;
+    }
+    piece_check_lines(pt, updates[i], updates_len[i], "update", ok, total);
+  }
+
+  for (int i = 0; i < PIECE_CHECK_COUNT; i += 1) {
+    printf("%s: %d/%d ok\n", piece_check_names[i], ok[i], total[i]);
+  }
+  free_piece_table(pt);
+  free(read);
+  free(next);
+  free(plain);
+}
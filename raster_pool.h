@@ -0,0 +1,294 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atlas.h"
+#include "sdf.h"
+#include "utils.h"
+
+// NOTE: raster pool rasterizes glyphs missing from the atlas on worker
+// threads, when a lot of them are needed at once, eg the window after
+// opening a file or zooming to a size without an atlas.
+// Every worker opens its own font, fonts aren't shared between threads.
+// Workers render glyph surfaces for font atlases, and distance fields for
+// sdf atlases. Packing and uploading stays on the render thread, which
+// owns the renderer, and it waits for the batch meanwhile.
+// Rows in the window are rasterized in their own batch, before the rows
+// that are prefetched, so they are uploaded first.
+
+#define RASTER_POOL_THREADS_CAP 8
+#define RASTER_POOL_MIN_JOBS 16 // NOTE: fewer glyphs are rasterized inline
+
+typedef struct {
+  int codepoint;
+  SDL_Surface *surface; // NOTE: of font atlases
+  SdfGlyph sdf_glyph;   // NOTE: of sdf atlases
+} RasterJob;
+
+typedef struct {
+  SDL_Thread *threads[RASTER_POOL_THREADS_CAP];
+  int threads_count;
+  const char *font_path;
+  //
+  SDL_mutex *lock;
+  SDL_cond *wake;
+  SDL_cond *done;
+  // NOTE: guarded by lock
+  RasterJob *jobs;
+  int jobs_count;
+  int next_job;
+  int done_count;
+  int font_size; // NOTE: jobs are rasterized with this size
+  bool is_sdf;
+  bool quit;
+  // NOTE: owned by the render thread
+  int jobs_cap;
+  long batches;
+  long glyphs;
+  Uint64 ticks;
+} RasterPool;
+
+void raster_job_run(RasterJob *job, TTF_Font *font, bool is_sdf) {
+  if (font == NULL) {
+    return; // NOTE: glyph is rasterized inline instead
+  }
+  if (is_sdf) {
+    job->sdf_glyph.codepoint = job->codepoint;
+    sdf_rasterize(font, &job->sdf_glyph);
+  } else {
+    job->surface = atlas_render_glyph(font, job->codepoint);
+  }
+}
+
+// raster_worker_run takes jobs until the pool quits.
+// NOTE: font is opened again when a batch is of another size
+int raster_worker_run(void *data) {
+  RasterPool *pool = data;
+  TTF_Font *font = NULL;
+  int font_size = 0;
+
+  SDL_LockMutex(pool->lock);
+  while (true) {
+    while (!pool->quit && pool->next_job == pool->jobs_count) {
+      SDL_CondWait(pool->wake, pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    RasterJob *job = &pool->jobs[pool->next_job];
+    pool->next_job += 1;
+    int job_font_size = pool->font_size;
+    bool is_sdf = pool->is_sdf;
+    SDL_UnlockMutex(pool->lock);
+
+    if (font == NULL || font_size != job_font_size) {
+      SDL_LockMutex(ATLAS_FONT_LOCK);
+      if (font != NULL) {
+        TTF_CloseFont(font);
+      }
+      font = TTF_OpenFont(pool->font_path, job_font_size);
+      SDL_UnlockMutex(ATLAS_FONT_LOCK);
+      font_size = job_font_size;
+      if (font == NULL) {
+        fprintf(stderr, "failed to load raster pool font: %s\n",
+                TTF_GetError());
+      }
+    }
+    raster_job_run(job, font, is_sdf);
+
+    SDL_LockMutex(pool->lock);
+    pool->done_count += 1;
+    if (pool->done_count == pool->jobs_count) {
+      SDL_CondSignal(pool->done);
+    }
+  }
+  SDL_UnlockMutex(pool->lock);
+
+  if (font != NULL) {
+    SDL_LockMutex(ATLAS_FONT_LOCK);
+    TTF_CloseFont(font);
+    SDL_UnlockMutex(ATLAS_FONT_LOCK);
+  }
+  return EXIT_SUCCESS;
+}
+
+// frees memory
+void raster_pool_stop(RasterPool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  SDL_LockMutex(pool->lock);
+  pool->quit = true;
+  SDL_CondBroadcast(pool->wake);
+  SDL_UnlockMutex(pool->lock);
+  for (int i = 0; i < pool->threads_count; i += 1) {
+    SDL_WaitThread(pool->threads[i], NULL);
+  }
+  if (pool->jobs != NULL) {
+    free(pool->jobs);
+  }
+  SDL_DestroyCond(pool->done);
+  SDL_DestroyCond(pool->wake);
+  SDL_DestroyMutex(pool->lock);
+  free(pool);
+}
+
+// raster_pool_start starts a worker per core, ATLAS_FONT_LOCK has to exist.
+// returns NULL if there is a single core, glyphs are rasterized inline then
+// allocs memory
+RasterPool *raster_pool_start(const char *font_path) {
+  int threads_count = lt(SDL_GetCPUCount(), RASTER_POOL_THREADS_CAP);
+  if (threads_count <= 1 || ATLAS_FONT_LOCK == NULL) {
+    return NULL;
+  }
+  RasterPool *pool = calloc(1, sizeof(RasterPool));
+  pool->font_path = font_path;
+  pool->lock = SDL_CreateMutex();
+  pool->wake = SDL_CreateCond();
+  pool->done = SDL_CreateCond();
+  for (int i = 0; i < threads_count; i += 1) {
+    SDL_Thread *thread = SDL_CreateThread(raster_worker_run, "raster", pool);
+    if (thread == NULL) {
+      fprintf(stderr, "failed to create raster thread: %s\n",
+              SDL_GetError());
+      break;
+    }
+    pool->threads[pool->threads_count] = thread;
+    pool->threads_count += 1;
+  }
+  if (pool->threads_count == 0) {
+    raster_pool_stop(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+// raster_pool_jobs returns room for count jobs of the next batch
+RasterJob *raster_pool_jobs(RasterPool *pool, int count) {
+  if (pool->jobs_cap < count) {
+    pool->jobs_cap = gt(count, 2 * pool->jobs_cap);
+    pool->jobs = realloc(pool->jobs, pool->jobs_cap * sizeof(RasterJob));
+  }
+  memset(pool->jobs, 0, count * sizeof(RasterJob));
+  return pool->jobs;
+}
+
+// raster_pool_run rasterizes count jobs from raster_pool_jobs
+// with fonts of font_size and waits until they are done
+void raster_pool_run(RasterPool *pool, int count, int font_size,
+                     bool is_sdf) {
+  if (count <= 0) {
+    return;
+  }
+  Uint64 start = SDL_GetPerformanceCounter();
+  SDL_LockMutex(pool->lock);
+  pool->jobs_count = count;
+  pool->next_job = 0;
+  pool->done_count = 0;
+  pool->font_size = font_size;
+  pool->is_sdf = is_sdf;
+  SDL_CondBroadcast(pool->wake);
+  while (pool->done_count < pool->jobs_count) {
+    SDL_CondWait(pool->done, pool->lock);
+  }
+  // NOTE: workers wait for the next batch
+  pool->jobs_count = 0;
+  pool->next_job = 0;
+  SDL_UnlockMutex(pool->lock);
+  pool->batches += 1;
+  pool->glyphs += count;
+  pool->ticks += SDL_GetPerformanceCounter() - start;
+}
+
+int compare_codepoints(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// raster_glyphs rasterizes missing glyphs of codepoints into the atlas,
+// on the pool if at least RASTER_POOL_MIN_JOBS of them are missing.
+// NOTE: codepoints are reordered
+void raster_glyphs(RasterPool *pool, GlyphAtlas *atlas,
+                   SDL_Renderer *renderer, int *codepoints, int count) {
+  if (atlas == NULL || count <= 0) {
+    return;
+  }
+  qsort(codepoints, count, sizeof(int), compare_codepoints);
+  int missing_count = 0;
+  for (int i = 0; i < count; i += 1) {
+    int codepoint = codepoints[i];
+    if (i > 0 && codepoint == codepoints[i - 1]) {
+      continue;
+    }
+    if (!atlas_is_missing(atlas, codepoint)) {
+      continue;
+    }
+    codepoints[missing_count] = codepoint;
+    missing_count += 1;
+  }
+  if (missing_count == 0) {
+    return;
+  }
+
+  if (pool != NULL && atlas->font != NULL &&
+      missing_count >= RASTER_POOL_MIN_JOBS) {
+    RasterJob *jobs = raster_pool_jobs(pool, missing_count);
+    for (int i = 0; i < missing_count; i += 1) {
+      jobs[i].codepoint = codepoints[i];
+    }
+    raster_pool_run(pool, missing_count, atlas->font_size, false);
+    if (atlas->unloaded) {
+      atlas_reload(atlas, renderer);
+    }
+    for (int i = 0; i < missing_count; i += 1) {
+      Glyph *glyph = atlas_glyph_metrics(atlas, jobs[i].codepoint);
+      if (jobs[i].surface == NULL) {
+        atlas_rasterize(atlas, renderer, glyph); // NOTE: try inline
+      } else {
+        atlas_pack(atlas, renderer, glyph, jobs[i].surface);
+      }
+    }
+  } else if (pool != NULL && atlas->sdf != NULL) {
+    // NOTE: only distance fields are rasterized with the font,
+    // converting them to the atlas size is a cheap resample
+    RasterJob *jobs = raster_pool_jobs(pool, missing_count);
+    int jobs_count = 0;
+    for (int i = 0; i < missing_count; i += 1) {
+      if (!sdf_has_glyph(atlas->sdf, codepoints[i])) {
+        jobs[jobs_count].codepoint = codepoints[i];
+        jobs_count += 1;
+      }
+    }
+    if (jobs_count >= RASTER_POOL_MIN_JOBS) {
+      raster_pool_run(pool, jobs_count, SDF_FONT_SIZE, true);
+      for (int i = 0; i < jobs_count; i += 1) {
+        if (jobs[i].sdf_glyph.codepoint == jobs[i].codepoint) {
+          sdf_insert(atlas->sdf, &jobs[i].sdf_glyph);
+        }
+      }
+    }
+  }
+
+  // NOTE: glyphs that weren't rasterized on the pool, and sdf conversions
+  for (int i = 0; i < missing_count; i += 1) {
+    (void)atlas_glyph(atlas, renderer, codepoints[i]);
+  }
+}
+
+void print_raster_pool_stats(RasterPool *pool) {
+  if (pool == NULL) {
+    printf("[STATS]: raster pool: off, glyphs are rasterized inline\n");
+    return;
+  }
+  double frequency = (double)SDL_GetPerformanceFrequency();
+  printf("[STATS]: raster pool: %ld glyphs in %ld batches on %d threads, "
+         "%.2fms per batch\n",
+         pool->glyphs, pool->batches, pool->threads_count,
+         pool->batches > 0 && frequency > 0
+             ? 1000.0 * pool->ticks / frequency / pool->batches
+             : 0.0);
+}
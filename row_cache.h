@@ -0,0 +1,127 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// NOTE: row cache keeps glyph quads of drawn rows, so a row that was drawn
+// before is queued by copying its quads instead of looking up every glyph.
+// Rows are cached in segments of ROW_CACHE_SEGMENT_WIDTH pixels, so only
+// segments of a long row that reach the window are rasterized and kept.
+// Segments are keyed by the hash of the tokens of their row and their
+// index, so equal rows share quads, also across reloads. Quads also depend
+// on the atlas, font scale and colors, they make up the epoch and the cache
+// is cleared when it changes.
+// Cache is direct mapped, a segment replaces the one it collides with.
+
+#define ROW_CACHE_CAP 1024           // NOTE: must be power of 2
+#define ROW_CACHE_SEGMENT_WIDTH 1024 // NOTE: in window pixels
+#define ROW_CACHE_QUADS_KEEP 256     // NOTE: more are freed on replace
+
+typedef struct {
+  int page;
+  SDL_Vertex vertices[4]; // NOTE: relative to the start of the row
+} RowQuad;
+
+typedef struct {
+  uint64_t hash;
+  bool used;
+  RowQuad *quads; // NOTE: in order of x
+  int quads_count;
+  int quads_cap;
+} CachedRow;
+
+typedef struct {
+  CachedRow *rows;
+  uint64_t epoch;
+  //
+  long lookups;
+  long hits;
+} RowCache;
+
+// row_cache_begin clears the cache if quads were made in another epoch
+void row_cache_begin(RowCache *cache, uint64_t epoch) {
+  if (cache->rows == NULL) {
+    cache->rows = calloc(ROW_CACHE_CAP, sizeof(CachedRow));
+  } else if (cache->epoch != epoch) {
+    for (int i = 0; i < ROW_CACHE_CAP; i += 1) {
+      cache->rows[i].used = false;
+    }
+  }
+  cache->epoch = epoch;
+}
+
+// row_cache_get returns the cached segment of the row of hash. If it isn't
+// cached, is_new is set and the returned row is emptied for the caller
+// to fill with quads of the segment
+CachedRow *row_cache_get(RowCache *cache, uint64_t row_hash, int segment,
+                         bool *is_new) {
+  cache->lookups += 1;
+  uint64_t hash = (row_hash ^ (uint64_t)segment) * 1099511628211ull;
+  CachedRow *row = &cache->rows[hash & (ROW_CACHE_CAP - 1)];
+  if (row->used && row->hash == hash) {
+    cache->hits += 1;
+    *is_new = false;
+    return row;
+  }
+  if (row->quads_cap > ROW_CACHE_QUADS_KEEP) {
+    free(row->quads);
+    row->quads = NULL;
+    row->quads_cap = 0;
+  }
+  row->used = true;
+  row->hash = hash;
+  row->quads_count = 0;
+  *is_new = true;
+  return row;
+}
+
+void cached_row_add(CachedRow *row, int page, SDL_Vertex *vertices) {
+  if (row->quads_count == row->quads_cap) {
+    row->quads_cap = gt(2 * row->quads_cap, 64);
+    row->quads = realloc(row->quads, row->quads_cap * sizeof(RowQuad));
+  }
+  RowQuad *quad = &row->quads[row->quads_count];
+  quad->page = page;
+  memcpy(quad->vertices, vertices, sizeof(quad->vertices));
+  row->quads_count += 1;
+}
+
+// cached_row_first_quad returns the first quad that ends right of x
+int cached_row_first_quad(CachedRow *row, float x) {
+  int lo = 0;
+  int hi = row->quads_count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (row->quads[mid].vertices[1].position.x <= x) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// frees memory
+void free_row_cache(RowCache *cache) {
+  if (cache->rows != NULL) {
+    for (int i = 0; i < ROW_CACHE_CAP; i += 1) {
+      if (cache->rows[i].quads != NULL) {
+        free(cache->rows[i].quads);
+      }
+    }
+    free(cache->rows);
+  }
+  *cache = (RowCache){0};
+}
+
+void print_row_cache_stats(RowCache *cache) {
+  printf("[STATS]: row cache: %ld segment lookups, %.1f%% hit rate\n",
+         cache->lookups,
+         cache->lookups > 0 ? 100.0 * cache->hits / cache->lookups : 0.0);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// NOTE: run cache hash-conses token layouts.
+// Source code repeats the same tokens constantly, so identical
+// (token text, font size) pairs share one reference counted Run.
+// Color isn't part of the key, because glyphs are tinted when drawn.
+
+#define RUNS_INITIAL_CAP 4096 // NOTE: must be power of 2
+
+typedef struct Run {
+  struct Run *next;
+  char *v;
+  int vlen;
+  int font_size;
+  int w;
+  int refs;
+  uint32_t hash;
+} Run;
+
+typedef struct {
+  Run **buckets;
+  int buckets_cap;
+  int runs_count;
+  //
+  long lookups;
+  long hits;
+} RunCache;
+
+RunCache run_cache = {0};
+
+uint32_t run_hash(const char *v, int vlen, int font_size) {
+  uint32_t hash = 2166136261u; // NOTE: FNV-1a
+  for (int i = 0; i < vlen; i += 1) {
+    hash = (hash ^ (unsigned char)v[i]) * 16777619u;
+  }
+  return (hash ^ (uint32_t)font_size) * 16777619u;
+}
+
+void run_cache_grow(RunCache *cache) {
+  int buckets_cap = gt(2 * cache->buckets_cap, RUNS_INITIAL_CAP);
+  Run **buckets = calloc(buckets_cap, sizeof(Run *));
+  for (int i = 0; i < cache->buckets_cap; i += 1) {
+    Run *run = cache->buckets[i];
+    while (run != NULL) {
+      Run *next = run->next;
+      int idx = run->hash & (buckets_cap - 1);
+      run->next = buckets[idx];
+      buckets[idx] = run;
+      run = next;
+    }
+  }
+  if (cache->buckets != NULL) {
+    free(cache->buckets);
+  }
+  cache->buckets = buckets;
+  cache->buckets_cap = buckets_cap;
+}
+
+// run_acquire returns the shared run for given text and font size and
+// takes a reference. Width of a new run is 0, caller is expected to fill it.
+// allocs memory
+Run *run_acquire(RunCache *cache, const char *v, int vlen, int font_size,
+                 bool *is_new) {
+  if (4 * (cache->runs_count + 1) > 3 * cache->buckets_cap) {
+    run_cache_grow(cache);
+  }
+  cache->lookups += 1;
+
+  uint32_t hash = run_hash(v, vlen, font_size);
+  int idx = hash & (cache->buckets_cap - 1);
+  for (Run *run = cache->buckets[idx]; run != NULL; run = run->next) {
+    if (run->hash == hash && run->font_size == font_size &&
+        run->vlen == vlen && memcmp(run->v, v, vlen) == 0) {
+      cache->hits += 1;
+      run->refs += 1;
+      *is_new = false;
+      return run;
+    }
+  }
+
+  Run *run = calloc(1, sizeof(Run));
+  run->v = calloc(vlen + 1, sizeof(char));
+  memcpy(run->v, v, vlen);
+  run->vlen = vlen;
+  run->font_size = font_size;
+  run->refs = 1;
+  run->hash = hash;
+  run->next = cache->buckets[idx];
+  cache->buckets[idx] = run;
+  cache->runs_count += 1;
+  *is_new = true;
+  return run;
+}
+
+// run_release drops a reference, run is freed when it's not used anymore.
+// frees memory
+void run_release(RunCache *cache, Run *run) {
+  if (run == NULL) {
+    return;
+  }
+  run->refs -= 1;
+  if (run->refs > 0) {
+    return;
+  }
+  int idx = run->hash & (cache->buckets_cap - 1);
+  Run **cur = &cache->buckets[idx];
+  for (; *cur != NULL && *cur != run; cur = &(*cur)->next) {
+    ;
+  }
+  if (*cur == run) {
+    *cur = run->next;
+  }
+  cache->runs_count -= 1;
+  free(run->v);
+  free(run);
+}
+
+// frees memory
+void free_run_cache(RunCache *cache) {
+  for (int i = 0; i < cache->buckets_cap; i += 1) {
+    Run *run = cache->buckets[i];
+    while (run != NULL) {
+      Run *next = run->next;
+      free(run->v);
+      free(run);
+      run = next;
+    }
+  }
+  if (cache->buckets != NULL) {
+    free(cache->buckets);
+  }
+  *cache = (RunCache){0};
+}
+
+void print_run_cache_stats(RunCache *cache, int textures_count) {
+  printf("[STATS]: run cache: %d unique runs for %d tokens, "
+         "%ld lookups, %.1f%% hit rate\n",
+         cache->runs_count, textures_count, cache->lookups,
+         cache->lookups > 0 ? 100.0 * cache->hits / cache->lookups : 0.0);
+}
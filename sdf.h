@@ -0,0 +1,311 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// NOTE: signed distance fields of glyphs are rasterized once, at
+// SDF_FONT_SIZE, and any smaller font size is drawn from them.
+// SDL renderer can't threshold distances in a shader, so glyphs are
+// converted to coverage on CPU once per drawn font size (see atlas.h),
+// which is a cheap resample instead of rasterizing with the font again.
+
+#define SDF_FONT_SIZE 64  // NOTE: at least FONT_UPPER_BOUND, only downscaled
+#define SDF_SPREAD 6      // in pixels of SDF_FONT_SIZE
+#define SDF_GLYPHS_INITIAL_CAP 256 // NOTE: must be power of 2
+
+typedef struct {
+  int codepoint;
+  bool used;
+  int advance;
+  int w; // NOTE: size of the glyph box, field is padded by SDF_SPREAD
+  int h;
+  Uint8 *field; // NOTE: 128 is the edge, larger values are inside
+} SdfGlyph;
+
+typedef struct {
+  TTF_Font *font;
+  int line_height;
+  //
+  SdfGlyph *glyphs; // NOTE: open addressing
+  int glyphs_count;
+  int glyphs_cap;
+  //
+  long conversions;
+} SdfFont;
+
+SdfGlyph *sdf_find_slot(SdfGlyph *glyphs, int glyphs_cap, int codepoint) {
+  unsigned int i = ((unsigned int)codepoint * 2654435761u) & (glyphs_cap - 1);
+  while (glyphs[i].used && glyphs[i].codepoint != codepoint) {
+    i = (i + 1) & (glyphs_cap - 1);
+  }
+  return &glyphs[i];
+}
+
+void sdf_grow(SdfFont *sdf) {
+  int glyphs_cap = gt(2 * sdf->glyphs_cap, SDF_GLYPHS_INITIAL_CAP);
+  SdfGlyph *glyphs = calloc(glyphs_cap, sizeof(SdfGlyph));
+  for (int i = 0; i < sdf->glyphs_cap; i += 1) {
+    if (sdf->glyphs[i].used) {
+      *sdf_find_slot(glyphs, glyphs_cap, sdf->glyphs[i].codepoint) =
+          sdf->glyphs[i];
+    }
+  }
+  if (sdf->glyphs != NULL) {
+    free(sdf->glyphs);
+  }
+  sdf->glyphs = glyphs;
+  sdf->glyphs_cap = glyphs_cap;
+}
+
+// sdf_chamfer propagates distances to the nearest zero of dist,
+// in a forward and a backward pass
+void sdf_chamfer(float *dist, int w, int h) {
+  const float diagonal = 1.41421356f;
+  for (int y = 0; y < h; y += 1) {
+    for (int x = 0; x < w; x += 1) {
+      float *d = &dist[y * w + x];
+      if (x > 0) {
+        *d = fminf(*d, d[-1] + 1);
+      }
+      if (y > 0) {
+        *d = fminf(*d, d[-w] + 1);
+        if (x > 0) {
+          *d = fminf(*d, d[-w - 1] + diagonal);
+        }
+        if (x < w - 1) {
+          *d = fminf(*d, d[-w + 1] + diagonal);
+        }
+      }
+    }
+  }
+  for (int y = h - 1; y >= 0; y -= 1) {
+    for (int x = w - 1; x >= 0; x -= 1) {
+      float *d = &dist[y * w + x];
+      if (x < w - 1) {
+        *d = fminf(*d, d[1] + 1);
+      }
+      if (y < h - 1) {
+        *d = fminf(*d, d[w] + 1);
+        if (x < w - 1) {
+          *d = fminf(*d, d[w + 1] + diagonal);
+        }
+        if (x > 0) {
+          *d = fminf(*d, d[w - 1] + diagonal);
+        }
+      }
+    }
+  }
+}
+
+// sdf_rasterize renders the glyph with font, opened at SDF_FONT_SIZE,
+// and computes its distance field.
+// NOTE: doesn't touch the SdfFont, so it can run on other threads
+// with their own font (see raster_pool.h)
+void sdf_rasterize(TTF_Font *font, SdfGlyph *glyph) {
+  int advance = 0;
+  TTF_GlyphMetrics32(font, glyph->codepoint, NULL, NULL, NULL, NULL,
+                     &advance);
+  glyph->advance = advance;
+
+  SDL_Surface *rendered = TTF_RenderGlyph32_Blended(
+      font, glyph->codepoint, (SDL_Color){255, 255, 255, 255});
+  if (rendered == NULL) {
+    fprintf(stderr, "failed to create sdf glyph surface: %s\n",
+            TTF_GetError());
+    return;
+  }
+  SDL_Surface *surface =
+      SDL_ConvertSurfaceFormat(rendered, SDL_PIXELFORMAT_ARGB8888, 0);
+  SDL_FreeSurface(rendered);
+  if (surface == NULL) {
+    fprintf(stderr, "failed to convert sdf glyph surface: %s\n",
+            SDL_GetError());
+    return;
+  }
+
+  int w = surface->w + 2 * SDF_SPREAD;
+  int h = surface->h + 2 * SDF_SPREAD;
+  float *to_inside = calloc(w * h, sizeof(float));
+  float *to_outside = calloc(w * h, sizeof(float));
+  float *coverage = calloc(w * h, sizeof(float));
+  for (int y = 0; y < surface->h; y += 1) {
+    Uint32 *row = (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch);
+    for (int x = 0; x < surface->w; x += 1) {
+      coverage[(y + SDF_SPREAD) * w + x + SDF_SPREAD] =
+          (row[x] >> 24) / 255.0f;
+    }
+  }
+  for (int i = 0; i < w * h; i += 1) {
+    bool inside = coverage[i] >= 0.5f;
+    to_inside[i] = inside ? 0 : INFINITY;
+    to_outside[i] = inside ? INFINITY : 0;
+  }
+  sdf_chamfer(to_inside, w, h);
+  sdf_chamfer(to_outside, w, h);
+
+  glyph->w = surface->w;
+  glyph->h = surface->h;
+  glyph->field = calloc(w * h, sizeof(Uint8));
+  for (int i = 0; i < w * h; i += 1) {
+    // NOTE: positive outside, in pixels; antialiased pixels on the edge
+    // know their distance better than the binary mask
+    float distance = coverage[i] >= 0.5f ? 0.5f - to_outside[i]
+                                         : to_inside[i] - 0.5f;
+    if (0 < coverage[i] && coverage[i] < 1) {
+      distance = 0.5f - coverage[i];
+    }
+    glyph->field[i] =
+        clamp(lrintf(128 - distance * 127 / SDF_SPREAD), 0, 255);
+  }
+
+  free(coverage);
+  free(to_outside);
+  free(to_inside);
+  SDL_FreeSurface(surface);
+}
+
+// sdf_glyph returns the distance field of codepoint, rasterizing it once
+SdfGlyph *sdf_glyph(SdfFont *sdf, int codepoint) {
+  if (4 * (sdf->glyphs_count + 1) > 3 * sdf->glyphs_cap) {
+    sdf_grow(sdf);
+  }
+  SdfGlyph *glyph = sdf_find_slot(sdf->glyphs, sdf->glyphs_cap, codepoint);
+  if (!glyph->used) {
+    glyph->used = true;
+    glyph->codepoint = codepoint;
+    sdf->glyphs_count += 1;
+    sdf_rasterize(sdf->font, glyph);
+  }
+  return glyph;
+}
+
+bool sdf_has_glyph(SdfFont *sdf, int codepoint) {
+  return sdf_find_slot(sdf->glyphs, sdf->glyphs_cap, codepoint)->used;
+}
+
+// sdf_insert adds a glyph rasterized elsewhere, the font takes its field.
+// NOTE: a glyph that is there already is kept
+void sdf_insert(SdfFont *sdf, SdfGlyph *rasterized) {
+  if (4 * (sdf->glyphs_count + 1) > 3 * sdf->glyphs_cap) {
+    sdf_grow(sdf);
+  }
+  SdfGlyph *glyph =
+      sdf_find_slot(sdf->glyphs, sdf->glyphs_cap, rasterized->codepoint);
+  if (glyph->used) {
+    if (rasterized->field != NULL) {
+      free(rasterized->field);
+    }
+  } else {
+    *glyph = *rasterized;
+    glyph->used = true;
+    sdf->glyphs_count += 1;
+  }
+  *rasterized = (SdfGlyph){0};
+}
+
+// sdf_sample returns the distance at x, y of the glyph box,
+// interpolated bilinearly
+float sdf_sample(SdfGlyph *glyph, float x, float y) {
+  int w = glyph->w + 2 * SDF_SPREAD;
+  int h = glyph->h + 2 * SDF_SPREAD;
+  x = fminf(fmaxf(x + SDF_SPREAD, 0), w - 1);
+  y = fminf(fmaxf(y + SDF_SPREAD, 0), h - 1);
+  int x0 = (int)x;
+  int y0 = (int)y;
+  int x1 = lt(x0 + 1, w - 1);
+  int y1 = lt(y0 + 1, h - 1);
+  float fx = x - x0;
+  float fy = y - y0;
+  Uint8 *f = glyph->field;
+  float top = f[y0 * w + x0] * (1 - fx) + f[y0 * w + x1] * fx;
+  float bottom = f[y1 * w + x0] * (1 - fx) + f[y1 * w + x1] * fx;
+  float value = top * (1 - fy) + bottom * fy;
+  return (128 - value) * SDF_SPREAD / 127;
+}
+
+// sdf_glyph_advance returns the advance of codepoint scaled to line_height
+int sdf_glyph_advance(SdfFont *sdf, int codepoint, int line_height) {
+  SdfGlyph *glyph = sdf_glyph(sdf, codepoint);
+  return lrintf(glyph->advance * (float)line_height / sdf->line_height);
+}
+
+// sdf_glyph_surface converts the distance field of codepoint to
+// white glyph with coverage in alpha, scaled to line_height.
+// returns NULL if there is nothing to draw
+// allocs memory
+SDL_Surface *sdf_glyph_surface(SdfFont *sdf, int codepoint,
+                               int line_height) {
+  SdfGlyph *glyph = sdf_glyph(sdf, codepoint);
+  if (glyph->field == NULL) {
+    return NULL;
+  }
+  float scale = (float)line_height / sdf->line_height;
+  int w = gt(lrintf(glyph->w * scale), 1);
+  int h = gt(lrintf(glyph->h * scale), 1);
+  SDL_Surface *surface =
+      SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+  if (surface == NULL) {
+    fprintf(stderr, "failed to create sdf coverage surface: %s\n",
+            SDL_GetError());
+    return NULL;
+  }
+  sdf->conversions += 1;
+
+  for (int y = 0; y < h; y += 1) {
+    Uint32 *row = (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch);
+    float sdf_y = (y + 0.5f) / scale - 0.5f;
+    for (int x = 0; x < w; x += 1) {
+      float sdf_x = (x + 0.5f) / scale - 0.5f;
+      // NOTE: distance in pixels of line_height
+      float distance = sdf_sample(glyph, sdf_x, sdf_y) * scale;
+      float alpha = fminf(fmaxf(0.5f - distance, 0), 1);
+      row[x] = ((Uint32)lrintf(alpha * 255) << 24) | 0x00FFFFFF;
+    }
+  }
+  return surface;
+}
+
+// allocs memory
+SdfFont *sdf_create(const char *font_path) {
+  TTF_Font *font = TTF_OpenFont(font_path, SDF_FONT_SIZE);
+  if (font == NULL) {
+    fprintf(stderr, "failed to load sdf font: %s\n", TTF_GetError());
+    return NULL;
+  }
+  SdfFont *sdf = calloc(1, sizeof(SdfFont));
+  sdf->font = font;
+  sdf->line_height = gt(TTF_FontHeight(font), 1);
+  sdf_grow(sdf);
+  return sdf;
+}
+
+// frees memory
+void sdf_free(SdfFont *sdf) {
+  if (sdf == NULL) {
+    return;
+  }
+  for (int i = 0; i < sdf->glyphs_cap; i += 1) {
+    if (sdf->glyphs[i].field != NULL) {
+      free(sdf->glyphs[i].field);
+    }
+  }
+  free(sdf->glyphs);
+  TTF_CloseFont(sdf->font);
+  free(sdf);
+}
+
+void print_sdf_stats(SdfFont *sdf) {
+  if (sdf == NULL) {
+    return;
+  }
+  printf("[STATS]: sdf: %d glyphs rasterized once at %dpx, "
+         "%ld coverage conversions\n",
+         sdf->glyphs_count, SDF_FONT_SIZE, sdf->conversions);
+}
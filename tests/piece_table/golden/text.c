@@ -0,0 +1,5 @@
+insert: 53/53 ok
+delete: 44/44 ok
+read: 44/44 ok
+update: 61/61 ok
+lines: 158/158 ok
@@ -0,0 +1,10 @@
+// c-style line comment
+/*
+c-style block comment
+*/
+/* c-style block comment */
+// c-style line comment with NOTE: comment keyword
+/*
+c-style block comment with NOTE: comment keyword
+*/
+// c-style line comment: it's having a english sentence
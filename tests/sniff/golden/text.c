@@ -0,0 +1 @@
+FILE_KIND_TEXT
@@ -30,8 +30,15 @@ typedef struct {
   char *v;
   int vlen;
   int s_until;
+  int offset; // NOTE: byte offset of the token in contents
 } Token;
 
+// token_bytes returns the length of the token in contents,
+// tabs are expanded in v
+int token_bytes(Token *token) {
+  return token->t == TOKEN_TABS ? token->vlen / TAB_WIDTH : token->vlen;
+}
+
 typedef struct {
   const char **code_keywords;
   int code_keywords_count;
@@ -429,6 +436,7 @@ Token **tokenize(char *contents, int contents_length,
       memcpy(token->v, contents + prev_offset, vlen);
     }
 
+    token->offset = prev_offset;
     tokens[*tokens_count] = token;
     *tokens_count += 1;
 
@@ -494,6 +502,7 @@ Token **tokenize(char *contents, int contents_length,
     eof_token->v = v;
     eof_token->vlen = 1;
     eof_token->t = TOKEN_NEWLINE;
+    eof_token->offset = contents_length;
     tokens[*tokens_count] = eof_token;
     *tokens_count += 1;
   }
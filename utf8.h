@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+
+bool is_utf8_continuation(unsigned char c) { return (c & 0xC0) == 0x80; }
+
+// utf8_decode decodes one codepoint from s into codepoint
+// and returns the number of bytes it took.
+// returns 0 if the sequence is invalid or truncated.
+int utf8_decode(const char *s, int len, int *codepoint) {
+  if (s == NULL || len <= 0) {
+    return 0;
+  }
+  const unsigned char *u = (const unsigned char *)s;
+  int seq_len = 0;
+  int cp = 0;
+  if (u[0] < 0x80) {
+    seq_len = 1;
+    cp = u[0];
+  } else if ((u[0] & 0xE0) == 0xC0) {
+    seq_len = 2;
+    cp = u[0] & 0x1F;
+  } else if ((u[0] & 0xF0) == 0xE0) {
+    seq_len = 3;
+    cp = u[0] & 0x0F;
+  } else if ((u[0] & 0xF8) == 0xF0) {
+    seq_len = 4;
+    cp = u[0] & 0x07;
+  } else {
+    return 0;
+  }
+  if (seq_len > len) {
+    return 0;
+  }
+  for (int i = 1; i < seq_len; i += 1) {
+    if (!is_utf8_continuation(u[i])) {
+      return 0;
+    }
+    cp = (cp << 6) | (u[i] & 0x3F);
+  }
+  // NOTE: reject overlong encodings and surrogates
+  if ((seq_len == 2 && cp < 0x80) || (seq_len == 3 && cp < 0x800) ||
+      (seq_len == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+      (0xD800 <= cp && cp <= 0xDFFF)) {
+    return 0;
+  }
+  if (codepoint != NULL) {
+    *codepoint = cp;
+  }
+  return seq_len;
+}
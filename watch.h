@@ -0,0 +1,181 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "file_contents.h"
+
+// NOTE: file watch wakes the main loop with a WATCH_EVENT when the file
+// changes, so the main loop doesn't have to poll the file.
+// On linux the directory of the file is watched with inotify (editors
+// often replace the file instead of writing it), elsewhere the watch
+// thread checks the modification time every WATCH_POLL_DELAY.
+
+#define WATCH_POLL_DELAY 1000 // in milliseconds
+#define WATCH_BUF_SIZE 4096
+
+Uint32 WATCH_EVENT = (Uint32)-1; // NOTE: registered in gui_loop
+
+typedef struct {
+  SDL_Thread *thread;
+  char *filename;
+  char *basename;
+  int fd; // NOTE: inotify fd, -1 when polling
+  int quit_pipe[2];
+  SDL_atomic_t pending; // NOTE: set until main loop handles the event
+  time_t last_modified;
+} FileWatch;
+
+// watch_notify pushes a WATCH_EVENT, unless one is already pending
+void watch_notify(FileWatch *watch) {
+  if (!SDL_AtomicCAS(&watch->pending, 0, 1)) {
+    return;
+  }
+  SDL_Event event = {.type = WATCH_EVENT};
+  if (SDL_PushEvent(&event) < 0) {
+    SDL_AtomicSet(&watch->pending, 0);
+  }
+}
+
+// watch_is_changed reads pending inotify events of the watched directory
+// or checks the modification time when polling
+bool watch_is_changed(FileWatch *watch) {
+#ifdef __linux__
+  if (watch->fd >= 0) {
+    char buf[WATCH_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(watch->fd, buf, sizeof(buf));
+    bool is_changed = false;
+    for (char *ptr = buf; ptr < buf + len;) {
+      struct inotify_event *event = (struct inotify_event *)ptr;
+      if (event->len > 0 && strcmp(event->name, watch->basename) == 0) {
+        is_changed = true;
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+    return is_changed;
+  }
+#endif
+  if (!file_exists(watch->filename) ||
+      !_is_updated(watch->filename, &watch->last_modified)) {
+    return false;
+  }
+  watch->last_modified = get_last_modified(watch->filename);
+  return true;
+}
+
+int watch_run(void *data) {
+  FileWatch *watch = data;
+  struct pollfd fds[2] = {
+      {.fd = watch->quit_pipe[0], .events = POLLIN},
+      {.fd = watch->fd, .events = POLLIN},
+  };
+  int fds_count = watch->fd >= 0 ? 2 : 1;
+  int timeout = watch->fd >= 0 ? -1 : WATCH_POLL_DELAY;
+
+  while (true) {
+    int ready = poll(fds, fds_count, timeout);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ready < 0 || fds[0].revents != 0) {
+      break;
+    }
+    if ((fds_count == 1 || fds[1].revents != 0) && watch_is_changed(watch)) {
+      watch_notify(watch);
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+// frees memory
+void watch_stop(FileWatch *watch) {
+  if (watch == NULL) {
+    return;
+  }
+  if (watch->thread != NULL) {
+    if (write(watch->quit_pipe[1], "q", 1) < 0) {
+      fprintf(stderr, "failed to stop watch thread: %s\n", strerror(errno));
+    }
+    SDL_WaitThread(watch->thread, NULL);
+  }
+  if (watch->fd >= 0) {
+    close(watch->fd);
+  }
+  close(watch->quit_pipe[0]);
+  close(watch->quit_pipe[1]);
+  free(watch->filename);
+  free(watch);
+}
+
+// watch_start starts watching the file.
+// returns NULL if the file can't be watched, then the caller polls it.
+// allocs memory
+FileWatch *watch_start(char *filename) {
+  if (WATCH_EVENT == (Uint32)-1) {
+    return NULL;
+  }
+  FileWatch *watch = calloc(1, sizeof(FileWatch));
+  if (pipe(watch->quit_pipe) < 0) {
+    fprintf(stderr, "failed to create watch pipe: %s\n", strerror(errno));
+    free(watch);
+    return NULL;
+  }
+  watch->filename = strdup(filename);
+  char *slash = strrchr(watch->filename, '/');
+  watch->basename = slash != NULL ? slash + 1 : watch->filename;
+  watch->last_modified = get_last_modified(filename);
+  watch->fd = -1;
+
+#ifdef __linux__
+  // NOTE: basename is cut off from the copy to get the directory
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->fd >= 0) {
+    char *dir = ".";
+    if (slash == watch->filename) {
+      dir = "/";
+    } else if (slash != NULL) {
+      *slash = '\0';
+      dir = watch->filename;
+    }
+    int wd = inotify_add_watch(watch->fd, dir,
+                               IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO |
+                                   IN_CREATE | IN_ATTRIB);
+    if (slash != NULL) {
+      *slash = '/';
+    }
+    if (wd < 0) {
+      fprintf(stdout, "[WARNING]: failed to watch '%s': %s, polling\n", dir,
+              strerror(errno));
+      close(watch->fd);
+      watch->fd = -1;
+    }
+  }
+#endif
+
+  watch->thread = SDL_CreateThread(watch_run, "watch", watch);
+  if (watch->thread == NULL) {
+    fprintf(stderr, "failed to create watch thread: %s\n", SDL_GetError());
+    watch_stop(watch);
+    return NULL;
+  }
+  return watch;
+}
+
+// watch_handled re-arms the watch, call it before reading the file
+void watch_handled(FileWatch *watch) {
+  if (watch != NULL) {
+    SDL_AtomicSet(&watch->pending, 0);
+  }
+}